@@ -0,0 +1,227 @@
+#include "usbus.h"
+#include "clock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Completion dispatch cost as the number of open devices grows, from 1 to
+ * MAX_DEVICES emulated devices in one context. Results are written to
+ * stdout as JSON.
+ *
+ * all_ready keeps a transfer in flight on every device, and reports the
+ * cost per completion. one_ready parks an interrupt IN transfer on every
+ * device, as a rig of mostly idle devices would, while transfers complete
+ * on just one of them - that cost should not depend on how many are open.
+ */
+
+#define MAX_DEVICES         512
+#define SAMPLES             5
+#define SAMPLE_COMPLETIONS  200000
+
+struct Bench {
+    UsbusDevice *device;
+    struct UsbusTransfer *active;       // on the source endpoint
+    struct UsbusTransfer *parked;       // on the interrupt endpoint, never completes
+    uint8_t buf[64];
+    uint8_t parkedBuf[8];
+};
+
+static void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose);
+static void onComplete(struct UsbusTransfer *t, enum UsbusStatus s);
+static uint64_t runAllReady(unsigned numDevices, unsigned *completions);
+static uint64_t runOneReady(unsigned numDevices, unsigned *completions);
+static void report(const char *name, unsigned numDevices, uint64_t (*fn)(unsigned, unsigned*));
+
+static struct Bench gBenches[MAX_DEVICES];
+static unsigned gNumDevices;
+static unsigned gCompleted;
+static unsigned gErrors;
+static int gFirstResult = 1;
+
+int main(int argc, char **argv)
+{
+    (void)argv;
+
+    if (argc > 1) {
+        fprintf(stderr, "usage: dispatchbench\n");
+        return -1;
+    }
+
+    static const struct UsbusEmuEndpoint endpoints[] = {
+        { 0x81, UsbusTransferBulk, 64, UsbusEmuSource, 0 },
+        { 0x82, UsbusTransferInterrupt, 8, UsbusEmuLoopback, 0 },   // nothing loops back to it
+    };
+
+    usbusSetPlatform(0, UsbusPlatformEmulated);
+
+    unsigned i;
+    for (i = 0; i < MAX_DEVICES; ++i) {
+        struct UsbusEmuDeviceConfig cfg;
+        memset(&cfg, 0, sizeof cfg);
+        cfg.descriptor.idVendor = 0x1209;
+        cfg.descriptor.idProduct = 0x0001;
+        cfg.speed = UsbusHighSpeed;
+        cfg.endpoints = endpoints;
+        cfg.numEndpoints = sizeof endpoints / sizeof endpoints[0];
+        usbusEmuAddDevice(0, &cfg);
+    }
+
+    // devices are found now, but only opened as each run needs them
+    usbusListen(0, onDeviceConnected, 0);
+    if (gNumDevices != MAX_DEVICES) {
+        fprintf(stderr, "only found %u of %u devices\n", gNumDevices, MAX_DEVICES);
+        return -1;
+    }
+
+    printf("{\n  \"platform\": \"emulated\",\n  \"results\": [");
+
+    unsigned numOpen = 0;
+    unsigned n;
+    for (n = 1; n <= MAX_DEVICES; n *= 2) {
+
+        for (; numOpen < n; ++numOpen) {
+            struct Bench *b = &gBenches[numOpen];
+            if (usbusOpen(b->device) != UsbusOK) {
+                fprintf(stderr, "failed to open device %u\n", numOpen);
+                return -1;
+            }
+            b->active = usbusAllocateTransfer();
+            b->parked = usbusAllocateTransfer();
+            usbusSetBulkTransferInfo(b->active, b->device, 0x81, b->buf, sizeof b->buf, onComplete, 0);
+            usbusSetBulkTransferInfo(b->parked, b->device, 0x82, b->parkedBuf, sizeof b->parkedBuf, onComplete, 0);
+            b->parked->type = UsbusTransferInterrupt;
+        }
+
+        report("all_ready", n, runAllReady);
+        report("one_ready", n, runOneReady);
+    }
+
+    printf("\n  ]\n}\n");
+
+    for (i = 0; i < gNumDevices; ++i) {
+        usbusClose(gBenches[i].device);
+        usbusDispose(gBenches[i].device);
+    }
+    usbusStopListen(0);
+    return gErrors ? -1 : 0;
+}
+
+void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose)
+{
+    if (gNumDevices < MAX_DEVICES) {
+        *dispose = 0;
+        gBenches[gNumDevices++].device = d;
+    }
+}
+
+void onComplete(struct UsbusTransfer *t, enum UsbusStatus s)
+{
+    (void)t;
+    if (s != UsbusComplete) {
+        gErrors++;
+    }
+    gCompleted++;
+}
+
+static uint64_t runAllReady(unsigned numDevices, unsigned *completions)
+{
+    /*
+     * A transfer on every device, then process until they've all
+     * completed - repeated until there's been enough of them.
+     */
+
+    unsigned rounds = SAMPLE_COMPLETIONS / numDevices;
+    if (rounds == 0) {
+        rounds = 1;
+    }
+
+    gCompleted = 0;
+    uint64_t start = monotonicNanos();
+
+    unsigned r, i;
+    for (r = 0; r < rounds; ++r) {
+        unsigned target = gCompleted + numDevices;
+        for (i = 0; i < numDevices; ++i) {
+            if (usbusSubmitTransfer(gBenches[i].active) != UsbusOK) {
+                gErrors++;
+                target--;
+            }
+        }
+        while (gCompleted < target) {
+            usbusProcessEvents(0, 0);
+        }
+    }
+
+    *completions = gCompleted;
+    return monotonicNanos() - start;
+}
+
+static uint64_t runOneReady(unsigned numDevices, unsigned *completions)
+{
+    /*
+     * Park a transfer on every device's interrupt endpoint, then submit
+     * and complete transfers one at a time on the first device only.
+     */
+
+    unsigned i;
+    for (i = 0; i < numDevices; ++i) {
+        if (usbusSubmitTransfer(gBenches[i].parked) != UsbusOK) {
+            gErrors++;
+        }
+    }
+
+    gCompleted = 0;
+    uint64_t start = monotonicNanos();
+
+    for (i = 0; i < SAMPLE_COMPLETIONS; ++i) {
+        if (usbusSubmitTransfer(gBenches[0].active) != UsbusOK) {
+            gErrors++;
+            break;
+        }
+        while (gCompleted <= i) {
+            usbusProcessEvents(0, 0);
+        }
+    }
+
+    uint64_t elapsed = monotonicNanos() - start;
+    *completions = gCompleted;
+
+    // the parked transfers complete as canceled, which isn't an error here
+    unsigned errors = gErrors;
+    for (i = 0; i < numDevices; ++i) {
+        usbusCancelTransfer(gBenches[i].parked);
+    }
+    unsigned target = gCompleted + numDevices;
+    while (gCompleted < target) {
+        usbusProcessEvents(0, 0);
+    }
+    gErrors = errors;
+
+    return elapsed;
+}
+
+static void report(const char *name, unsigned numDevices, uint64_t (*fn)(unsigned, unsigned*))
+{
+    /*
+     * Best of SAMPLES runs, in nanoseconds per completion.
+     */
+
+    double best = 0;
+    unsigned completions = 0;
+
+    unsigned i;
+    for (i = 0; i < SAMPLES; ++i) {
+        uint64_t elapsed = fn(numDevices, &completions);
+        double perCompletion = completions ? (double)elapsed / completions : 0;
+        if (i == 0 || perCompletion < best) {
+            best = perCompletion;
+        }
+    }
+
+    printf("%s\n    { \"name\": \"%s\", \"devices\": %u, \"completions\": %u, \"nanosPerCompletion\": %.1f, \"ok\": %s }",
+           gFirstResult ? "" : ",", name, numDevices, completions, best, gErrors ? "false" : "true");
+    fflush(stdout);
+    gFirstResult = 0;
+}
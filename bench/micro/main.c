@@ -0,0 +1,307 @@
+#include "usbus.h"
+#include "clock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Microbenchmarks for the paths that run per device during enumeration:
+ * string descriptor conversion, configuration descriptor parsing and
+ * lookups, endpoint resolution, and device allocation.
+ *
+ * Each runs against emulated devices serving descriptor sets of common
+ * real devices, and reports nanoseconds per operation as JSON - the
+ * minimum and median of several samples, each long enough to swamp timer
+ * resolution.
+ */
+
+#define SAMPLES             7
+#define SAMPLE_NANOS        20000000
+
+struct CannedDevice {
+    const char *name;
+    struct UsbusDeviceDescriptor descriptor;
+    const uint8_t *config;
+    unsigned configLen;
+    const char *strings[3];
+};
+
+// FTDI FT232R USB UART - vendor specific, a bulk pair
+static const uint8_t ft232rConfig[] = {
+    0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0xa0, 0x2d,
+    0x09, 0x04, 0x00, 0x00, 0x02, 0xff, 0xff, 0xff, 0x02,
+    0x07, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00,
+    0x07, 0x05, 0x02, 0x02, 0x40, 0x00, 0x00,
+};
+
+// STM32 virtual COM port - CDC ACM, with class specific functional descriptors
+static const uint8_t cdcAcmConfig[] = {
+    0x09, 0x02, 0x43, 0x00, 0x02, 0x01, 0x00, 0xc0, 0x32,
+    0x09, 0x04, 0x00, 0x00, 0x01, 0x02, 0x02, 0x01, 0x00,
+    0x05, 0x24, 0x00, 0x10, 0x01,
+    0x05, 0x24, 0x01, 0x00, 0x01,
+    0x04, 0x24, 0x02, 0x02,
+    0x05, 0x24, 0x06, 0x00, 0x01,
+    0x07, 0x05, 0x82, 0x03, 0x08, 0x00, 0x10,
+    0x09, 0x04, 0x01, 0x00, 0x02, 0x0a, 0x00, 0x00, 0x00,
+    0x07, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00,
+    0x07, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00,
+};
+
+// keyboard + mouse receiver - two HID interfaces
+static const uint8_t hidComboConfig[] = {
+    0x09, 0x02, 0x3b, 0x00, 0x02, 0x01, 0x00, 0xa0, 0x31,
+    0x09, 0x04, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01, 0x00,
+    0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x3b, 0x00,
+    0x07, 0x05, 0x81, 0x03, 0x08, 0x00, 0x0a,
+    0x09, 0x04, 0x01, 0x00, 0x01, 0x03, 0x01, 0x02, 0x00,
+    0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x34, 0x00,
+    0x07, 0x05, 0x82, 0x03, 0x08, 0x00, 0x0a,
+};
+
+static const struct CannedDevice canned[] = {
+    { "ft232r",
+      { 0x12, 0x01, 0x0200, 0x00, 0x00, 0x00, 0x08, 0x0403, 0x6001, 0x0600, 1, 2, 3, 1 },
+      ft232rConfig, sizeof ft232rConfig,
+      { "FTDI", "FT232R USB UART", "A50285BI" } },
+    { "cdc_acm",
+      { 0x12, 0x01, 0x0200, 0x02, 0x00, 0x00, 0x40, 0x0483, 0x5740, 0x0200, 1, 2, 3, 1 },
+      cdcAcmConfig, sizeof cdcAcmConfig,
+      { "STMicroelectronics", "STM32 Virtual ComPort", "6D8F1B5A4E55" } },
+    { "hid_combo",
+      { 0x12, 0x01, 0x0200, 0x00, 0x00, 0x00, 0x08, 0x046d, 0xc52b, 0x1201, 1, 2, 0, 1 },
+      hidComboConfig, sizeof hidComboConfig,
+      { "Logitech", "USB Receiver", 0 } },
+};
+
+#define NUM_CANNED (sizeof canned / sizeof canned[0])
+
+// internal - see src/usbus_private.h
+UsbusDevice *allocateDevice();
+
+typedef void (*BenchFunc)(UsbusDevice *d, unsigned iterations);
+
+static void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose);
+static void run(const char *name, const char *device, BenchFunc fn, UsbusDevice *d);
+static void benchStringAscii(UsbusDevice *d, unsigned iterations);
+static void benchOpenClose(UsbusDevice *d, unsigned iterations);
+static void benchDescriptorWalk(UsbusDevice *d, unsigned iterations);
+static void benchInterfaceLookup(UsbusDevice *d, unsigned iterations);
+static void benchEndpointResolve(UsbusDevice *d, unsigned iterations);
+static void benchAllocDispose(UsbusDevice *d, unsigned iterations);
+static int compareU64(const void *a, const void *b);
+
+static UsbusDevice *gDevices[NUM_CANNED];
+static unsigned gNumDevices;
+static volatile unsigned gSink;     // keeps results live, so loops aren't optimized away
+
+int main()
+{
+    usbusSetPlatform(0, UsbusPlatformEmulated);
+
+    unsigned i;
+    for (i = 0; i < NUM_CANNED; ++i) {
+        struct UsbusEmuDeviceConfig cfg;
+        memset(&cfg, 0, sizeof cfg);
+        cfg.descriptor = canned[i].descriptor;
+        cfg.speed = UsbusFullSpeed;
+        cfg.configDescriptors = canned[i].config;
+        cfg.configDescriptorsLen = canned[i].configLen;
+        cfg.strings = canned[i].strings;
+        cfg.numStrings = canned[i].strings[2] ? 3 : 2;
+        usbusEmuAddDevice(0, &cfg);
+    }
+
+    usbusListen(0, onDeviceConnected, 0);
+    if (gNumDevices != NUM_CANNED) {
+        fprintf(stderr, "only found %u of %u devices\n", gNumDevices, (unsigned)NUM_CANNED);
+        return -1;
+    }
+
+    printf("{\n  \"results\": [");
+
+    for (i = 0; i < NUM_CANNED; ++i) {
+        run("string_ascii", canned[i].name, benchStringAscii, gDevices[i]);
+        run("open_close", canned[i].name, benchOpenClose, gDevices[i]);
+        run("descriptor_walk", canned[i].name, benchDescriptorWalk, gDevices[i]);
+        run("interface_lookup", canned[i].name, benchInterfaceLookup, gDevices[i]);
+        run("endpoint_resolve", canned[i].name, benchEndpointResolve, gDevices[i]);
+    }
+    run("device_alloc_dispose", "none", benchAllocDispose, 0);
+
+    printf("\n  ]\n}\n");
+
+    for (i = 0; i < gNumDevices; ++i) {
+        usbusClose(gDevices[i]);
+        usbusDispose(gDevices[i]);
+    }
+    usbusStopListen(0);
+    return 0;
+}
+
+void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose)
+{
+    if (gNumDevices < NUM_CANNED && usbusOpen(d) == UsbusOK) {
+        *dispose = 0;
+        gDevices[gNumDevices++] = d;
+    }
+}
+
+static void run(const char *name, const char *device, BenchFunc fn, UsbusDevice *d)
+{
+    /*
+     * Find an iteration count that takes at least SAMPLE_NANOS,
+     * then time SAMPLES runs of it.
+     */
+
+    static int first = 1;
+
+    unsigned iterations = 1;
+    for (;;) {
+        uint64_t start = monotonicNanos();
+        fn(d, iterations);
+        if (monotonicNanos() - start >= SAMPLE_NANOS || iterations >= (1u << 30)) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    uint64_t samples[SAMPLES];
+    unsigned i;
+    for (i = 0; i < SAMPLES; ++i) {
+        uint64_t start = monotonicNanos();
+        fn(d, iterations);
+        samples[i] = monotonicNanos() - start;
+    }
+    qsort(samples, SAMPLES, sizeof samples[0], compareU64);
+
+    printf("%s\n    { \"name\": \"%s\", \"device\": \"%s\", \"iterations\": %u, "
+           "\"nanosPerOpMin\": %.2f, \"nanosPerOpMedian\": %.2f }",
+           first ? "" : ",", name, device, iterations,
+           (double)samples[0] / iterations, (double)samples[SAMPLES / 2] / iterations);
+    fflush(stdout);
+    first = 0;
+}
+
+static void benchStringAscii(UsbusDevice *d, unsigned iterations)
+{
+    // the product string - served from the string cache after the first read
+    char buf[128];
+    unsigned i, n = 0;
+    for (i = 0; i < iterations; ++i) {
+        usbusGetStringDescriptorAscii(d, 2, 0, buf, sizeof buf, &n);
+    }
+    gSink += n;
+}
+
+static void benchOpenClose(UsbusDevice *d, unsigned iterations)
+{
+    // parses the configuration descriptors into the device's descriptor tree
+    unsigned i;
+    for (i = 0; i < iterations; ++i) {
+        usbusClose(d);
+        gSink += usbusOpen(d);
+    }
+}
+
+static void benchDescriptorWalk(UsbusDevice *d, unsigned iterations)
+{
+    unsigned i, n = 0;
+    for (i = 0; i < iterations; ++i) {
+        struct UsbusDescriptorIter it;
+        if (usbusDescriptorIterBegin(d, 0, &it) == UsbusOK) {
+            const struct UsbusDescriptorHeader *h;
+            while ((h = usbusDescriptorIterNext(&it))) {
+                n += h->bDescriptorType;
+            }
+        }
+    }
+    gSink += n;
+}
+
+static void benchInterfaceLookup(UsbusDevice *d, unsigned iterations)
+{
+    /*
+     * Every interface and endpoint descriptor in turn, as a driver
+     * looking for its endpoints would.
+     */
+
+    struct UsbusConfigDescriptor cfg;
+    if (usbusGetConfigDescriptor(d, 0, &cfg) != UsbusOK) {
+        return;
+    }
+
+    unsigned i, n = 0;
+    for (i = 0; i < iterations; ++i) {
+        unsigned intf;
+        for (intf = 0; intf < cfg.bNumInterfaces; ++intf) {
+            struct UsbusInterfaceDescriptor id;
+            if (usbusGetInterfaceDescriptor(d, intf, 0, &id) != UsbusOK) {
+                continue;
+            }
+            unsigned ep;
+            for (ep = 0; ep < id.bNumEndpoints; ++ep) {
+                struct UsbusEndpointDescriptor ed;
+                if (usbusGetEndpointDescriptor(d, intf, ep, &ed) == UsbusOK) {
+                    n += ed.bEndpointAddress;
+                }
+            }
+        }
+    }
+    gSink += n;
+}
+
+static void benchEndpointResolve(UsbusDevice *d, unsigned iterations)
+{
+    /*
+     * Resolve each endpoint address in the configuration to its interface
+     * and pipe, cycling through them.
+     */
+
+    uint8_t addresses[32];
+    unsigned numAddresses = 0;
+
+    struct UsbusDescriptorIter it;
+    if (usbusDescriptorIterBegin(d, 0, &it) != UsbusOK) {
+        return;
+    }
+    const struct UsbusDescriptorHeader *h;
+    while ((h = usbusDescriptorIterNext(&it)) && numAddresses < sizeof addresses) {
+        if (h->bDescriptorType == UsbusDescriptorEndpoint) {
+            addresses[numAddresses++] = ((const struct UsbusEndpointDescriptorView*)h)->bEndpointAddress;
+        }
+    }
+    if (numAddresses == 0) {
+        return;
+    }
+
+    unsigned i, n = 0;
+    for (i = 0; i < iterations; ++i) {
+        struct UsbusEndpoint *e = usbusOpenEndpoint(d, addresses[i % numAddresses]);
+        if (e) {
+            n++;
+            usbusCloseEndpoint(e);
+        }
+    }
+    gSink += n;
+}
+
+static void benchAllocDispose(UsbusDevice *d, unsigned iterations)
+{
+    (void)d;
+
+    unsigned i;
+    for (i = 0; i < iterations; ++i) {
+        UsbusDevice *dev = allocateDevice();
+        gSink += dev != 0;
+        usbusDispose(dev);
+    }
+}
+
+static int compareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
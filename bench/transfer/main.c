@@ -0,0 +1,390 @@
+#include "usbus.h"
+#include "clock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Transfer benchmarks: bulk IN/OUT throughput, ping-pong round trip
+ * latency, per-transfer submit/complete overhead, and throughput as queue
+ * depth grows. Results are written to stdout as JSON, so runs from
+ * different library versions can be compared.
+ *
+ * With no arguments, runs against an emulated device, which measures the
+ * library's own overhead. Given a device, runs against real hardware -
+ * ping-pong expects it to echo OUT packets back on the IN endpoint, as
+ * for example/echo.
+ */
+
+#define MAX_DEPTH   64
+#define PING_PONG_TIMEOUT_MILLIS    1000    // a round trip that takes longer counts as an error
+
+struct Target {
+    const char *platform;
+    uint8_t inEP;               // for IN throughput
+    uint8_t outEP;              // for OUT throughput
+    uint8_t echoIn;             // ping-pong pair
+    uint8_t echoOut;
+};
+
+struct Run {
+    uint64_t deadline;          // stop resubmitting once passed
+    uint64_t active;            // bit per transfers[] slot still in flight
+    uint8_t canceled;           // outstanding transfers were canceled at the deadline
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t passes;            // usbusProcessEvents() calls
+    unsigned inFlight;
+    unsigned errors;
+    struct UsbusTransfer *completed[MAX_DEPTH]; // to resubmit after the current pass
+    unsigned numCompleted;
+};
+
+struct Slot {
+    struct Run *run;
+    unsigned index;             // into transfers[], for Run.active
+};
+
+static void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose);
+static int runThroughput(uint8_t ep, unsigned size, unsigned depth, unsigned millis, struct Run *run, uint64_t *elapsed);
+static void onThroughputComplete(struct UsbusTransfer *t, enum UsbusStatus s);
+static void benchThroughput(const char *name, uint8_t ep, unsigned size, unsigned depth, unsigned millis);
+static void benchOverhead(uint8_t ep, unsigned count);
+static void benchPingPong(uint8_t inEP, uint8_t outEP, unsigned size, unsigned count);
+static void onPingPongComplete(struct UsbusTransfer *t, enum UsbusStatus s);
+static int compareU64(const void *a, const void *b);
+static void beginResult(const char *name);
+
+static UsbusDevice *gDevice = 0;
+static int gFirstResult = 1;
+
+int main(int argc, char **argv)
+{
+    struct Target target;
+    unsigned millis = 1000;
+
+    if (argc >= 5) {
+        struct UsbusDeviceId id;
+        id.idVendor = (uint16_t)strtol(argv[1], 0, 0);
+        id.idProduct = (uint16_t)strtol(argv[2], 0, 0);
+
+        struct UsbusMatchFilter filter;
+        memset(&filter, 0, sizeof filter);
+        filter.ids = &id;
+        filter.numIds = 1;
+        usbusSetMatchFilter(0, &filter);
+
+        target.platform = "native";
+        target.inEP = target.echoIn = (uint8_t)strtol(argv[3], 0, 0);
+        target.outEP = target.echoOut = (uint8_t)strtol(argv[4], 0, 0);
+        if (argc >= 6) {
+            millis = strtol(argv[5], 0, 0);
+        }
+
+    } else if (argc <= 2) {
+        static const struct UsbusEmuEndpoint endpoints[] = {
+            { 0x81, UsbusTransferBulk, 512, UsbusEmuSource, 0 },
+            { 0x02, UsbusTransferBulk, 512, UsbusEmuSink, 0 },
+            { 0x83, UsbusTransferBulk, 512, UsbusEmuLoopback, 0 },
+            { 0x03, UsbusTransferBulk, 512, UsbusEmuLoopback, 0 },
+        };
+
+        struct UsbusEmuDeviceConfig cfg;
+        memset(&cfg, 0, sizeof cfg);
+        cfg.descriptor.idVendor = 0x1209;
+        cfg.descriptor.idProduct = 0x0001;
+        cfg.speed = UsbusHighSpeed;
+        cfg.endpoints = endpoints;
+        cfg.numEndpoints = sizeof endpoints / sizeof endpoints[0];
+
+        usbusSetPlatform(0, UsbusPlatformEmulated);
+        usbusEmuAddDevice(0, &cfg);
+
+        target.platform = "emulated";
+        target.inEP = 0x81;
+        target.outEP = 0x02;
+        target.echoIn = 0x83;
+        target.echoOut = 0x03;
+        if (argc == 2) {
+            millis = strtol(argv[1], 0, 0);
+        }
+
+    } else {
+        fprintf(stderr, "usage: bench [millis per test]\n"
+                        "       bench <vid> <pid> <IN ep> <OUT ep> [millis per test]\n");
+        return -1;
+    }
+
+    usbusListen(0, onDeviceConnected, 0);
+    if (!gDevice) {
+        fprintf(stderr, "didn't find device\n");
+        return -1;
+    }
+
+    printf("{\n  \"platform\": \"%s\",\n  \"results\": [", target.platform);
+
+    benchThroughput("bulk_in_throughput", target.inEP, 16384, 8, millis);
+    benchThroughput("bulk_out_throughput", target.outEP, 16384, 8, millis);
+    benchPingPong(target.echoIn, target.echoOut, 64, 10000);
+    benchOverhead(target.inEP, 100000);
+
+    unsigned depth;
+    for (depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+        benchThroughput("queue_depth_scaling", target.inEP, 512, depth, millis / 4);
+    }
+
+    printf("\n  ]\n}\n");
+
+    usbusClose(gDevice);
+    usbusDispose(gDevice);
+    usbusStopListen(0);
+    return 0;
+}
+
+void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose)
+{
+    // the match filter, if any, has already picked out our device
+    if (!gDevice && usbusOpen(d) == UsbusOK && usbusOpenInterface(d, 0) == UsbusOK) {
+        *dispose = 0;
+        gDevice = d;
+    }
+}
+
+static int runThroughput(uint8_t ep, unsigned size, unsigned depth, unsigned millis, struct Run *run, uint64_t *elapsed)
+{
+    /*
+     * Keep `depth` transfers of `size` in flight for `millis`, then cancel
+     * whichever are still outstanding and wait for them to come back.
+     *
+     * Completed transfers are resubmitted from the event loop rather than
+     * their callback, so each one goes through a whole submit, process and
+     * return cycle - including the op draining and timers in between.
+     */
+
+    static struct UsbusTransfer *transfers[MAX_DEPTH];
+    static struct Slot slots[MAX_DEPTH];
+    static uint8_t *buffers[MAX_DEPTH];
+    static unsigned bufferSize;
+
+    unsigned i;
+    if (size > bufferSize) {
+        for (i = 0; i < MAX_DEPTH; ++i) {
+            free(buffers[i]);
+            buffers[i] = malloc(size);
+            if (!buffers[i]) {
+                return -1;
+            }
+            memset(buffers[i], 0x55, size);
+        }
+        bufferSize = size;
+    }
+
+    memset(run, 0, sizeof *run);
+    uint64_t start = monotonicNanos();
+    run->deadline = start + (uint64_t)millis * 1000000;
+
+    for (i = 0; i < depth; ++i) {
+        if (!transfers[i]) {
+            transfers[i] = usbusAllocateTransfer();
+        }
+        slots[i].run = run;
+        slots[i].index = i;
+        usbusSetBulkTransferInfo(transfers[i], gDevice, ep, buffers[i], size, onThroughputComplete, &slots[i]);
+        if (usbusSubmitTransfer(transfers[i]) != UsbusOK) {
+            run->errors++;
+            break;
+        }
+        run->active |= 1ull << i;
+        run->inFlight++;
+    }
+
+    while (run->inFlight > 0) {
+        usbusProcessEvents(0, 10);
+        run->passes++;
+
+        int stop = monotonicNanos() >= run->deadline;
+        for (i = 0; i < run->numCompleted; ++i) {
+            struct UsbusTransfer *t = run->completed[i];
+            if (stop || usbusSubmitTransfer(t) != UsbusOK) {
+                run->active &= ~(1ull << ((struct Slot*)t->userData)->index);
+                run->inFlight--;
+            }
+        }
+        run->numCompleted = 0;
+
+        // a device that stops responding mustn't hold up the results
+        if (stop && !run->canceled) {
+            run->canceled = 1;
+            for (i = 0; i < depth; ++i) {
+                if ((run->active & (1ull << i)) && usbusCancelTransfer(transfers[i]) != UsbusOK) {
+                    // no completion to wait for, so give up on it
+                    run->active &= ~(1ull << i);
+                    run->inFlight--;
+                    run->errors++;
+                }
+            }
+        }
+    }
+
+    *elapsed = monotonicNanos() - start;
+    return run->errors ? -1 : 0;
+}
+
+void onThroughputComplete(struct UsbusTransfer *t, enum UsbusStatus s)
+{
+    struct Slot *slot = t->userData;
+    struct Run *run = slot->run;
+
+    if (s != UsbusComplete) {
+        if (s != UsbusCanceled || !run->canceled) {
+            run->errors++;
+        }
+        run->active &= ~(1ull << slot->index);
+        run->inFlight--;
+        return;
+    }
+
+    run->transfers++;
+    run->bytes += t->transferredlength;
+    run->completed[run->numCompleted++] = t;
+}
+
+static void benchThroughput(const char *name, uint8_t ep, unsigned size, unsigned depth, unsigned millis)
+{
+    struct Run run;
+    uint64_t elapsed;
+    int r = runThroughput(ep, size, depth, millis, &run, &elapsed);
+    double secs = elapsed / 1e9;
+
+    beginResult(name);
+    printf("\"endpoint\": %u, \"transferSize\": %u, \"queueDepth\": %u, \"seconds\": %.3f, "
+           "\"transfers\": %llu, \"passes\": %llu, \"bytesPerSec\": %.0f, \"transfersPerSec\": %.0f, \"errors\": %u, \"ok\": %s }",
+           ep, size, depth, secs, (unsigned long long)run.transfers, (unsigned long long)run.passes,
+           run.bytes / secs, run.transfers / secs, run.errors, r == 0 ? "true" : "false");
+}
+
+static void benchOverhead(uint8_t ep, unsigned count)
+{
+    /*
+     * One small transfer at a time, resubmitted after each pass - against
+     * the emulated device this is the library's fixed cost per transfer.
+     */
+
+    struct Run run;
+    uint64_t elapsed;
+
+    // runThroughput() stops on a deadline, so aim for `count` transfers from a short calibration run
+    runThroughput(ep, 8, 1, 50, &run, &elapsed);
+    unsigned millis = run.transfers ? (unsigned)((uint64_t)count * elapsed / run.transfers / 1000000) + 1 : 1000;
+
+    int r = runThroughput(ep, 8, 1, millis, &run, &elapsed);
+
+    beginResult("submit_complete_overhead");
+    printf("\"endpoint\": %u, \"transferSize\": 8, \"transfers\": %llu, \"nanosPerTransfer\": %.1f, \"ok\": %s }",
+           ep, (unsigned long long)run.transfers,
+           run.transfers ? (double)elapsed / run.transfers : 0.0, r == 0 ? "true" : "false");
+}
+
+struct PingPong {
+    uint64_t sentAt;
+    uint64_t *samples;
+    unsigned count;
+    unsigned done;
+    unsigned errors;
+    uint8_t waiting;
+    struct UsbusTransfer *out;
+};
+
+static void benchPingPong(uint8_t inEP, uint8_t outEP, unsigned size, unsigned count)
+{
+    /*
+     * Send a packet, and time how long until it comes back, one at a time.
+     */
+
+    struct PingPong pp;
+    memset(&pp, 0, sizeof pp);
+    pp.count = count;
+    pp.samples = malloc(count * sizeof *pp.samples);
+
+    static uint8_t outBuf[512], inBuf[512];
+    if (size > sizeof outBuf) {
+        size = sizeof outBuf;
+    }
+
+    struct UsbusTransfer *in = usbusAllocateTransfer();
+    pp.out = usbusAllocateTransfer();
+    usbusSetBulkTransferInfo(in, gDevice, inEP, inBuf, size, onPingPongComplete, &pp);
+    usbusSetBulkTransferInfo(pp.out, gDevice, outEP, outBuf, size, 0, 0);
+    in->timeout = PING_PONG_TIMEOUT_MILLIS;
+    pp.out->timeout = PING_PONG_TIMEOUT_MILLIS;
+
+    // poll the OUT side for completion rather than calling back, so only the IN side drives the loop
+    while (pp.samples && pp.done < count && !pp.errors) {
+        outBuf[0] = (uint8_t)pp.done;
+        pp.sentAt = monotonicNanos();
+        pp.waiting = 1;
+        if (usbusSubmitTransfer(in) != UsbusOK || usbusSubmitTransfer(pp.out) != UsbusOK) {
+            pp.errors++;
+            break;
+        }
+
+        struct UsbusCompletion c;
+        unsigned outDone = 0;
+        while (pp.waiting || !outDone) {
+            if (usbusPollCompletions(0, &c, 1, 10) == 1) {
+                outDone = 1;
+                if (c.status != UsbusComplete) {
+                    pp.errors++;
+                }
+            }
+        }
+    }
+
+    beginResult("ping_pong_latency");
+    printf("\"endpoints\": [%u, %u], \"transferSize\": %u, \"roundTrips\": %u, \"errors\": %u",
+           outEP, inEP, size, pp.done, pp.errors);
+
+    if (pp.done > 0) {
+        uint64_t total = 0;
+        unsigned i;
+        for (i = 0; i < pp.done; ++i) {
+            total += pp.samples[i];
+        }
+        qsort(pp.samples, pp.done, sizeof *pp.samples, compareU64);
+        printf(", \"micros\": { \"min\": %.2f, \"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f }",
+               pp.samples[0] / 1e3, (double)total / pp.done / 1e3, pp.samples[pp.done / 2] / 1e3,
+               pp.samples[(uint64_t)pp.done * 99 / 100] / 1e3, pp.samples[pp.done - 1] / 1e3);
+    }
+    printf(" }");
+
+    usbusReleaseTransfer(in);
+    usbusReleaseTransfer(pp.out);
+    free(pp.samples);
+}
+
+void onPingPongComplete(struct UsbusTransfer *t, enum UsbusStatus s)
+{
+    struct PingPong *pp = t->userData;
+    pp->waiting = 0;
+
+    if (s != UsbusComplete) {
+        pp->errors++;
+        return;
+    }
+    pp->samples[pp->done++] = monotonicNanos() - pp->sentAt;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void beginResult(const char *name)
+{
+    printf("%s\n    { \"name\": \"%s\", ", gFirstResult ? "" : ",", name);
+    gFirstResult = 0;
+    fflush(stdout);
+}
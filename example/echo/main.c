@@ -84,21 +84,18 @@ static void doEcho()
     static uint8_t OUTbuf[10];
 
     /*
-     * Submit several IN transfers, such that one is always pending to serve the next IN packet.
+     * Stream from the IN endpoint, such that several transfers are always pending to serve the next IN packet.
      * This helps keep latencies low, rather than waiting for a round trip.
      */
-    unsigned i;
-    for (i = 0; i < 10; ++i) {
-        struct UsbusTransfer *rx = usbusAllocateTransfer();
-        rx->buffer = malloc(sizeof(OUTbuf));
-        memset(rx->buffer, 0, sizeof OUTbuf);
-        usbusSetBulkTransferInfo(rx, gDevice, devInfo.inEP, rx->buffer, 10, onTransferComplete, 0);
-        usbusSubmitTransfer(rx);
+    struct UsbusStream *rx = usbusStreamIn(gDevice, devInfo.inEP, 10, sizeof(OUTbuf), 4096);
+    if (!rx) {
+        fprintf(stderr, "failed to start IN stream\n");
+        return;
     }
 
     struct UsbusTransfer *t = usbusAllocateTransfer();
 
-    while (usbusIsOpen(gDevice)) {
+    while (usbusIsOpen(gDevice) && usbusStreamStatus(rx) == UsbusOK) {
 
         /*
          * Send successive echo packets, as soon as the previous OUT packet has completed.
@@ -115,7 +112,21 @@ static void doEcho()
         }
 
         usbusProcessEvents(0, 0);
+
+        uint8_t INbuf[64];
+        unsigned n = usbusStreamRead(rx, INbuf, sizeof INbuf);
+        if (n > 0) {
+            printf("received %u bytes:", n);
+            unsigned i;
+            for (i = 0; i < n; ++i) {
+                printf(" %02x", INbuf[i]);
+            }
+            printf("\n");
+        }
     }
+
+    usbusStreamClose(rx);
+    usbusReleaseTransfer(t);
 }
 
 void onTransferComplete(struct UsbusTransfer *t, enum UsbusStatus s)
@@ -127,18 +138,5 @@ void onTransferComplete(struct UsbusTransfer *t, enum UsbusStatus s)
         return;
     }
 
-    if (usbusTransferIsIN(t)) {
-        unsigned i;
-        for (i = 0; i < t->transferredlength; ++i) {
-            printf("%02x ", t->buffer[i]);
-        }
-        printf("\n");
-
-        memset(t->buffer, 0, 10);
-        if (usbusSubmitTransfer(t) != UsbusOK) {
-            return;
-        }
-    } else {
-        outstandingTx--;
-    }
+    outstandingTx--;
 }
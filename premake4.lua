@@ -6,7 +6,7 @@ project "usbus"
     kind "StaticLib"
     language "C"
 
-    files "src/*.c"
+    files { "src/*.c", "src/platform/emulated.c" }
     includedirs { "src" }
 
     if os.is("macosx") then
@@ -15,6 +15,9 @@ project "usbus"
     elseif os.is("windows") then
         defines { "USBUS_PLATFORM_WIN" }
         files { "src/platform/winusb.c" }
+    elseif os.is("linux") then
+        defines { "USBUS_PLATFORM_LINUX" }
+        files { "src/platform/usbfs.c" }
     end
 
     configuration "Debug"
@@ -37,6 +40,8 @@ project "enumerator"
         links { "IOKit.framework", "CoreFoundation.framework" }
     elseif os.is("windows") then
         links { "setupapi", "winusb" }
+    elseif os.is("linux") then
+        links { "pthread" }
     end
 
 project "echo"
@@ -51,4 +56,70 @@ project "echo"
         links { "IOKit.framework", "CoreFoundation.framework" }
     elseif os.is("windows") then
         links { "setupapi", "winusb" }
+    elseif os.is("linux") then
+        links { "pthread" }
+    end
+
+project "bench"
+    kind "ConsoleApp"
+    language "C"
+    location "bench/transfer"
+
+    files { "bench/transfer/*.c" }
+    includedirs { "src" }
+    links { "usbus" }
+    if os.is("macosx") then
+        links { "IOKit.framework", "CoreFoundation.framework" }
+    elseif os.is("windows") then
+        links { "setupapi", "winusb" }
+    elseif os.is("linux") then
+        links { "pthread" }
+    end
+
+project "microbench"
+    kind "ConsoleApp"
+    language "C"
+    location "bench/micro"
+
+    files { "bench/micro/*.c" }
+    includedirs { "src" }
+    links { "usbus" }
+    if os.is("macosx") then
+        links { "IOKit.framework", "CoreFoundation.framework" }
+    elseif os.is("windows") then
+        links { "setupapi", "winusb" }
+    elseif os.is("linux") then
+        links { "pthread" }
+    end
+
+project "dispatchbench"
+    kind "ConsoleApp"
+    language "C"
+    location "bench/dispatch"
+
+    files { "bench/dispatch/*.c" }
+    includedirs { "src" }
+    links { "usbus" }
+    if os.is("macosx") then
+        links { "IOKit.framework", "CoreFoundation.framework" }
+    elseif os.is("windows") then
+        links { "setupapi", "winusb" }
+    elseif os.is("linux") then
+        links { "pthread" }
+    end
+
+project "descriptortest"
+    kind "ConsoleApp"
+    language "C"
+    location "test/descriptor"
+
+    files { "test/descriptor/*.c" }
+    includedirs { "src" }
+    links { "usbus" }
+    if os.is("macosx") then
+        links { "IOKit.framework", "CoreFoundation.framework" }
+    elseif os.is("windows") then
+        links { "setupapi", "winusb" }
+    elseif os.is("linux") then
+        links { "pthread" }
     end
@@ -0,0 +1,140 @@
+#ifndef _ATOMICS_H
+#define _ATOMICS_H
+
+#include <stdint.h>
+
+/*
+ * Minimal set of atomic operations used by the lock-free parts of the library.
+ * Loads are acquire, stores are release, and read-modify-write operations
+ * are sequentially consistent.
+ */
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+static inline uint32_t atomicLoad32(volatile uint32_t *p) {
+    uint32_t v = *p;
+    _ReadWriteBarrier();
+    return v;
+}
+
+static inline void atomicStore32(volatile uint32_t *p, uint32_t v) {
+    _ReadWriteBarrier();
+    *p = v;
+}
+
+static inline uint32_t atomicExchange32(volatile uint32_t *p, uint32_t v) {
+    return (uint32_t)_InterlockedExchange((volatile long*)p, (long)v);
+}
+
+static inline uint32_t atomicFetchAdd32(volatile uint32_t *p, uint32_t v) {
+    return (uint32_t)_InterlockedExchangeAdd((volatile long*)p, (long)v);
+}
+
+static inline int atomicCompareExchange32(volatile uint32_t *p, uint32_t *expected, uint32_t desired) {
+    uint32_t prev = (uint32_t)_InterlockedCompareExchange((volatile long*)p, (long)desired, (long)*expected);
+    if (prev == *expected) {
+        return 1;
+    }
+    *expected = prev;
+    return 0;
+}
+
+static inline uint64_t atomicLoad64(volatile uint64_t *p) {
+    // a no-op CAS gives us an atomic 64-bit read on 32-bit targets too
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64*)p, 0, 0);
+}
+
+static inline int atomicCompareExchange64(volatile uint64_t *p, uint64_t *expected, uint64_t desired) {
+    uint64_t prev = (uint64_t)_InterlockedCompareExchange64((volatile __int64*)p, (__int64)desired, (__int64)*expected);
+    if (prev == *expected) {
+        return 1;
+    }
+    *expected = prev;
+    return 0;
+}
+
+static inline void *atomicLoadPtr(void *volatile *p) {
+    void *v = *p;
+    _ReadWriteBarrier();
+    return v;
+}
+
+static inline void atomicStorePtr(void *volatile *p, void *v) {
+    _ReadWriteBarrier();
+    *p = v;
+}
+
+static inline void *atomicExchangePtr(void *volatile *p, void *v) {
+    return _InterlockedExchangePointer(p, v);
+}
+
+static inline int atomicCompareExchangePtr(void *volatile *p, void **expected, void *desired) {
+    void *prev = _InterlockedCompareExchangePointer(p, desired, *expected);
+    if (prev == *expected) {
+        return 1;
+    }
+    *expected = prev;
+    return 0;
+}
+
+static inline void cpuRelax() {
+    _mm_pause();
+}
+
+#else // gcc, clang
+
+static inline uint32_t atomicLoad32(volatile uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomicStore32(volatile uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t atomicExchange32(volatile uint32_t *p, uint32_t v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t atomicFetchAdd32(volatile uint32_t *p, uint32_t v) {
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomicCompareExchange32(volatile uint32_t *p, uint32_t *expected, uint32_t desired) {
+    return __atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t atomicLoad64(volatile uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline int atomicCompareExchange64(volatile uint64_t *p, uint64_t *expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE);
+}
+
+static inline void *atomicLoadPtr(void *volatile *p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomicStorePtr(void *volatile *p, void *v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline void *atomicExchangePtr(void *volatile *p, void *v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomicCompareExchangePtr(void *volatile *p, void **expected, void *desired) {
+    return __atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE);
+}
+
+static inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif
+
+#endif // _ATOMICS_H
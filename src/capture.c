@@ -0,0 +1,252 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "clock.h"
+#include "logger.h"
+#include "filering.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Packet capture, in the format Wireshark reads from Linux usbmon
+ * (LINKTYPE_USB_LINUX_MMAPPED, with its 64 byte header).
+ *
+ * The event thread formats each pcap record straight into a FileRing,
+ * and its writer thread copies whatever's accumulated out to the file.
+ * Records that don't fit are dropped rather than stalling I/O.
+ */
+
+#define PCAP_MAGIC                  0xa1b2c3d4
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+
+#if (USBUS_CAPTURE_RING_SIZE & (USBUS_CAPTURE_RING_SIZE - 1)) != 0
+#error USBUS_CAPTURE_RING_SIZE must be a power of 2
+#endif
+
+// Linux errno values, as usbmon reports them regardless of our platform
+#define LINUX_ENOENT        2
+#define LINUX_EIO           5
+#define LINUX_EINVAL        22
+#define LINUX_EPIPE         32
+#define LINUX_EPROTO        71
+#define LINUX_EOVERFLOW     75
+#define LINUX_ETIMEDOUT     110
+#define LINUX_EINPROGRESS   115
+
+struct PcapFileHeader {
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t thisZone;
+    uint32_t sigFigs;
+    uint32_t snapLength;
+    uint32_t linkType;
+};
+
+struct PcapRecordHeader {
+    uint32_t seconds;
+    uint32_t micros;
+    uint32_t capturedLength;
+    uint32_t length;
+};
+
+// struct usbmon_packet, see Documentation/usb/usbmon.rst in the Linux kernel
+struct UsbmonHeader {
+    uint64_t id;
+    uint8_t type;                       // 'S'ubmit, 'C'omplete or submission 'E'rror
+    uint8_t transferType;               // 0 iso, 1 interrupt, 2 control, 3 bulk
+    uint8_t endpoint;
+    uint8_t device;
+    uint16_t bus;
+    uint8_t flagSetup;                  // 0 if setup is valid
+    uint8_t flagData;                   // 0 if data follows
+    int64_t seconds;
+    int32_t micros;
+    int32_t status;
+    uint32_t length;
+    uint32_t capturedLength;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t startFrame;
+    uint32_t transferFlags;
+    uint32_t numIsoDescriptors;
+};
+
+typedef char usbmonHeaderIs64Bytes[sizeof(struct UsbmonHeader) == 64 ? 1 : -1];
+
+struct Capture {
+    struct FileRing out;
+    unsigned snapLength;
+    uint64_t epochOffset;               // realtime - monotonic, fixed at start
+};
+
+static int32_t usbmonStatus(int status);
+
+
+/**************
+ * API
+ **************/
+
+int usbusStartCapture(UsbusContext *ctx, const char *path, unsigned snapLength)
+{
+    /*
+     * Capture every transfer submitted and completed on `ctx` to a pcap
+     * file at `path`, keeping up to `snapLength` bytes of each payload
+     * (0 for headers only).
+     *
+     * Call from the thread processing events.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (c->capture) {
+        return UsbusBadParameter;
+    }
+
+    struct Capture *cap = calloc(1, sizeof *cap);
+    if (!cap) {
+        logerror("usbusStartCapture(): failed to malloc capture");
+        return -1;
+    }
+
+    // a record must always fit in the ring, however large the payload
+    unsigned maxSnap = USBUS_CAPTURE_RING_SIZE / 4;
+    cap->snapLength = snapLength < maxSnap ? snapLength : maxSnap;
+    cap->epochOffset = realtimeNanos() - monotonicNanos();
+
+    struct PcapFileHeader fh;
+    fh.magic = PCAP_MAGIC;
+    fh.versionMajor = 2;
+    fh.versionMinor = 4;
+    fh.thisZone = 0;
+    fh.sigFigs = 0;
+    fh.snapLength = sizeof(struct UsbmonHeader) + cap->snapLength;
+    fh.linkType = LINKTYPE_USB_LINUX_MMAPPED;
+
+    if (fileRingOpen(&cap->out, path, USBUS_CAPTURE_RING_SIZE, &fh, sizeof fh) != 0) {
+        logerror("usbusStartCapture(): failed to start capture");
+        free(cap);
+        return -1;
+    }
+
+    c->capture = cap;
+    return UsbusOK;
+}
+
+void usbusStopCapture(UsbusContext *ctx)
+{
+    /*
+     * Flush everything captured so far and close the file.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    struct Capture *cap = c->capture;
+
+    if (!cap) {
+        return;
+    }
+    c->capture = 0;
+
+    if (fileRingClose(&cap->out) != 0) {
+        logerror("usbusStopCapture(): failed to write capture");
+    }
+    if (cap->out.dropped) {
+        logwarn("usbusStopCapture(): capture ring full, dropped %u packets", cap->out.dropped);
+    }
+
+    free(cap);
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+void captureRecord(struct UsbusTransfer *t, char type, int status)
+{
+    /*
+     * Called via captureTransfer(), with `status` a UsbusStatus for
+     * completions. Submissions carry OUT data, completions carry IN data.
+     * For control transfers, the buffer starts with the setup packet, and
+     * transferredlength only counts the data stage after it.
+     */
+
+    struct Capture *cap = t->device->ctx->capture;
+
+    const uint8_t *data = t->buffer;
+    int length = type == 'C' ? t->transferredlength : t->requestedLength;
+
+    struct UsbusTransferPriv *tp = transferPriv(t);
+    struct UsbmonHeader h;
+    memset(&h, 0, sizeof h);
+
+    h.id = (uint64_t)(uintptr_t)tp;
+    h.type = (uint8_t)type;
+    h.endpoint = t->endpoint;
+    h.device = t->device->address;
+    h.bus = t->device->busNumber;
+    h.flagSetup = '-';
+
+    if (usbusTransferIsControl(t)) {
+        h.transferType = 2;
+        if (type == 'S') {
+            memcpy(h.setup, t->buffer, USBUS_CONTROL_SETUP_SIZE);
+            h.flagSetup = 0;
+        }
+        data += USBUS_CONTROL_SETUP_SIZE;
+        if (type != 'C') {
+            length -= USBUS_CONTROL_SETUP_SIZE;
+        }
+    } else {
+        switch (t->type) {
+        case UsbusTransferIsochronous:  h.transferType = 0; break;
+        case UsbusTransferInterrupt:    h.transferType = 1; break;
+        default:                        h.transferType = 3; break;
+        }
+    }
+
+    unsigned captured = 0;
+    int hasData = usbusTransferIsIN(t) ? type == 'C' : type == 'S';
+    if (hasData && length > 0) {
+        captured = (unsigned)length < cap->snapLength ? (unsigned)length : cap->snapLength;
+    }
+    h.flagData = captured ? 0 : usbusTransferIsIN(t) ? '<' : '>';
+
+    uint64_t now = monotonicNanos() + cap->epochOffset;
+    h.seconds = (int64_t)(now / 1000000000);
+    h.micros = (int32_t)(now % 1000000000 / 1000);
+    h.status = type == 'S' ? -LINUX_EINPROGRESS : type == 'E' ? -LINUX_EIO : usbmonStatus(status);
+    h.length = (uint32_t)length;
+    h.capturedLength = captured;
+
+    struct PcapRecordHeader rh;
+    rh.seconds = (uint32_t)h.seconds;
+    rh.micros = (uint32_t)h.micros;
+    rh.capturedLength = sizeof h + captured;
+    rh.length = sizeof h + (uint32_t)length;
+
+    uint32_t total = sizeof rh + sizeof h + captured;
+    if (!fileRingReserve(&cap->out, total)) {
+        return;
+    }
+
+    fileRingPut(&cap->out, 0, &rh, sizeof rh);
+    fileRingPut(&cap->out, sizeof rh, &h, sizeof h);
+    fileRingPut(&cap->out, sizeof rh + sizeof h, data, captured);
+    fileRingCommit(&cap->out, total);
+}
+
+static int32_t usbmonStatus(int status)
+{
+    switch (status) {
+    case UsbusComplete:         return 0;
+    case UsbusCanceled:         return -LINUX_ENOENT;
+    case UsbusStalled:          return -LINUX_EPIPE;
+    case UsbusOverflow:         return -LINUX_EOVERFLOW;
+    case UsbusTimeout:          return -LINUX_ETIMEDOUT;
+    case UsbusBadParameter:     return -LINUX_EINVAL;
+    case UsbusStatusGenericError: return -LINUX_EPROTO;
+    default:                    return -LINUX_EIO;
+    }
+}
@@ -0,0 +1,76 @@
+#include "clock.h"
+
+#if defined(USBUS_PLATFORM_OSX)
+#include <mach/mach_time.h>
+#include <time.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t monotonicNanos()
+{
+    /*
+     * Monotonic timestamp in nanoseconds, with an arbitrary epoch.
+     */
+
+#if defined(USBUS_PLATFORM_OSX)
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+
+#elif defined(_WIN32)
+    static LARGE_INTEGER freq;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    // split to avoid overflowing the multiplication
+    uint64_t secs = now.QuadPart / freq.QuadPart;
+    uint64_t rem = now.QuadPart % freq.QuadPart;
+    return secs * 1000000000ULL + rem * 1000000000ULL / freq.QuadPart;
+
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+uint64_t realtimeNanos()
+{
+    /*
+     * Wall clock time in nanoseconds since the Unix epoch. Not monotonic -
+     * only for timestamps that leave the process, eg. captures.
+     */
+
+#if defined(_WIN32)
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    // 100ns intervals since 1601
+    uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (t - 116444736000000000ULL) * 100;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void sleepNanos(uint64_t ns)
+{
+#if defined(_WIN32)
+    // Sleep() granularity is a millisecond at best - round up
+    Sleep((DWORD)((ns + 999999) / 1000000));
+#else
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    nanosleep(&ts, 0);
+#endif
+}
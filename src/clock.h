@@ -0,0 +1,10 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdint.h>
+
+uint64_t monotonicNanos();
+uint64_t realtimeNanos();
+void sleepNanos(uint64_t ns);
+
+#endif // _CLOCK_H
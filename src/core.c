@@ -10,15 +10,13 @@
     const struct UsbusPlatform * const gPlatform = &platformIOKit;
 #elif defined(USBUS_PLATFORM_WIN)
     const struct UsbusPlatform * const gPlatform = &platformWinUSB;
+#elif defined(USBUS_PLATFORM_LINUX)
+    const struct UsbusPlatform * const gPlatform = &platformUsbfs;
 #else
     #error "Unsupported Platform"
 #endif
 
-struct UsbusContext defaultCtxt = {
-    0,
-    0,
-    { 0 }
-};
+struct UsbusContext defaultCtxt = { 0 };
 
 int usbusListen(struct UsbusContext *ctx,
                 UsbusDeviceConnectedCallback connectCB,
@@ -27,13 +25,37 @@ int usbusListen(struct UsbusContext *ctx,
     struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
     c->connected = connectCB;
     c->disconnected = disconnectCB;
-    return gPlatform->listen(c);
+    c->platform = ctxPlatform(c);
+    return c->platform->listen(c);
 }
 
 void usbusStopListen(struct UsbusContext *ctx)
 {
     struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
-    gPlatform->stopListen(c);
+    ctxPlatform(c)->stopListen(c);
+}
+
+int usbusSetPlatform(UsbusContext *ctx, enum UsbusPlatformType type)
+{
+    /*
+     * Select the platform backing this context.
+     * Must be called before usbusListen().
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    switch (type) {
+    case UsbusPlatformNative:
+        c->platform = gPlatform;
+        return UsbusOK;
+
+    case UsbusPlatformEmulated:
+        c->platform = &platformEmulated;
+        return UsbusOK;
+
+    default:
+        return UsbusBadParameter;
+    }
 }
 
 int usbusOpen(UsbusDevice *d)
@@ -43,8 +65,13 @@ int usbusOpen(UsbusDevice *d)
         return UsbusOK;
     }
 
-    int r = gPlatform->open(d);
+    int r = devPlatform(d)->open(d);
     d->isOpen = (r == UsbusOK);
+
+    if (d->isOpen && buildDescriptorTree(d) != UsbusOK) {
+        logdebug("usbusOpen(): descriptors unavailable, falling back to the platform");
+    }
+
     return r;
 }
 
@@ -56,8 +83,11 @@ uint8_t usbusIsOpen(UsbusDevice *d)
 void usbusClose(UsbusDevice *d)
 {
     if (d->isOpen) {
-        gPlatform->close(d);
+        disarmDeviceTimers(d);
+        devPlatform(d)->close(d);
+        statsDeviceClosed(d);
         d->isOpen = 0;
+        freeDescriptorTree(d);
     }
 }
 
@@ -68,7 +98,7 @@ int usbusOpenInterface(UsbusDevice *d, unsigned index)
         return UsbusNotOpen;
     }
 
-    return gPlatform->openInterface(d, index);
+    return devPlatform(d)->openInterface(d, index);
 }
 
 
@@ -78,7 +108,7 @@ int usbusCloseInterface(UsbusDevice *d, unsigned index)
         return UsbusNotOpen;
     }
 
-    return gPlatform->closeInterface(d, index);
+    return devPlatform(d)->closeInterface(d, index);
 }
 
 
@@ -89,18 +119,29 @@ void usbusDispose(UsbusDevice *d)
      */
 
     if (d) {
+        // devices rejected during enumeration may not have been bound to a context yet
+        if (d->ctx && devPlatform(d)->dispose) {
+            devPlatform(d)->dispose(d);
+        }
+        freeDescriptorTree(d);
+        freeStringCache(d);
+        freeEndpointStats(d);
         free(d);
     }
 }
 
 int usbusGetConfiguration(UsbusDevice *d, uint8_t *config)
 {
-    return gPlatform->getConfiguration(d, config);
+    return devPlatform(d)->getConfiguration(d, config);
 }
 
 int usbusSetConfiguration(UsbusDevice *d, uint8_t config)
 {
-    return gPlatform->setConfiguration(d, config);
+    int r = devPlatform(d)->setConfiguration(d, config);
+    if (r == UsbusOK) {
+        setActiveConfig(d, config);
+    }
+    return r;
 }
 
 
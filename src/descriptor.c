@@ -4,13 +4,92 @@
 #include "usbus_limits.h"
 #include "logger.h"
 
+#include <stdlib.h>
 #include <string.h>
 
+#define CONFIG_DESC_LEN         9
+#define INTERFACE_DESC_LEN      9
+#define ENDPOINT_DESC_LEN       7
+
+static const struct DescriptorInterface *treeInterface(struct DescriptorTree *dt, unsigned number, unsigned altsetting);
+static int fetchConfigs(UsbusDevice *d, uint8_t **raw, unsigned *rawLen, unsigned *offsets);
+static void fetchBos(UsbusDevice *d, uint8_t **bos, unsigned *bosLen);
+static int cachedString(UsbusDevice *d, uint8_t index, uint16_t lang, const uint8_t **desc);
+
 void usbusGetDescriptor(UsbusDevice *dev, struct UsbusDeviceDescriptor *desc)
 {
     memcpy(desc, &dev->descriptor, sizeof(*desc));
 }
 
+int usbusDescriptorIterBegin(UsbusDevice *d, unsigned configIndex, struct UsbusDescriptorIter *it)
+{
+    /*
+     * Walk every descriptor in a configuration's descriptor set, starting
+     * with the configuration descriptor itself - interface, endpoint,
+     * class specific and SuperSpeed companion descriptors alike.
+     */
+
+    if (!d->isOpen) {
+        return UsbusNotOpen;
+    }
+
+    if (!d->descriptors || configIndex >= d->descriptors->numConfigs) {
+        return UsbusNotFound;
+    }
+
+    const struct DescriptorConfig *dc = &d->descriptors->configs[configIndex];
+    it->next = dc->raw;
+    it->end = dc->raw + dc->rawLen;
+    return UsbusOK;
+}
+
+int usbusBosIterBegin(UsbusDevice *d, struct UsbusDescriptorIter *it)
+{
+    /*
+     * Walk the Binary device Object Store - the BOS descriptor followed by
+     * its device capability descriptors. Only USB 2.01 and later devices
+     * provide one. Fetched from the device on first use.
+     */
+
+    if (!d->isOpen) {
+        return UsbusNotOpen;
+    }
+
+    struct DescriptorTree *dt = d->descriptors;
+    if (!dt || d->descriptor.bcdUSB < 0x0201) {
+        return UsbusNotFound;
+    }
+
+    if (!dt->bosFetched) {
+        dt->bosFetched = 1;
+        fetchBos(d, &dt->bos, &dt->bosLen);
+    }
+
+    if (!dt->bos) {
+        return UsbusNotFound;
+    }
+
+    it->next = dt->bos;
+    it->end = dt->bos + dt->bosLen;
+    return UsbusOK;
+}
+
+const struct UsbusDescriptorHeader *usbusDescriptorIterNext(struct UsbusDescriptorIter *it)
+{
+    /*
+     * Returns the next descriptor, or null at the end of the set
+     * or if the next descriptor is malformed.
+     */
+
+    const uint8_t *p = it->next;
+    if (p + 2 > it->end || p[0] < 2 || p + p[0] > it->end) {
+        return 0;
+    }
+
+    it->next = p + p[0];
+    return (const struct UsbusDescriptorHeader*)p;
+}
+
 int usbusGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc)
 {
     if (!d->isOpen) {
@@ -21,7 +100,15 @@ int usbusGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigD
         return UsbusNotFound;
     }
 
-    return gPlatform->getConfigDescriptor(d, index, desc);
+    if (d->descriptors) {
+        if (index >= d->descriptors->numConfigs) {
+            return UsbusNotFound;
+        }
+        *desc = d->descriptors->configs[index].desc;
+        return UsbusOK;
+    }
+
+    return devPlatform(d)->getConfigDescriptor(d, index, desc);
 }
 
 int usbusGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc)
@@ -34,7 +121,16 @@ int usbusGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsett
         return UsbusBadParameter;
     }
 
-    return gPlatform->getInterfaceDescriptor(d, index, altsetting, desc);
+    if (d->descriptors) {
+        const struct DescriptorInterface *di = treeInterface(d->descriptors, index, altsetting);
+        if (!di) {
+            return UsbusNotFound;
+        }
+        *desc = di->desc;
+        return UsbusOK;
+    }
+
+    return devPlatform(d)->getInterfaceDescriptor(d, index, altsetting, desc);
 }
 
 int usbusGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned epIndex, struct UsbusEndpointDescriptor *desc)
@@ -53,50 +149,579 @@ int usbusGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned epIn
         return UsbusBadParameter;
     }
 
-    return gPlatform->getEndpointDescriptor(d, intfIndex, epIndex, desc);
+    if (d->descriptors) {
+        const struct DescriptorInterface *di = treeInterface(d->descriptors, intfIndex, 0);
+        if (!di || epIndex >= di->numEndpoints) {
+            return UsbusNotFound;
+        }
+        *desc = d->descriptors->endpoints[di->firstEndpoint + epIndex];
+        return UsbusOK;
+    }
+
+    return devPlatform(d)->getEndpointDescriptor(d, intfIndex, epIndex, desc);
 }
 
 int usbusGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang, uint8_t *buf, unsigned len, unsigned *transferred)
 {
-    if (!d->isOpen) {
-        return UsbusNotOpen;
+    /*
+     * String descriptors are cached per device, so only the first request
+     * for a given index and language goes to the device.
+     * A `lang` of 0 selects the device's first supported language.
+     */
+
+    const uint8_t *desc;
+    int r = cachedString(d, index, lang, &desc);
+    if (r != UsbusOK) {
+        return r;
     }
 
-    return gPlatform->getStringDescriptor(d, index, lang, buf, len, transferred);
+    unsigned n = desc[0] < len ? desc[0] : len;
+    memcpy(buf, desc, n);
+    *transferred = n;
+    return UsbusOK;
 }
 
 int usbusGetStringDescriptorAscii(UsbusDevice *d, uint8_t index, uint16_t lang, char *buf, unsigned len, unsigned *transferred)
 {
-    if (!d->isOpen) {
-        return UsbusNotOpen;
+    /*
+     * Convert to ASCII, replacing anything outside of it with '?'.
+     * Ensure that we null terminate the resulting string.
+     */
+
+    if (len == 0) {
+        return UsbusBadParameter;
     }
 
-    uint8_t unicodeBuf[256];
-    unsigned unicodeLen;
-    int r = gPlatform->getStringDescriptor(d, index, lang, unicodeBuf, sizeof unicodeBuf, &unicodeLen);
+    const uint8_t *desc;
+    int r = cachedString(d, index, lang, &desc);
     if (r != UsbusOK) {
         return r;
     }
 
+    unsigned desti, srci;
+    for (desti = 0, srci = 2; srci + 1 < desc[0] && desti + 1 < len; srci += 2) {
+        uint16_t c = desc[srci] | (desc[srci + 1] << 8);
+        if (c >= 0xdc00 && c <= 0xdfff) {
+            continue;   // second half of a surrogate pair, already replaced
+        }
+        buf[desti++] = c < 0x80 ? (char)c : '?';
+    }
+
+    buf[desti] = 0;
+    *transferred = desti;
+    return UsbusOK;
+}
+
+int usbusGetStringDescriptorUtf8(UsbusDevice *d, uint8_t index, uint16_t lang, char *buf, unsigned len, unsigned *transferred)
+{
     /*
-     * Convert unicode buffer contents to ASCII.
-     * Ensure that we null terminate the resulting string.
+     * Convert to UTF-8, see utf16ToUtf8().
      */
 
-    if (unicodeBuf[1] != UsbusDescriptorString || unicodeBuf[0] != unicodeLen) {
-        return UsbusIoErr;
+    if (len == 0) {
+        return UsbusBadParameter;
     }
 
-    unsigned desti, srci;
-    for (desti = 0, srci = 2; srci < unicodeLen && desti < len; srci += 2) {
-        // punt if there's anything in the high byte
-        if (unicodeBuf[srci + 1])
-            buf[desti++] = '?';
-        else
-            buf[desti++] = unicodeBuf[srci];
+    const uint8_t *desc;
+    int r = cachedString(d, index, lang, &desc);
+    if (r != UsbusOK) {
+        return r;
+    }
+
+    *transferred = utf16ToUtf8(desc, buf, len);
+    return UsbusOK;
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+int buildDescriptorTree(UsbusDevice *d)
+{
+    /*
+     * Fetch every configuration descriptor set, and parse them into
+     * a DescriptorTree. Counts are taken in a first pass so that the
+     * tree and the raw descriptors share a single allocation.
+     */
+
+    uint8_t *raw;
+    unsigned rawLen;
+    unsigned offsets[256 + 1];
+    if (fetchConfigs(d, &raw, &rawLen, offsets) != UsbusOK) {
+        return -1;
+    }
+
+    unsigned numConfigs = d->descriptor.bNumConfigurations;
+    unsigned numInterfaces = 0, numEndpoints = 0;
+    const uint8_t *p;
+
+    unsigned c;
+    for (c = 0; c < numConfigs; ++c) {
+        const uint8_t *pend = raw + offsets[c + 1];
+        for (p = raw + offsets[c]; p + 2 <= pend && p[0] >= 2 && p + p[0] <= pend; p += p[0]) {
+            if (p[1] == UsbusDescriptorInterface && p[0] >= INTERFACE_DESC_LEN) {
+                numInterfaces++;
+            } else if (p[1] == UsbusDescriptorEndpoint && p[0] >= ENDPOINT_DESC_LEN) {
+                numEndpoints++;
+            }
+        }
+    }
+
+    size_t sz = sizeof(struct DescriptorTree) +
+                numConfigs * sizeof(struct DescriptorConfig) +
+                numInterfaces * sizeof(struct DescriptorInterface) +
+                numEndpoints * sizeof(struct UsbusEndpointDescriptor);
+
+    struct DescriptorTree *dt = calloc(1, sz + rawLen);
+    if (!dt) {
+        logerror("failed to allocate descriptor tree");
+        free(raw);
+        return -1;
+    }
+
+    dt->numConfigs = numConfigs;
+    dt->configs = (struct DescriptorConfig*)(dt + 1);
+    dt->interfaces = (struct DescriptorInterface*)(dt->configs + numConfigs);
+    dt->endpoints = (struct UsbusEndpointDescriptor*)(dt->interfaces + numInterfaces);
+    dt->raw = (uint8_t*)dt + sz;
+    memcpy(dt->raw, raw, rawLen);
+    free(raw);
+
+    unsigned ni = 0, ne = 0;
+    for (c = 0; c < numConfigs; ++c) {
+
+        struct DescriptorConfig *dc = &dt->configs[c];
+        dc->raw = dt->raw + offsets[c];
+        dc->rawLen = offsets[c + 1] - offsets[c];
+        dc->firstInterface = ni;
+
+        const uint8_t *cp = dc->raw;
+        dc->desc.bLength = cp[0];
+        dc->desc.bDescriptorType = cp[1];
+        dc->desc.wTotalLength = cp[2] | (cp[3] << 8);
+        dc->desc.bNumInterfaces = cp[4];
+        dc->desc.bConfigurationValue = cp[5];
+        dc->desc.iConfiguration = cp[6];
+        dc->desc.bmAttributes = cp[7];
+        dc->desc.bMaxPower = cp[8];
+
+        struct DescriptorInterface *di = 0;
+        const uint8_t *cpend = dc->raw + dc->rawLen;
+
+        for (p = cp + cp[0]; p + 2 <= cpend && p[0] >= 2 && p + p[0] <= cpend; p += p[0]) {
+
+            if (p[1] == UsbusDescriptorInterface && p[0] >= INTERFACE_DESC_LEN) {
+                di = &dt->interfaces[ni++];
+                di->desc.bLength = p[0];
+                di->desc.bDescriptorType = p[1];
+                di->desc.bInterfaceNumber = p[2];
+                di->desc.bAlternateSetting = p[3];
+                di->desc.bNumEndpoints = p[4];
+                di->desc.bInterfaceClass = p[5];
+                di->desc.bInterfaceSubClass = p[6];
+                di->desc.bInterfaceProtocol = p[7];
+                di->desc.iInterface = p[8];
+                di->firstEndpoint = ne;
+                dc->numInterfaces++;
+
+            } else if (p[1] == UsbusDescriptorEndpoint && p[0] >= ENDPOINT_DESC_LEN && di) {
+                struct UsbusEndpointDescriptor *ed = &dt->endpoints[ne++];
+                ed->bLength = p[0];
+                ed->bDescriptorType = p[1];
+                ed->bEndpointAddress = p[2];
+                ed->bmAttributes = p[3];
+                ed->wMaxPacketSize = p[4] | (p[5] << 8);
+                ed->bInterval = p[6];
+                di->numEndpoints++;
+            }
+        }
+    }
+
+    d->descriptors = dt;
+
+    uint8_t config;
+    if (devPlatform(d)->getConfiguration(d, &config) == UsbusOK) {
+        setActiveConfig(d, config);
+    }
+
+    return UsbusOK;
+}
+
+unsigned utf16ToUtf8(const uint8_t *desc, char *buf, unsigned len)
+{
+    /*
+     * Convert a string descriptor from UTF-16LE to UTF-8, including surrogate pairs.
+     * Unpaired surrogates become U+FFFD. The result is null terminated,
+     * and truncated on a character boundary if `buf` is too small.
+     * `len` must be non-zero. Returns the length of the result.
+     */
+
+    unsigned desti = 0, srci = 2;
+    while (srci + 1 < desc[0]) {
+
+        uint32_t c = desc[srci] | (desc[srci + 1] << 8);
+        srci += 2;
+
+        if (c >= 0xd800 && c <= 0xdbff && srci + 1 < desc[0]) {
+            uint32_t lo = desc[srci] | (desc[srci + 1] << 8);
+            if (lo >= 0xdc00 && lo <= 0xdfff) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                srci += 2;
+            }
+        }
+        if (c >= 0xd800 && c <= 0xdfff) {
+            c = 0xfffd;
+        }
+
+        uint8_t enc[4];
+        unsigned n;
+        if (c < 0x80) {
+            enc[0] = c;
+            n = 1;
+        } else if (c < 0x800) {
+            enc[0] = 0xc0 | (c >> 6);
+            enc[1] = 0x80 | (c & 0x3f);
+            n = 2;
+        } else if (c < 0x10000) {
+            enc[0] = 0xe0 | (c >> 12);
+            enc[1] = 0x80 | ((c >> 6) & 0x3f);
+            enc[2] = 0x80 | (c & 0x3f);
+            n = 3;
+        } else {
+            enc[0] = 0xf0 | (c >> 18);
+            enc[1] = 0x80 | ((c >> 12) & 0x3f);
+            enc[2] = 0x80 | ((c >> 6) & 0x3f);
+            enc[3] = 0x80 | (c & 0x3f);
+            n = 4;
+        }
+
+        if (desti + n + 1 > len) {
+            break;
+        }
+        memcpy(buf + desti, enc, n);
+        desti += n;
     }
 
     buf[desti] = 0;
-    *transferred = desti;
+    return desti;
+}
+
+void freeDescriptorTree(UsbusDevice *d)
+{
+    if (d->descriptors) {
+        free(d->descriptors->bos);
+    }
+    free(d->descriptors);
+    d->descriptors = 0;
+}
+
+void freeStringCache(UsbusDevice *d)
+{
+    struct StringCache *sc = &d->strings;
+
+    unsigned i;
+    for (i = 0; i < sc->numEntries; ++i) {
+        free(sc->entries[i].desc);
+    }
+    free(sc->entries);
+    memset(sc, 0, sizeof *sc);
+}
+
+void setActiveConfig(UsbusDevice *d, uint8_t configValue)
+{
+    struct DescriptorTree *dt = d->descriptors;
+    if (!dt) {
+        return;
+    }
+
+    unsigned c;
+    for (c = 0; c < dt->numConfigs; ++c) {
+        if (dt->configs[c].desc.bConfigurationValue == configValue) {
+            dt->activeConfig = c;
+            return;
+        }
+    }
+}
+
+int findEndpointDescriptor(UsbusDevice *d, uint8_t address, struct UsbusEndpointDescriptor *desc, unsigned *intfIndex)
+{
+    /*
+     * Search the current configuration's interfaces for the endpoint with the given address.
+     * `intfIndex` is optional, and receives the interface's bInterfaceNumber -
+     * see interfacePosition() for platforms that need its position instead.
+     *
+     * Default altsettings are searched first, then the alternate ones, since
+     * isochronous endpoints in particular often only exist in the latter.
+     */
+
+    struct DescriptorTree *dt = d->descriptors;
+    if (dt) {
+        const struct DescriptorConfig *dc = &dt->configs[dt->activeConfig];
+        unsigned pass, i, e;
+        for (pass = 0; pass < 2; ++pass) {
+            for (i = dc->firstInterface; i < dc->firstInterface + dc->numInterfaces; ++i) {
+                const struct DescriptorInterface *di = &dt->interfaces[i];
+                if ((di->desc.bAlternateSetting == 0) != (pass == 0)) {
+                    continue;
+                }
+                for (e = di->firstEndpoint; e < di->firstEndpoint + di->numEndpoints; ++e) {
+                    if (dt->endpoints[e].bEndpointAddress == address) {
+                        *desc = dt->endpoints[e];
+                        if (intfIndex) {
+                            *intfIndex = di->desc.bInterfaceNumber;
+                        }
+                        return UsbusOK;
+                    }
+                }
+            }
+        }
+        return UsbusNotFound;
+    }
+
+    // without a tree, platforms only expose the endpoints of the default altsetting
+    const struct UsbusPlatform *p = devPlatform(d);
+
+    struct UsbusConfigDescriptor cfg;
+    if (p->getConfigDescriptor(d, 0, &cfg) != UsbusOK) {
+        return UsbusNotFound;
+    }
+
+    unsigned i;
+    for (i = 0; i < cfg.bNumInterfaces && i < USBUS_MAX_INTERFACES; ++i) {
+        struct UsbusInterfaceDescriptor intf;
+        if (p->getInterfaceDescriptor(d, i, 0, &intf) != UsbusOK) {
+            continue;
+        }
+
+        unsigned e;
+        for (e = 0; e < intf.bNumEndpoints && e < USBUS_MAX_ENDPOINTS; ++e) {
+            if (p->getEndpointDescriptor(d, i, e, desc) == UsbusOK && desc->bEndpointAddress == address) {
+                if (intfIndex) {
+                    *intfIndex = i;
+                }
+                return UsbusOK;
+            }
+        }
+    }
+
+    return UsbusNotFound;
+}
+
+int interfacePosition(UsbusDevice *d, unsigned number, unsigned *position)
+{
+    /*
+     * Map an interface number to its position among the active
+     * configuration's interfaces, for platforms that index interfaces in
+     * descriptor order rather than by number.
+     * Without a tree, interfaces are assumed to be numbered from 0.
+     */
+
+    struct DescriptorTree *dt = d->descriptors;
+    if (!dt) {
+        *position = number;
+        return UsbusOK;
+    }
+
+    const struct DescriptorConfig *dc = &dt->configs[dt->activeConfig];
+
+    unsigned i, pos = 0;
+    for (i = dc->firstInterface; i < dc->firstInterface + dc->numInterfaces; ++i) {
+        const struct UsbusInterfaceDescriptor *id = &dt->interfaces[i].desc;
+        if (id->bInterfaceNumber == number) {
+            *position = pos;
+            return UsbusOK;
+        }
+        if (id->bAlternateSetting == 0) {
+            pos++;
+        }
+    }
+
+    return UsbusNotFound;
+}
+
+static const struct DescriptorInterface *treeInterface(struct DescriptorTree *dt, unsigned number, unsigned altsetting)
+{
+    const struct DescriptorConfig *dc = &dt->configs[dt->activeConfig];
+
+    unsigned i;
+    for (i = dc->firstInterface; i < dc->firstInterface + dc->numInterfaces; ++i) {
+        const struct DescriptorInterface *di = &dt->interfaces[i];
+        if (di->desc.bInterfaceNumber == number && di->desc.bAlternateSetting == altsetting) {
+            return di;
+        }
+    }
+
+    return 0;
+}
+
+static int fetchConfigs(UsbusDevice *d, uint8_t **raw, unsigned *rawLen, unsigned *offsets)
+{
+    /*
+     * Read every configuration descriptor set back to back into a heap buffer,
+     * recording where each one starts - `offsets` has room for
+     * bNumConfigurations + 1 entries.
+     */
+
+    const struct UsbusPlatform *p = devPlatform(d);
+    if (!p->getDescriptor) {
+        return -1;
+    }
+
+    unsigned numConfigs = d->descriptor.bNumConfigurations;
+    if (numConfigs == 0) {
+        return -1;
+    }
+
+    uint8_t *buf = 0;
+    unsigned len = 0;
+
+    unsigned c;
+    for (c = 0; c < numConfigs; ++c) {
+
+        // the header gives the length of the full set
+        uint8_t hdr[CONFIG_DESC_LEN];
+        unsigned transferred;
+        if (p->getDescriptor(d, UsbusDescriptorConfig, c, 0, hdr, sizeof hdr, &transferred) != UsbusOK ||
+            transferred < CONFIG_DESC_LEN || hdr[1] != UsbusDescriptorConfig)
+        {
+            free(buf);
+            return -1;
+        }
+
+        unsigned total = hdr[2] | (hdr[3] << 8);
+        if (total < CONFIG_DESC_LEN) {
+            free(buf);
+            return -1;
+        }
+
+        uint8_t *nbuf = realloc(buf, len + total);
+        if (!nbuf) {
+            free(buf);
+            return -1;
+        }
+        buf = nbuf;
+
+        if (p->getDescriptor(d, UsbusDescriptorConfig, c, 0, buf + len, total, &transferred) != UsbusOK ||
+            transferred < CONFIG_DESC_LEN)
+        {
+            free(buf);
+            return -1;
+        }
+
+        offsets[c] = len;
+        len += transferred;
+    }
+
+    offsets[numConfigs] = len;
+    *raw = buf;
+    *rawLen = len;
+    return UsbusOK;
+}
+
+static void fetchBos(UsbusDevice *d, uint8_t **bos, unsigned *bosLen)
+{
+    /*
+     * As with configurations, the header gives the length of the full set.
+     * Leaves `bos` null if the device doesn't provide one.
+     */
+
+    const struct UsbusPlatform *p = devPlatform(d);
+    if (!p->getDescriptor) {
+        return;
+    }
+
+    struct UsbusBosDescriptor hdr;
+    unsigned transferred;
+    if (p->getDescriptor(d, UsbusDescriptorBOS, 0, 0, (uint8_t*)&hdr, sizeof hdr, &transferred) != UsbusOK ||
+        transferred < sizeof hdr || hdr.bDescriptorType != UsbusDescriptorBOS)
+    {
+        return;
+    }
+
+    unsigned total = usbusLE16(hdr.wTotalLength);
+    uint8_t *buf = malloc(total);
+    if (!buf) {
+        return;
+    }
+
+    if (p->getDescriptor(d, UsbusDescriptorBOS, 0, 0, buf, total, &transferred) != UsbusOK ||
+        transferred < sizeof hdr)
+    {
+        free(buf);
+        return;
+    }
+
+    *bos = buf;
+    *bosLen = transferred;
+}
+
+static int cachedString(UsbusDevice *d, uint8_t index, uint16_t lang, const uint8_t **desc)
+{
+    /*
+     * Look up a string descriptor, reading it from the device and
+     * caching it on a miss. Language 0 is resolved via the language ID
+     * table at index 0, which is itself cached.
+     */
+
+    struct StringCache *sc = &d->strings;
+
+    if (index != 0 && lang == 0) {
+        const uint8_t *langs;
+        int r = cachedString(d, 0, 0, &langs);
+        if (r != UsbusOK) {
+            return r;
+        }
+        if (langs[0] < 4) {
+            return UsbusNotFound;
+        }
+        lang = langs[2] | (langs[3] << 8);
+    }
+
+    unsigned i;
+    for (i = 0; i < sc->numEntries; ++i) {
+        if (sc->entries[i].index == index && sc->entries[i].lang == lang) {
+            *desc = sc->entries[i].desc;
+            return UsbusOK;
+        }
+    }
+
+    if (!d->isOpen) {
+        return UsbusNotOpen;
+    }
+
+    uint8_t buf[255];
+    unsigned transferred;
+    int r = devPlatform(d)->getStringDescriptor(d, index, lang, buf, sizeof buf, &transferred);
+    if (r != UsbusOK) {
+        return r;
+    }
+
+    if (transferred < 2 || buf[1] != UsbusDescriptorString || buf[0] < 2 || buf[0] > transferred) {
+        return UsbusIoErr;
+    }
+
+    if (sc->numEntries == sc->capacity) {
+        unsigned cap = sc->capacity ? sc->capacity * 2 : 4;
+        struct StringCacheEntry *entries = realloc(sc->entries, cap * sizeof *entries);
+        if (!entries) {
+            return -1;
+        }
+        sc->entries = entries;
+        sc->capacity = cap;
+    }
+
+    uint8_t *copy = malloc(buf[0]);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, buf, buf[0]);
+
+    struct StringCacheEntry *e = &sc->entries[sc->numEntries++];
+    e->index = index;
+    e->lang = lang;
+    e->desc = copy;
+
+    *desc = copy;
     return UsbusOK;
 }
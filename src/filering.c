@@ -0,0 +1,145 @@
+#include "filering.h"
+#include "atomics.h"
+#include "clock.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FILERING_IDLE_NANOS     1000000
+
+static void writerThread(void *arg);
+
+
+int fileRingOpen(struct FileRing *r, const char *path, uint32_t size, const void *header, unsigned headerLen)
+{
+    /*
+     * Create `path`, write `header` to it, and start the writer thread.
+     * `size` must be a power of 2.
+     */
+
+    memset(r, 0, sizeof *r);
+    r->size = size;
+
+    r->ring = malloc(size);
+    if (!r->ring) {
+        logerror("fileRingOpen(): failed to malloc ring");
+        return -1;
+    }
+
+    r->file = fopen(path, "wb");
+    if (!r->file) {
+        logerror("fileRingOpen(): failed to open %s", path);
+        free(r->ring);
+        return -1;
+    }
+
+    if (fwrite(header, headerLen, 1, r->file) != 1 ||
+        threadStart(&r->thread, writerThread, r) != 0) {
+        logerror("fileRingOpen(): failed to start writing %s", path);
+        fclose(r->file);
+        free(r->ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+int fileRingClose(struct FileRing *r)
+{
+    /*
+     * Write out everything committed so far and close the file.
+     * Returns -1 if any of it couldn't be written.
+     */
+
+    atomicStore32(&r->stop, 1);
+    threadJoin(r->thread);
+
+    int ok = !ferror(r->file);
+    if (fclose(r->file) != 0) {
+        ok = 0;
+    }
+    free(r->ring);
+    r->ring = 0;
+
+    return ok ? 0 : -1;
+}
+
+int fileRingReserve(struct FileRing *r, uint32_t len)
+{
+    /*
+     * Whether a record of `len` bytes fits right now - if not, it's counted
+     * as dropped, rather than waiting for the writer to catch up.
+     */
+
+    if (r->size - (r->head - atomicLoad32(&r->tail)) < len) {
+        r->dropped++;
+        return 0;
+    }
+    return 1;
+}
+
+void fileRingWait(struct FileRing *r, uint32_t len)
+{
+    /*
+     * Wait until a record of `len` bytes fits - for the rare record that
+     * matters more than not stalling the producer.
+     */
+
+    while (r->size - (r->head - atomicLoad32(&r->tail)) < len) {
+        sleepNanos(FILERING_IDLE_NANOS);
+    }
+}
+
+void fileRingPut(struct FileRing *r, uint32_t offset, const void *src, unsigned len)
+{
+    // `offset` bytes into the record being built, which isn't visible until committed
+    unsigned pos = (r->head + offset) & (r->size - 1);
+    unsigned first = r->size - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(&r->ring[pos], src, first);
+    memcpy(r->ring, (const uint8_t*)src + first, len - first);
+}
+
+void fileRingCommit(struct FileRing *r, uint32_t len)
+{
+    atomicStore32(&r->head, r->head + len);
+}
+
+static void writerThread(void *arg)
+{
+    /*
+     * Write out whatever's accumulated, in at most two pieces as the ring
+     * wraps, and flush once it's idle. Keeps going after a stop is
+     * requested until the ring is empty.
+     */
+
+    struct FileRing *r = arg;
+
+    for (;;) {
+        uint32_t stop = atomicLoad32(&r->stop);
+        uint32_t tail = r->tail;
+        uint32_t avail = atomicLoad32(&r->head) - tail;
+
+        if (avail == 0) {
+            if (stop) {
+                break;
+            }
+            fflush(r->file);
+            sleepNanos(FILERING_IDLE_NANOS);
+            continue;
+        }
+
+        unsigned offset = tail & (r->size - 1);
+        unsigned n = r->size - offset;
+        if (n > avail) {
+            n = avail;
+        }
+        if (fwrite(&r->ring[offset], 1, n, r->file) != n) {
+            logerror("fileRing: failed to write %u bytes", n);
+        }
+        atomicStore32(&r->tail, tail + n);
+    }
+}
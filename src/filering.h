@@ -0,0 +1,34 @@
+#ifndef _FILERING_H
+#define _FILERING_H
+
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Single producer / single consumer byte ring, copied out to a file by a
+ * writer thread. The producer formats records straight into the ring, which
+ * holds the file's bytes verbatim, so the writer never has to look inside it.
+ * Used by packet capture and traffic recording.
+ */
+struct FileRing {
+    FILE *file;
+    uint8_t *ring;
+    uint32_t size;                      // power of 2
+    volatile uint32_t head;             // written by the producer
+    volatile uint32_t tail;             // written by the writer thread
+    volatile uint32_t stop;
+    uint32_t dropped;                   // records that didn't fit, producer only
+    Thread thread;
+};
+
+int fileRingOpen(struct FileRing *r, const char *path, uint32_t size, const void *header, unsigned headerLen);
+int fileRingClose(struct FileRing *r);
+
+int fileRingReserve(struct FileRing *r, uint32_t len);
+void fileRingWait(struct FileRing *r, uint32_t len);
+void fileRingPut(struct FileRing *r, uint32_t offset, const void *src, unsigned len);
+void fileRingCommit(struct FileRing *r, uint32_t len);
+
+#endif // _FILERING_H
@@ -1,34 +1,186 @@
 #include "usbus.h"
 #include "usbus_private.h"
 #include "logger.h"
+#include "clock.h"
+#include "atomics.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+// context whose events are being processed on this thread, if any
+static USBUS_THREAD_LOCAL UsbusContext *tlsEventCtx;
+
+// transfers aren't tied to a context until submitted, so they share one pool
+static struct UsbusTransferPool transferPool;
+
+static void pushOp(UsbusContext *c, void *volatile *queue, struct UsbusTransferPriv *tp, struct UsbusTransferPriv **link);
+static void drainOps(UsbusContext *c);
+static int runEvents(UsbusContext *c, unsigned timeoutMillis);
+static int platformSubmit(struct UsbusTransfer *t);
+static void expireTimers(UsbusContext *c);
+static int timerOnDevice(struct TimerEntry *e, void *d);
+static int isPooled(const struct UsbusTransfer *t, const char *caller);
+static int hasSetup(const struct UsbusTransfer *t, const char *caller);
+static int platformCancel(struct UsbusTransfer *t);
+static void unlinkCompleted(struct UsbusTransferPriv *tp);
+
+static inline struct UsbusTransferPriv *timerTransfer(struct TimerEntry *e) {
+    return (struct UsbusTransferPriv*)((char*)e - offsetof(struct UsbusTransferPriv, timer));
+}
+
 struct UsbusTransfer *usbusAllocateTransfer()
 {
-    struct UsbusTransfer *t = malloc(sizeof *t);
-    if (!t) {
+    /*
+     * Transfers come from a pool shared by all contexts, and carry
+     * any per-submit state the platform requires.
+     */
+
+    struct UsbusTransferPriv *tp = transferPoolAlloc(&transferPool);
+    if (!tp) {
         logerror("failed to allocate transfer");
         return 0;
     }
-    memset(t, 0, sizeof *t);
-    return t;
+
+    memset(&tp->transfer, 0, sizeof tp->transfer);
+    return &tp->transfer;
 }
 
 void usbusReleaseTransfer(struct UsbusTransfer *t)
 {
-    if (t) {
-        free(t);
+    /*
+     * A transfer whose completion hasn't been collected via
+     * usbusPollCompletions() yet is dropped from the queue.
+     */
+
+    if (t && isPooled(t, "usbusReleaseTransfer")) {
+        struct UsbusTransferPriv *tp = transferPriv(t);
+        if (tp->completedCtx) {
+            unlinkCompleted(tp);
+        }
+        transferPoolFree(tp->pool, tp);
     }
 }
 
+uint8_t *usbusAllocateTransferBuffer(UsbusDevice *d, unsigned len)
+{
+    /*
+     * Platforms that can transfer directly to/from memory they provide
+     * (usbfs, via mmap) allocate it here - otherwise it's regular heap memory.
+     * Buffers must be released with usbusFreeTransferBuffer() before the
+     * device is closed.
+     */
+
+    if (!d->isOpen) {
+        return 0;
+    }
+
+    const struct UsbusPlatform *p = devPlatform(d);
+    if (p->allocateBuffer) {
+        return p->allocateBuffer(d, len);
+    }
+
+    uint8_t *buf = malloc(len);
+    if (!buf) {
+        logerror("failed to allocate transfer buffer");
+    }
+    return buf;
+}
+
+void usbusFreeTransferBuffer(UsbusDevice *d, uint8_t *buf)
+{
+    if (!buf) {
+        return;
+    }
+
+    const struct UsbusPlatform *p = devPlatform(d);
+    if (p->freeBuffer) {
+        // platform buffers are reclaimed when the device is closed
+        if (d->isOpen) {
+            p->freeBuffer(d, buf);
+        }
+    } else {
+        free(buf);
+    }
+}
+
+struct UsbusEndpoint *usbusOpenEndpoint(UsbusDevice *d, uint8_t ep)
+{
+    /*
+     * Look up the interface, transfer type and packet size for `ep`,
+     * along with anything else the platform needs to route transfers to it.
+     * The endpoint's interface must already be open.
+     *
+     * Handles must be closed before the device is.
+     */
+
+    if (!d->isOpen) {
+        return 0;
+    }
+
+    struct UsbusEndpointDescriptor desc;
+    unsigned intfIndex;
+    if (findEndpointDescriptor(d, ep, &desc, &intfIndex) != UsbusOK) {
+        logdebug("usbusOpenEndpoint(): no endpoint 0x%02x", ep);
+        return 0;
+    }
+
+    struct UsbusEndpoint *e = calloc(1, sizeof *e);
+    if (!e) {
+        logerror("failed to allocate endpoint");
+        return 0;
+    }
+
+    e->device = d;
+    e->address = ep;
+    e->interfaceIndex = intfIndex;
+    e->type = (enum UsbusTransferType)(desc.bmAttributes & 0x3);
+    e->maxPacketSize = desc.wMaxPacketSize & 0x7ff;
+
+    const struct UsbusPlatform *p = devPlatform(d);
+    if (p->openEndpoint && p->openEndpoint(d, e) != UsbusOK) {
+        free(e);
+        return 0;
+    }
+
+    return e;
+}
+
+void usbusCloseEndpoint(struct UsbusEndpoint *e)
+{
+    free(e);
+}
+
+void usbusSetEndpointTransferInfo(struct UsbusTransfer *t, struct UsbusEndpoint *e,
+                                  uint8_t *buf, unsigned len, UsbusTransferCallback cb, void *userData)
+{
+    t->device = e->device;
+    t->endpoint = e->address;
+    t->endpointHandle = e;
+    t->type = e->type;
+    t->buffer = buf;
+    t->requestedLength = len;
+    t->callback = cb;
+    t->userData = userData;
+}
+
 int usbusSubmitTransfer(struct UsbusTransfer *t)
 {
+    if (!isPooled(t, "usbusSubmitTransfer") || !hasSetup(t, "usbusSubmitTransfer")) {
+        return UsbusBadParameter;
+    }
+
     if (!t->device->isOpen) {
         return UsbusNotOpen;
     }
 
+    UsbusContext *c = t->device->ctx;
+    traceTransfer(t, TraceSubmit, 0);
+    if (c->threadSafe && tlsEventCtx != c) {
+        pushOp(c, &c->submitQueue, transferPriv(t), &transferPriv(t)->nextSubmit);
+        return UsbusOK;
+    }
+
     /*
      * Reset length here, rather than the setXXXTransferInfo() routines,
      * such that a transfer that's being reused (common for IN transfers)
@@ -36,24 +188,380 @@ int usbusSubmitTransfer(struct UsbusTransfer *t)
      */
     t->transferredlength = 0;
 
-    return gPlatform->submitTransfer(t);
+    return platformSubmit(t);
+}
+
+
+int usbusSubmitTransfers(struct UsbusTransfer **ts, unsigned n, int *results)
+{
+    /*
+     * Submit a batch of transfers. Consecutive transfers for the same device
+     * are validated once, and handed to the platform together where it
+     * supports that.
+     *
+     * `results` receives the outcome for each transfer. Returns UsbusOK if
+     * all transfers were submitted, otherwise the last error encountered.
+     */
+
+    int r = UsbusOK;
+    unsigned i = 0;
+
+    while (i < n) {
+
+        if (!isPooled(ts[i], "usbusSubmitTransfers") || !hasSetup(ts[i], "usbusSubmitTransfers")) {
+            r = results[i++] = UsbusBadParameter;
+            continue;
+        }
+
+        UsbusDevice *d = ts[i]->device;
+
+        if (d->ctx->threadSafe && tlsEventCtx != d->ctx) {
+            r = results[i] = usbusSubmitTransfer(ts[i]);
+            i++;
+            continue;
+        }
+
+        unsigned end;
+        for (end = i; end < n && ts[end]->device == d && transferPoolOwns(&transferPool, ts[end]) &&
+                         (!usbusTransferIsControl(ts[end]) || ts[end]->requestedLength >= USBUS_CONTROL_SETUP_SIZE); ++end) {
+            ts[end]->transferredlength = 0;
+        }
+
+        if (!d->isOpen) {
+            for (; i < end; ++i) {
+                r = results[i] = UsbusNotOpen;
+            }
+            continue;
+        }
+
+        const struct UsbusPlatform *p = devPlatform(d);
+        if (p->submitTransfers) {
+            unsigned j;
+            for (j = i; j < end; ++j) {
+                traceTransfer(ts[j], TraceSubmit, 0);
+                traceTransfer(ts[j], TraceEnqueue, 0);
+                captureTransfer(ts[j], 'S', 0);
+                recordSubmitted(ts[j]);
+                transferPriv(ts[j])->timedOut = 0;
+                transferPriv(ts[j])->cancelRequested = 0;
+                if (ts[j]->timeout) {
+                    timerArm(&d->ctx->timers, &transferPriv(ts[j])->timer, ts[j]->timeout);
+                }
+                statsSubmitted(ts[j]);
+            }
+            int pr = p->submitTransfers(&ts[i], end - i, &results[i]);
+            if (pr != UsbusOK) {
+                r = pr;
+            }
+            for (j = i; j < end; ++j) {
+                if (results[j] != UsbusOK) {
+                    timerDisarm(&d->ctx->timers, &transferPriv(ts[j])->timer);
+                    statsSubmitFailed(ts[j]);
+                    traceTransfer(ts[j], TraceSubmitFailed, results[j]);
+                    captureTransfer(ts[j], 'E', results[j]);
+                }
+            }
+            i = end;
+        } else {
+            for (; i < end; ++i) {
+                traceTransfer(ts[i], TraceSubmit, 0);
+                results[i] = platformSubmit(ts[i]);
+                if (results[i] != UsbusOK) {
+                    r = results[i];
+                }
+            }
+        }
+    }
+
+    return r;
 }
 
 
 int usbusCancelTransfer(struct UsbusTransfer *t)
 {
+    if (!isPooled(t, "usbusCancelTransfer")) {
+        return UsbusBadParameter;
+    }
+
     if (!t->device->isOpen) {
         return UsbusNotOpen;
     }
 
-    return gPlatform->cancelTransfer(t);
+    UsbusContext *c = t->device->ctx;
+    traceTransfer(t, TraceCancel, 0);
+    if (c->threadSafe && tlsEventCtx != c) {
+        pushOp(c, &c->cancelQueue, transferPriv(t), &transferPriv(t)->nextCancel);
+        return UsbusOK;
+    }
+
+    return platformCancel(t);
 }
 
 
 int usbusProcessEvents(UsbusContext *ctx, unsigned timeoutMillis)
 {
     struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
-    return gPlatform->processEvents(c, timeoutMillis);
+    return runEvents(c, timeoutMillis);
+}
+
+
+int usbusSetThreadSafe(UsbusContext *ctx, uint8_t enable)
+{
+    /*
+     * Opt in to thread-safe mode, in which any thread may call
+     * usbusSubmitTransfer() and usbusCancelTransfer().
+     *
+     * Ops from threads other than the one processing events are pushed onto
+     * a lock-free queue and the event thread is woken to perform them, so
+     * they return UsbusOK once queued - a submission that later fails is
+     * reported through the transfer's completion instead.
+     *
+     * Must be called before any other thread uses the context.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (enable && !ctxPlatform(c)->wakeup) {
+        return UsbusNotSupported;
+    }
+
+    c->threadSafe = enable ? 1 : 0;
+    return UsbusOK;
+}
+
+
+int usbusPollCompletions(UsbusContext *ctx, struct UsbusCompletion *out, unsigned max, unsigned timeoutMillis)
+{
+    /*
+     * Pull-style alternative to transfer callbacks: transfers submitted
+     * without a callback are queued as they complete, and handed back
+     * here in batches of up to `max`.
+     *
+     * Only waits for events if nothing has completed already, and then
+     * until something is queued or `timeoutMillis` has passed - transfers
+     * with callbacks don't end the wait.
+     * Returns the number of completions written to `out`, or -1 on error.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (!c->completedHead) {
+        uint64_t deadline = monotonicNanos() + (uint64_t)timeoutMillis * 1000000;
+        for (;;) {
+            if (runEvents(c, timeoutMillis) < 0) {
+                return -1;
+            }
+
+            uint64_t now = monotonicNanos();
+            if (c->completedHead || now >= deadline) {
+                break;
+            }
+            timeoutMillis = (unsigned)((deadline - now + 999999) / 1000000);
+        }
+    }
+
+    unsigned n = 0;
+    while (n < max && c->completedHead) {
+        struct UsbusTransferPriv *tp = c->completedHead;
+        c->completedHead = tp->nextCompleted;
+        tp->completedCtx = 0;
+
+        out[n].transfer = &tp->transfer;
+        out[n].status = tp->transfer.status;
+        out[n].length = tp->transfer.transferredlength;
+        out[n].timestampNanos = tp->completedAt;
+        n++;
+    }
+
+    if (!c->completedHead) {
+        c->completedTail = 0;
+    }
+
+    return n;
+}
+
+
+void dispatchTransferCompletion(struct UsbusTransfer *t, enum UsbusStatus status)
+{
+    /*
+     * Called by the platforms once a transfer has finished, with
+     * transferredlength already filled in.
+     *
+     * Transfers with a callback are dispatched immediately, others are
+     * queued for usbusPollCompletions().
+     *
+     * IOKit and WinUSB can only cancel a whole pipe, so canceling one
+     * transfer also cancels those queued behind it. Those that hadn't
+     * started are quietly resubmitted, keeping their original timeout.
+     */
+
+    struct UsbusContext *c = t->device->ctx;
+    struct UsbusTransferPriv *tp = transferPriv(t);
+
+    if (status == UsbusCanceled && !tp->cancelRequested && t->transferredlength == 0 &&
+        t->device->isOpen && devPlatform(t->device)->submitTransfer(t) == UsbusOK) {
+        return;
+    }
+
+    timerDisarm(&c->timers, &tp->timer);
+    if (tp->timedOut) {
+        tp->timedOut = 0;
+        if (status == UsbusCanceled) {
+            status = UsbusTimeout;
+        }
+    }
+
+    t->status = status;
+    statsCompleted(t, status);
+    traceTransfer(t, TraceComplete, status);
+    captureTransfer(t, 'C', status);
+    recordCompleted(t, status);
+
+    if (t->callback) {
+        if (c->trace.enabled) {
+            // the callback may reuse `t`, so its end is recorded from what was known at the start
+            uint32_t begin = traceRecord(t, TraceCallbackBegin, 0);
+            t->callback(t, status);
+            traceCallbackEnd(c, begin);
+        } else {
+            t->callback(t, status);
+        }
+        return;
+    }
+
+    tp->completedAt = monotonicNanos();
+    tp->nextCompleted = 0;
+    tp->completedCtx = c;
+    if (c->completedTail) {
+        c->completedTail->nextCompleted = tp;
+    } else {
+        c->completedHead = tp;
+    }
+    c->completedTail = tp;
+}
+
+
+int usbusGetPollFds(UsbusContext *ctx, struct UsbusPollFd *fds, unsigned max, unsigned *count)
+{
+    /*
+     * Report the descriptors the platform is currently waiting on.
+     * `count` receives the total, which may exceed `max`.
+     *
+     * Platforms that don't wait on file descriptors (IOKit, WinUSB and the
+     * emulated platform) report UsbusNotSupported.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (!ctxPlatform(c)->getEventFd) {
+        return UsbusNotSupported;
+    }
+
+    unsigned n = c->numPollFds < max ? c->numPollFds : max;
+    memcpy(fds, c->pollFds, n * sizeof *fds);
+    *count = c->numPollFds;
+
+    return UsbusOK;
+}
+
+
+void usbusSetPollFdNotifiers(UsbusContext *ctx, UsbusPollFdAddedCallback added,
+                             UsbusPollFdRemovedCallback removed, void *userData)
+{
+    /*
+     * Be notified as descriptors come and go - typically as devices
+     * are opened and closed.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    c->pollFdAdded = added;
+    c->pollFdRemoved = removed;
+    c->pollFdUserData = userData;
+}
+
+
+int usbusGetEventFd(UsbusContext *ctx, int *fd)
+{
+    /*
+     * Alternatively, a single descriptor that becomes readable whenever
+     * any of the above are ready. Only valid while the context is listening.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    const struct UsbusPlatform *p = ctxPlatform(c);
+
+    if (!p->getEventFd) {
+        return UsbusNotSupported;
+    }
+
+    return p->getEventFd(c, fd);
+}
+
+
+unsigned usbusGetNextTimeout(UsbusContext *ctx, unsigned timeoutMillis)
+{
+    /*
+     * Transfer timeouts and OUT stream flushes are only acted on from
+     * usbusProcessEvents(), and no descriptor becomes ready when they're due.
+     * Applications waiting on the descriptors above should wait no longer
+     * than this - `timeoutMillis` or less, 0 if something is due already.
+     * Call it from the thread processing events.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (c->outStreams) {
+        timeoutMillis = streamWaitMillis(c, timeoutMillis);
+    }
+    if (timerPending(&c->timers)) {
+        timeoutMillis = timerWaitMillis(&c->timers, timeoutMillis);
+    }
+
+    return timeoutMillis;
+}
+
+
+int addPollFd(UsbusContext *ctx, int fd, short events)
+{
+    if (ctx->numPollFds == ctx->pollFdCapacity) {
+        unsigned cap = ctx->pollFdCapacity ? ctx->pollFdCapacity * 2 : 8;
+        struct UsbusPollFd *fds = realloc(ctx->pollFds, cap * sizeof *fds);
+        if (!fds) {
+            logerror("failed to allocate poll fds");
+            return -1;
+        }
+        ctx->pollFds = fds;
+        ctx->pollFdCapacity = cap;
+    }
+
+    ctx->pollFds[ctx->numPollFds].fd = fd;
+    ctx->pollFds[ctx->numPollFds].events = events;
+    ctx->numPollFds++;
+
+    if (ctx->pollFdAdded) {
+        ctx->pollFdAdded(fd, events, ctx->pollFdUserData);
+    }
+
+    return UsbusOK;
+}
+
+
+void removePollFd(UsbusContext *ctx, int fd)
+{
+    /*
+     * Safe to call for descriptors that have already been removed.
+     */
+
+    unsigned i;
+    for (i = 0; i < ctx->numPollFds; ++i) {
+        if (ctx->pollFds[i].fd == fd) {
+            ctx->pollFds[i] = ctx->pollFds[--ctx->numPollFds];
+            if (ctx->pollFdRemoved) {
+                ctx->pollFdRemoved(fd, ctx->pollFdUserData);
+            }
+            return;
+        }
+    }
 }
 
 
@@ -63,7 +571,7 @@ int usbusReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsign
         return UsbusNotOpen;
     }
 
-    return gPlatform->readSync(d, ep, buf, len, written);
+    return devPlatform(d)->readSync(d, ep, buf, len, written);
 }
 
 
@@ -73,5 +581,261 @@ int usbusWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len,
         return UsbusNotOpen;
     }
 
-    return gPlatform->writeSync(d, ep, buf, len, written);
+    return devPlatform(d)->writeSync(d, ep, buf, len, written);
+}
+
+
+/************************************
+ * Internal Implementation/Helpers
+ ************************************/
+
+static void pushOp(UsbusContext *c, void *volatile *queue, struct UsbusTransferPriv *tp, struct UsbusTransferPriv **link)
+{
+    /*
+     * Push onto a multi-producer queue, and wake the event thread if the
+     * queue was empty - otherwise a wakeup is already on its way.
+     */
+
+    void *head = atomicLoadPtr(queue);
+    do {
+        *link = head;
+    } while (!atomicCompareExchangePtr(queue, &head, tp));
+
+    if (!head) {
+        ctxPlatform(c)->wakeup(c);
+    }
+}
+
+static void drainOps(UsbusContext *c)
+{
+    /*
+     * Perform submit and cancel ops queued by other threads.
+     * Ops are pushed in LIFO order, so reverse each batch to preserve
+     * the order they were made in. Submits go first, so a transfer
+     * canceled right after being submitted is found by the platform.
+     */
+
+    struct UsbusTransferPriv *tp = atomicExchangePtr(&c->submitQueue, 0);
+    struct UsbusTransferPriv *ops = 0;
+    while (tp) {
+        struct UsbusTransferPriv *next = tp->nextSubmit;
+        tp->nextSubmit = ops;
+        ops = tp;
+        tp = next;
+    }
+
+    while (ops) {
+        struct UsbusTransferPriv *next = ops->nextSubmit;
+        struct UsbusTransfer *t = &ops->transfer;
+
+        t->transferredlength = 0;
+        if (!t->device->isOpen || platformSubmit(t) != UsbusOK) {
+            dispatchTransferCompletion(t, UsbusStatusGenericError);
+        }
+        ops = next;
+    }
+
+    tp = atomicExchangePtr(&c->cancelQueue, 0);
+    while (tp) {
+        struct UsbusTransferPriv *next = tp->nextCancel;
+        tp->nextCancel = ops;
+        ops = tp;
+        tp = next;
+    }
+
+    while (ops) {
+        struct UsbusTransferPriv *next = ops->nextCancel;
+        struct UsbusTransfer *t = &ops->transfer;
+
+        if (t->device->isOpen) {
+            platformCancel(t);
+        }
+        ops = next;
+    }
+}
+
+static int runEvents(UsbusContext *c, unsigned timeoutMillis)
+{
+    /*
+     * Mark this thread as the event thread while processing, so that
+     * transfers resubmitted from callbacks go straight to the platform.
+     * Queued ops are drained before waiting, and again after in case
+     * the wait was cut short by a wakeup.
+     *
+     * OUT streams with buffered data, and transfer timeouts, also limit
+     * how long we wait.
+     */
+
+    if (!c->threadSafe && !c->outStreams && !timerPending(&c->timers)) {
+        return ctxPlatform(c)->processEvents(c, timeoutMillis);
+    }
+
+    UsbusContext *prev = tlsEventCtx;
+    tlsEventCtx = c;
+
+    if (c->threadSafe) {
+        drainOps(c);
+    }
+    if (c->outStreams) {
+        timeoutMillis = serviceStreams(c, timeoutMillis);
+    }
+    if (timerPending(&c->timers)) {
+        timeoutMillis = timerWaitMillis(&c->timers, timeoutMillis);
+    }
+
+    int r = ctxPlatform(c)->processEvents(c, timeoutMillis);
+
+    if (timerPending(&c->timers)) {
+        expireTimers(c);
+    }
+    if (c->threadSafe) {
+        drainOps(c);
+    }
+    if (c->outStreams) {
+        serviceStreams(c, 0);
+    }
+
+    tlsEventCtx = prev;
+    return r;
+}
+
+static int platformSubmit(struct UsbusTransfer *t)
+{
+    /*
+     * Arm the transfer's timeout and record stats before handing it to
+     * the platform, in case it completes before the platform returns.
+     */
+
+    struct TimerWheel *w = &t->device->ctx->timers;
+    struct UsbusTransferPriv *tp = transferPriv(t);
+
+    tp->timedOut = 0;
+    tp->cancelRequested = 0;
+    if (t->timeout) {
+        timerArm(w, &tp->timer, t->timeout);
+    }
+    statsSubmitted(t);
+    traceTransfer(t, TraceEnqueue, 0);
+    captureTransfer(t, 'S', 0);
+    recordSubmitted(t);
+
+    int r = devPlatform(t->device)->submitTransfer(t);
+    if (r != UsbusOK) {
+        timerDisarm(w, &tp->timer);
+        statsSubmitFailed(t);
+        traceTransfer(t, TraceSubmitFailed, r);
+        captureTransfer(t, 'E', r);
+    }
+    return r;
+}
+
+static void expireTimers(UsbusContext *c)
+{
+    /*
+     * Cancel transfers whose timeout has passed. The platform completes
+     * them as canceled, which dispatchTransferCompletion() reports as UsbusTimeout.
+     * A transfer that can no longer be canceled has already completed,
+     * and is reported as such.
+     */
+
+    timerAdvance(&c->timers);
+
+    struct TimerEntry *e;
+    while ((e = timerNextExpired(&c->timers))) {
+        struct UsbusTransferPriv *tp = timerTransfer(e);
+        struct UsbusTransfer *t = &tp->transfer;
+
+        tp->timedOut = 1;
+        traceTransfer(t, TraceTimeout, 0);
+        if (platformCancel(t) != UsbusOK) {
+            logdebug("expireTimers(): failed to cancel transfer on endpoint 0x%02x", t->endpoint);
+            tp->timedOut = 0;
+        }
+    }
+}
+
+void disarmDeviceTimers(UsbusDevice *d)
+{
+    /*
+     * Closing a device drops its pending transfers without completing them,
+     * so their timeouts must go too.
+     */
+
+    if (timerPending(&d->ctx->timers)) {
+        timerDisarmMatching(&d->ctx->timers, timerOnDevice, d);
+    }
+}
+
+static int timerOnDevice(struct TimerEntry *e, void *d)
+{
+    return timerTransfer(e)->transfer.device == d;
+}
+
+static int isPooled(const struct UsbusTransfer *t, const char *caller)
+{
+    /*
+     * Transfers keep private state in front of the public struct, so one
+     * declared elsewhere would have memory it doesn't own written to.
+     */
+
+    if (transferPoolOwns(&transferPool, t)) {
+        return 1;
+    }
+
+    logerror("%s(): transfer wasn't allocated by usbusAllocateTransfer()", caller);
+    return 0;
+}
+
+static int hasSetup(const struct UsbusTransfer *t, const char *caller)
+{
+    /*
+     * Control transfers must at least carry their setup packet.
+     */
+
+    if (!usbusTransferIsControl(t) || t->requestedLength >= USBUS_CONTROL_SETUP_SIZE) {
+        return 1;
+    }
+
+    logerror("%s(): control transfer without a setup packet", caller);
+    return 0;
+}
+
+static int platformCancel(struct UsbusTransfer *t)
+{
+    /*
+     * Tell this transfer's cancellation apart from those that come along
+     * with it, see dispatchTransferCompletion().
+     */
+
+    transferPriv(t)->cancelRequested = 1;
+    return devPlatform(t->device)->cancelTransfer(t);
+}
+
+static void unlinkCompleted(struct UsbusTransferPriv *tp)
+{
+    /*
+     * Remove `tp` from its context's completion queue. Only for transfers
+     * released before being polled, so walking the queue is fine.
+     */
+
+    struct UsbusContext *c = tp->completedCtx;
+    struct UsbusTransferPriv *prev = 0;
+    struct UsbusTransferPriv *q;
+
+    for (q = c->completedHead; q && q != tp; q = q->nextCompleted) {
+        prev = q;
+    }
+    if (!q) {
+        return;
+    }
+
+    if (prev) {
+        prev->nextCompleted = tp->nextCompleted;
+    } else {
+        c->completedHead = tp->nextCompleted;
+    }
+    if (c->completedTail == tp) {
+        c->completedTail = prev;
+    }
+    tp->completedCtx = 0;
 }
@@ -1,76 +1,540 @@
 
 #include "logger.h"
 #include "usbus.h"
+#include "usbus_limits.h"
+#include "atomics.h"
+#include "clock.h"
+#include "thread.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
-static enum UsbusLogLevel gLogLevel = UsbusLogError;
+/*
+ * In async modes, log calls only capture the format string and a copy of
+ * their arguments into a bounded lock-free ring (multi producer, single
+ * consumer), leaving the formatting and I/O to the consumer. Format strings
+ * must therefore be literals, which all of ours are. A full ring drops
+ * messages rather than blocking, and the drops are reported once there's room.
+ */
+
+#define LOG_LINE_SIZE       512
+#define LOG_MAX_ARGS        8
+#define LOG_TEXT_SIZE       192
+#define LOG_RECORD_MASK     (USBUS_LOG_RECORDS - 1)
+#define LOG_IDLE_NANOS      1000000
+
+#if (USBUS_LOG_RECORDS & LOG_RECORD_MASK) != 0 || USBUS_LOG_RECORDS < 2
+#error USBUS_LOG_RECORDS must be a power of 2
+#endif
+
+// sequence number of a free record, in the round of the ring containing `pos`
+#define LOG_ROUND(pos)      ((pos) & ~(uint32_t)LOG_RECORD_MASK)
+
+union LogArg {
+    int64_t i;
+    uint64_t u;                         // also the offset within LogRecord::text of string args
+    double f;
+    const void *p;
+};
+
+struct LogRecord {
+    volatile uint32_t seq;              // LOG_ROUND() while free, + 1 once written
+    uint8_t level;
+    uint8_t numArgs;
+    const char *fmt;                    // null if text holds the already formatted message
+    union LogArg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_SIZE];
+};
+
+struct LogSpec {
+    const char *begin;                  // the '%'
+    const char *end;                    // just past the conversion
+    char length;                        // 'H' for hh, 'L' for ll (and long double), otherwise as written
+    char conversion;
+    uint8_t stars;                      // '*' width and precision, each taking an int argument
+};
+
+int gLogLevel = UsbusLogError;
+
+static UsbusLogCallback gLogCallback;
+static void *gLogUserData;
+
+static volatile uint32_t gLogMode = UsbusLogSync;
+static volatile uint32_t gLogDropped;
+static struct LogRecord gRing[USBUS_LOG_RECORDS];
+static volatile uint32_t gRingTail;     // next position to write
+static uint32_t gRingHead;              // next position to read, consumer only
+
+static volatile uint32_t gThreadRunning;
+static Thread gThread;
+
+static void enqueue(enum UsbusLogLevel level, const char *fmt, va_list ap);
+static int captureArgs(struct LogRecord *r, const char *fmt, va_list ap);
+static void formatRecord(const struct LogRecord *r, char *buf, unsigned len);
+static const char *parseSpec(const char *p, struct LogSpec *spec);
+static void deliver(enum UsbusLogLevel level, const char *msg);
+static void consumerThread(void *arg);
+
+
+/**************
+ * API
+ **************/
 
 void usbusSetLogLevel(enum UsbusLogLevel lvl)
 {
     gLogLevel = lvl;
 }
 
-void logdebug(const char * fmt, ...)
+void usbusSetLogCallback(UsbusLogCallback cb, void *userData)
 {
-    if (gLogLevel < UsbusLogDebug) {
-        return;
+    /*
+     * Hand formatted messages to `cb`, rather than writing them to stderr.
+     * In UsbusLogAsync mode, `cb` is called on the logger's thread.
+     * Set before any logging is expected - changes aren't synchronized.
+     */
+
+    gLogCallback = cb;
+    gLogUserData = userData;
+}
+
+int usbusSetLogMode(enum UsbusLogMode mode)
+{
+    /*
+     * Switch between formatting messages as they're logged, and capturing
+     * them for a consumer to format later - either the logger's own thread,
+     * or the application via usbusDrainLog().
+     *
+     * Messages still buffered when leaving an async mode are flushed here.
+     */
+
+    uint32_t prev = atomicExchange32(&gLogMode, mode);
+
+    if (prev == UsbusLogAsync && mode != UsbusLogAsync) {
+        atomicStore32(&gThreadRunning, 0);
+        threadJoin(gThread);
+    }
+    if (prev != UsbusLogSync && mode == UsbusLogSync) {
+        usbusDrainLog();
     }
 
+    if (mode == UsbusLogAsync && prev != UsbusLogAsync) {
+        atomicStore32(&gThreadRunning, 1);
+        if (threadStart(&gThread, consumerThread, 0) != 0) {
+            atomicStore32(&gThreadRunning, 0);
+            atomicStore32(&gLogMode, UsbusLogSync);
+            usbusDrainLog();
+            logerror("usbusSetLogMode(): failed to start logger thread");
+            return -1;
+        }
+    }
+
+    return UsbusOK;
+}
+
+unsigned usbusDrainLog()
+{
+    /*
+     * Format and deliver buffered messages, returning the number delivered.
+     * Must only be called from one thread at a time, and never while
+     * in UsbusLogAsync mode, whose thread does this itself.
+     */
+
+    unsigned n = 0;
+    char msg[LOG_LINE_SIZE];
+
+    for (;;) {
+        struct LogRecord *r = &gRing[gRingHead & LOG_RECORD_MASK];
+        if (atomicLoad32(&r->seq) != LOG_ROUND(gRingHead) + 1) {
+            break;
+        }
+
+        formatRecord(r, msg, sizeof msg);
+        enum UsbusLogLevel level = (enum UsbusLogLevel)r->level;
+        atomicStore32(&r->seq, LOG_ROUND(gRingHead) + USBUS_LOG_RECORDS);
+        gRingHead++;
+
+        deliver(level, msg);
+        n++;
+    }
+
+    uint32_t dropped = atomicExchange32(&gLogDropped, 0);
+    if (dropped) {
+        snprintf(msg, sizeof msg, "log ring full, dropped %u messages", dropped);
+        deliver(UsbusLogWarning, msg);
+    }
+
+    return n;
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+void logWrite(enum UsbusLogLevel level, const char *fmt, ...)
+{
+    /*
+     * Called via the log macros, once the level has been checked.
+     */
+
     va_list ap;
     va_start(ap, fmt);
 
-    fprintf(stderr, "  [DEBUG] ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    if (atomicLoad32(&gLogMode) != UsbusLogSync) {
+        enqueue(level, fmt, ap);
+    } else {
+        char msg[LOG_LINE_SIZE];
+        vsnprintf(msg, sizeof msg, fmt, ap);
+        deliver(level, msg);
+    }
 
     va_end(ap);
 }
 
-void logwarn(const char * fmt, ...)
+static void enqueue(enum UsbusLogLevel level, const char *fmt, va_list ap)
 {
-    if (gLogLevel < UsbusLogWarning) {
-        return;
+    /*
+     * Claim the next record by advancing the tail, then publish it via its
+     * sequence number once written.
+     */
+
+    uint32_t pos = atomicLoad32(&gRingTail);
+    struct LogRecord *r;
+
+    for (;;) {
+        r = &gRing[pos & LOG_RECORD_MASK];
+        int32_t diff = (int32_t)(atomicLoad32(&r->seq) - LOG_ROUND(pos));
+        if (diff == 0) {
+            if (atomicCompareExchange32(&gRingTail, &pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // not yet consumed since the ring last wrapped
+            atomicFetchAdd32(&gLogDropped, 1);
+            return;
+        } else {
+            pos = atomicLoad32(&gRingTail);
+        }
     }
 
-    va_list ap;
-    va_start(ap, fmt);
+    r->level = (uint8_t)level;
 
-    fprintf(stderr, "  [WARN] ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    va_list args;
+    va_copy(args, ap);
+    int captured = captureArgs(r, fmt, args);
+    va_end(args);
 
-    va_end(ap);
+    if (!captured) {
+        // more arguments than we can hold, or conversions we don't handle - format it now instead
+        r->fmt = 0;
+        vsnprintf(r->text, sizeof r->text, fmt, ap);
+    }
+
+    atomicStore32(&r->seq, LOG_ROUND(pos) + 1);
+}
+
+static int captureArgs(struct LogRecord *r, const char *fmt, va_list ap)
+{
+    /*
+     * Copy out the arguments `fmt` refers to, widened to 64 bits, along
+     * with the contents of any strings. Returns 0 if they won't fit.
+     */
+
+    unsigned n = 0;
+    unsigned text = 0;
+    const char *p = fmt;
+
+    while ((p = strchr(p, '%'))) {
+        struct LogSpec spec;
+        p = parseSpec(p, &spec);
+        if (!p) {
+            return 0;
+        }
+        if (spec.conversion == '%') {
+            continue;
+        }
+        if (n + spec.stars + 1 > LOG_MAX_ARGS) {
+            return 0;
+        }
+
+        unsigned i;
+        for (i = 0; i < spec.stars; ++i) {
+            r->args[n++].i = va_arg(ap, int);
+        }
+
+        union LogArg *a = &r->args[n++];
+
+        switch (spec.conversion) {
+        case 'd':
+        case 'i':
+            switch (spec.length) {
+            case 'l': a->i = va_arg(ap, long); break;
+            case 'L': a->i = va_arg(ap, long long); break;
+            case 'z': a->i = (int64_t)va_arg(ap, size_t); break;
+            case 'j': a->i = va_arg(ap, intmax_t); break;
+            case 't': a->i = va_arg(ap, ptrdiff_t); break;
+            default:  a->i = va_arg(ap, int); break;
+            }
+            break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            switch (spec.length) {
+            case 'l': a->u = va_arg(ap, unsigned long); break;
+            case 'L': a->u = va_arg(ap, unsigned long long); break;
+            case 'z': a->u = va_arg(ap, size_t); break;
+            case 'j': a->u = va_arg(ap, uintmax_t); break;
+            case 't': a->u = (uint64_t)va_arg(ap, ptrdiff_t); break;
+            default:  a->u = va_arg(ap, unsigned); break;
+            }
+            // hh and h values were promoted, so truncate them back down
+            if (spec.length == 'H') {
+                a->u = (unsigned char)a->u;
+            } else if (spec.length == 'h') {
+                a->u = (unsigned short)a->u;
+            }
+            break;
+
+        case 'c':
+            a->i = va_arg(ap, int);
+            break;
+
+        case 'e': case 'E':
+        case 'f': case 'F':
+        case 'g': case 'G':
+        case 'a': case 'A':
+            a->f = spec.length == 'L' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+            break;
+
+        case 'p':
+            a->p = va_arg(ap, void*);
+            break;
+
+        case 's': {
+            const char *s = va_arg(ap, const char*);
+            if (!s) {
+                s = "(null)";
+            }
+            size_t len = strlen(s);
+            if (text + len + 1 > sizeof r->text) {
+                len = text + 1 < sizeof r->text ? sizeof r->text - text - 1 : 0;
+            }
+            memcpy(&r->text[text], s, len);
+            r->text[text + len] = '\0';
+            a->u = text;
+            text += (unsigned)len + 1;
+            if (text > sizeof r->text) {
+                text = sizeof r->text - 1;
+            }
+            break;
+        }
+
+        default:
+            return 0;
+        }
+    }
+
+    r->fmt = fmt;
+    r->numArgs = (uint8_t)n;
+    return 1;
 }
 
-void logerror(const char * fmt, ...)
+static void formatRecord(const struct LogRecord *r, char *buf, unsigned len)
 {
-    if (gLogLevel < UsbusLogError) {
+    /*
+     * printf() the captured arguments one conversion at a time, each with
+     * its width and precision resolved and its length normalized to
+     * match how it was captured.
+     */
+
+    if (!r->fmt) {
+        snprintf(buf, len, "%s", r->text);
         return;
     }
 
-    va_list ap;
-    va_start(ap, fmt);
+    unsigned pos = 0;
+    unsigned n = 0;
+    const char *p = r->fmt;
 
-    fprintf(stderr, "  [ERR] ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    buf[0] = '\0';
 
-    va_end(ap);
+    while (*p && pos + 1 < len) {
+
+        if (*p != '%') {
+            buf[pos++] = *p++;
+            buf[pos] = '\0';
+            continue;
+        }
+
+        struct LogSpec spec;
+        const char *next = parseSpec(p, &spec);
+
+        if (spec.conversion == '%') {
+            buf[pos++] = '%';
+            buf[pos] = '\0';
+            p = next;
+            continue;
+        }
+
+        // rebuild the spec without '*' or length modifiers
+        char fmt[64];
+        unsigned f = 0;
+        const char *s;
+        for (s = spec.begin; s < spec.end - 1 && f < sizeof fmt - 24; ++s) {
+            if (*s == '*') {
+                f += snprintf(&fmt[f], sizeof fmt - f, "%d", (int)r->args[n++].i);
+            } else if (!strchr("hljztL", *s)) {
+                fmt[f++] = *s;
+            }
+        }
+
+        const union LogArg *a = &r->args[n++];
+        int w;
+
+        switch (spec.conversion) {
+        case 'd': case 'i':
+        case 'u': case 'o':
+        case 'x': case 'X':
+            fmt[f++] = 'l';
+            fmt[f++] = 'l';
+            fmt[f++] = spec.conversion;
+            fmt[f] = '\0';
+            w = snprintf(&buf[pos], len - pos, fmt, a->u);
+            break;
+
+        case 'c':
+            fmt[f++] = 'c';
+            fmt[f] = '\0';
+            w = snprintf(&buf[pos], len - pos, fmt, (int)a->i);
+            break;
+
+        case 'p':
+            fmt[f++] = 'p';
+            fmt[f] = '\0';
+            w = snprintf(&buf[pos], len - pos, fmt, a->p);
+            break;
+
+        case 's':
+            fmt[f++] = 's';
+            fmt[f] = '\0';
+            w = snprintf(&buf[pos], len - pos, fmt, &r->text[a->u]);
+            break;
+
+        default:
+            fmt[f++] = spec.conversion;
+            fmt[f] = '\0';
+            w = snprintf(&buf[pos], len - pos, fmt, a->f);
+            break;
+        }
+
+        if (w > 0) {
+            pos += (unsigned)w < len - pos ? (unsigned)w : len - pos - 1;
+        }
+        p = next;
+    }
 }
 
-void loginfo(const char * fmt, ...)
+static const char *parseSpec(const char *p, struct LogSpec *spec)
 {
-    if (gLogLevel < UsbusLogInfo) {
+    /*
+     * Parse the conversion starting at `p`, returning the position just
+     * past it, or null if it's malformed.
+     */
+
+    spec->begin = p++;
+    spec->length = 0;
+    spec->stars = 0;
+
+    while (*p && strchr("-+ #0", *p)) {
+        p++;
+    }
+
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (*p == 'h' || *p == 'l') {
+        spec->length = *p++;
+        if (*p == spec->length) {
+            spec->length = spec->length == 'h' ? 'H' : 'L';
+            p++;
+        }
+    } else if (*p && strchr("zjtL", *p)) {
+        spec->length = *p++;
+    }
+
+    if (!*p) {
+        return 0;
+    }
+
+    spec->conversion = *p++;
+    spec->end = p;
+    return p;
+}
+
+static void deliver(enum UsbusLogLevel level, const char *msg)
+{
+    /*
+     * Messages go to stderr in a single write, so those from different
+     * threads don't interleave.
+     */
+
+    if (gLogCallback) {
+        gLogCallback(level, msg, gLogUserData);
         return;
     }
 
-    va_list ap;
-    va_start(ap, fmt);
+    const char *prefix;
+    switch (level) {
+    case UsbusLogError:     prefix = "ERR"; break;
+    case UsbusLogWarning:   prefix = "WARN"; break;
+    case UsbusLogDebug:     prefix = "DEBUG"; break;
+    default:                prefix = "INFO"; break;
+    }
 
-    fprintf(stderr, "  [INFO] ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    char line[LOG_LINE_SIZE + 16];
+    int n = snprintf(line, sizeof line, "  [%s] %s\n", prefix, msg);
+    if (n < 0) {
+        return;
+    }
+    if ((unsigned)n >= sizeof line) {
+        n = sizeof line - 1;
+        line[n - 1] = '\n';
+    }
+    fwrite(line, 1, (size_t)n, stderr);
+}
 
-    va_end(ap);
+static void consumerThread(void *arg)
+{
+    /*
+     * Drain the ring until asked to stop, backing off while it's idle.
+     * Whatever's left once stopped is drained by usbusSetLogMode().
+     */
+
+    (void)arg;
+
+    while (atomicLoad32(&gThreadRunning)) {
+        if (usbusDrainLog() == 0) {
+            sleepNanos(LOG_IDLE_NANOS);
+        }
+    }
 }
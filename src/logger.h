@@ -1,11 +1,33 @@
 #ifndef _LOGGER_H
 #define _LOGGER_H
 
-#include <stdarg.h>
+#include "usbus.h"
 
-void logerror(const char * fmt, ...);
-void logwarn (const char * fmt, ...);
-void logdebug(const char * fmt, ...);
-void loginfo(const char * fmt, ...);
+/*
+ * Messages less severe than USBUS_MIN_LOG_LEVEL are compiled out entirely,
+ * eg. -DUSBUS_MIN_LOG_LEVEL=UsbusLogWarning for release builds that never
+ * need debug output. Those that remain cost a single comparison when
+ * filtered out at runtime by usbusSetLogLevel().
+ */
+#ifndef USBUS_MIN_LOG_LEVEL
+#define USBUS_MIN_LOG_LEVEL UsbusLogInfo
+#endif
+
+extern int gLogLevel;
+
+void logWrite(enum UsbusLogLevel level, const char *fmt, ...);
+
+// arguments are still referenced when compiled out, so they don't become unused variables
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) <= USBUS_MIN_LOG_LEVEL && (level) <= gLogLevel) { \
+            logWrite((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define logerror(...)   LOG_AT(UsbusLogError, __VA_ARGS__)
+#define logwarn(...)    LOG_AT(UsbusLogWarning, __VA_ARGS__)
+#define logdebug(...)   LOG_AT(UsbusLogDebug, __VA_ARGS__)
+#define loginfo(...)    LOG_AT(UsbusLogInfo, __VA_ARGS__)
 
 #endif // _LOGGER_H
@@ -0,0 +1,162 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Match filters are evaluated by each platform while it enumerates, using
+ * whatever it can learn about a device without opening it (sysfs attributes,
+ * registry properties, etc). Devices that don't match are skipped before a
+ * UsbusDevice is ever allocated for them.
+ */
+
+static void clearFilter(struct UsbusMatchFilter *f);
+
+
+/**************
+ * API
+ **************/
+
+int usbusSetMatchFilter(UsbusContext *ctx, const struct UsbusMatchFilter *filter)
+{
+    /*
+     * Restrict the devices reported by usbusListen() to those matching `filter`,
+     * or report all devices again if `filter` is null.
+     * Everything referenced by `filter` is copied, so it needn't outlive this call.
+     * Must be called before usbusListen().
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    struct UsbusMatchFilter m = { 0 };
+
+    if (filter) {
+        m = *filter;
+        m.ids = 0;
+        m.serialPrefix = 0;
+
+        if (filter->numIds) {
+            if (!filter->ids) {
+                return UsbusBadParameter;
+            }
+            struct UsbusDeviceId *ids = malloc(filter->numIds * sizeof *ids);
+            if (!ids) {
+                logerror("usbusSetMatchFilter(): failed to malloc ids");
+                return -1;
+            }
+            memcpy(ids, filter->ids, filter->numIds * sizeof *ids);
+            m.ids = ids;
+        }
+
+        if (filter->serialPrefix && filter->serialPrefix[0]) {
+            char *prefix = malloc(strlen(filter->serialPrefix) + 1);
+            if (!prefix) {
+                logerror("usbusSetMatchFilter(): failed to malloc serial prefix");
+                clearFilter(&m);
+                return -1;
+            }
+            strcpy(prefix, filter->serialPrefix);
+            m.serialPrefix = prefix;
+        }
+    }
+
+    clearFilter(&c->match);
+    c->match = m;
+    return UsbusOK;
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+int matchDevice(UsbusContext *ctx, const struct UsbusDeviceDescriptor *desc, uint8_t busNumber)
+{
+    /*
+     * Check everything but the serial number, which callers only fetch
+     * if matchNeedsSerial() says it's required.
+     */
+
+    const struct UsbusMatchFilter *f = &ctx->match;
+
+    if (!matchIds(ctx, desc->idVendor, desc->idProduct)) {
+        return 0;
+    }
+
+    if ((f->flags & UsbusMatchClass) && desc->bDeviceClass != f->deviceClass) {
+        return 0;
+    }
+    if ((f->flags & UsbusMatchSubClass) && desc->bDeviceSubClass != f->deviceSubClass) {
+        return 0;
+    }
+    if ((f->flags & UsbusMatchProtocol) && desc->bDeviceProtocol != f->deviceProtocol) {
+        return 0;
+    }
+    if ((f->flags & UsbusMatchBus) && busNumber != f->busNumber) {
+        return 0;
+    }
+
+    return 1;
+}
+
+int matchIds(UsbusContext *ctx, uint16_t idVendor, uint16_t idProduct)
+{
+    /*
+     * For platforms that learn the vendor and product IDs before the rest of the descriptor.
+     */
+
+    const struct UsbusMatchFilter *f = &ctx->match;
+    if (f->numIds == 0) {
+        return 1;
+    }
+
+    unsigned i;
+    for (i = 0; i < f->numIds; ++i) {
+        if (f->ids[i].idVendor == idVendor &&
+            (f->ids[i].idProduct == 0 || f->ids[i].idProduct == idProduct)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int matchSerial(UsbusContext *ctx, const char *serial)
+{
+    /*
+     * `serial` may be null for devices that don't report one,
+     * which never match a serial prefix.
+     */
+
+    const char *prefix = ctx->match.serialPrefix;
+    if (!prefix) {
+        return 1;
+    }
+    return serial && strncmp(serial, prefix, strlen(prefix)) == 0;
+}
+
+int matchSerialDescriptor(UsbusContext *ctx, const uint8_t *desc)
+{
+    /*
+     * As matchSerial(), for a raw UTF-16LE string descriptor.
+     */
+
+    if (!ctx->match.serialPrefix) {
+        return 1;
+    }
+    if (!desc) {
+        return 0;
+    }
+
+    // a string descriptor holds at most 126 UTF-16 units, each of which takes at most 3 bytes of UTF-8
+    char serial[126 * 3 + 1];
+    utf16ToUtf8(desc, serial, sizeof serial);
+    return matchSerial(ctx, serial);
+}
+
+static void clearFilter(struct UsbusMatchFilter *f)
+{
+    free((void*)f->ids);
+    free((void*)f->serialPrefix);
+    memset(f, 0, sizeof *f);
+}
@@ -0,0 +1,1597 @@
+
+#include "emulated.h"
+#include "usbus.h"
+#include "usbus_private.h"
+#include "clock.h"
+#include "atomics.h"
+#include "logger.h"
+#include "record.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * In-process virtual devices.
+ *
+ * Devices are described by a UsbusEmuDeviceConfig, and each endpoint
+ * completes transfers according to its UsbusEmuBehavior after a fixed latency.
+ * No OS facilities are involved, which makes this backend suitable for
+ * measuring the overhead of the library itself, and for running on machines
+ * without any USB hardware attached.
+ *
+ * Devices can also be replayed from a recording (see usbusStartRecording()),
+ * each endpoint completing transfers with the data, status and timing of
+ * those recorded on it, in the order they were submitted.
+ */
+
+#define DEVICE_DESC_LEN         18
+#define CONFIG_DESC_LEN         9
+#define INTERFACE_DESC_LEN      9
+#define ENDPOINT_DESC_LEN       7
+#define EMU_QUEUE_INITIAL       16
+#define EMU_LOOPBACK_FIFO       (64 * 1024)
+#define EMU_WAKEUP_SLICE_NANOS  1000000     // longest sleep between wakeup checks
+
+const struct UsbusPlatform platformEmulated = {
+    "Emulated",
+    emuListen,
+    emuStopListen,
+    emuGetStringDescriptor,
+    emuOpen,
+    emuClose,
+    emuGetConfigDescriptor,
+    emuGetInterfaceDescriptor,
+    emuGetEndpointDescriptor,
+    emuOpenInterface,
+    emuCloseInterface,
+    emuGetConfiguration,
+    emuSetConfiguration,
+    emuSubmitTransfer,
+    emuCancelTransfer,
+    emuProcessEvents,
+    emuReadSync,
+    emuWriteSync,
+    0,
+    0,
+    emuSubmitTransfers,
+    0,
+    emuWakeup,
+    0,
+    emuGetDescriptor,
+    0
+};
+
+// a registered device, from which any number of UsbusDevices are created
+struct EmuDeviceModel {
+    struct UsbusDeviceDescriptor descriptor;
+    enum UsbusSpeed speed;
+    uint8_t *configDescriptors;
+    unsigned configDescriptorsLen;
+    uint8_t **strings;                  // complete string descriptors, strings[0] is index 1
+    unsigned numStrings;
+    struct UsbusEmuEndpoint *endpoints;
+    unsigned numEndpoints;
+    uint8_t *bos;
+    unsigned bosLen;
+    struct EmuReplay *replay;           // for devices from usbusEmuAddReplay()
+};
+
+// transfers recorded on one endpoint, in the order they were submitted
+struct EmuReplayEndpoint {
+    const struct RecordHeader **records;
+    unsigned numRecords;
+};
+
+struct EmuReplay {
+    struct ReplayLog *log;              // shared by all the devices from one recording
+    unsigned speedup;                   // 0 for as fast as possible
+    uint64_t firstSubmitted;            // recording time of the device's first submission
+    struct EmuReplayEndpoint *endpoints;    // parallel to EmuDeviceModel::endpoints
+};
+
+struct EmuPending {
+    struct UsbusTransfer *t;
+    uint64_t due;                       // monotonicNanos() at which the transfer may complete
+    const struct RecordHeader *record;  // what a replayed transfer completes with
+};
+
+// per endpoint state for an open device
+struct EmuEndpoint {
+    const struct UsbusEmuEndpoint *cfg;
+    UsbusDevice *device;
+    struct EmuEndpoint *peer;           // IN endpoint that receives loopback data
+    struct EmuEndpoint *feeder;         // OUT endpoint whose data loops back to this one
+    uint64_t latency;                   // nanos
+    struct EmuPending *queue;           // ring of pending transfers
+    unsigned head;
+    unsigned count;
+    unsigned capacity;                  // power of 2
+    uint8_t fill;                       // next byte used to fill source data
+    unsigned replayNext;                // next recorded transfer to pair with a submission
+    uint8_t *fifo;                      // loopback data waiting for IN transfers, as length prefixed messages
+    unsigned fifoSize;                  // power of 2
+    unsigned fifoRd;                    // free running
+    unsigned fifoWr;
+    unsigned readyIndex;                // position in EmuContext::ready + 1, 0 if not in it
+    uint64_t readyDue;                  // due time of the first queued transfer, while ready
+    uint8_t blocked;                    // waiting on the loopback fifo, so not ready
+};
+
+static int addModel(UsbusContext *ctx, struct EmuDeviceModel *m);
+static void dispatchModel(UsbusContext *ctx, struct EmuDeviceModel *m, unsigned index);
+static void freeModel(struct EmuDeviceModel *m);
+static int synthesizeConfig(struct EmuDeviceModel *m);
+static struct EmuDeviceModel *replayModel(struct ReplayLog *log, const struct RecordHeader *dev, unsigned speedup);
+static int replayEndpoints(struct EmuDeviceModel *m, struct ReplayLog *log, unsigned device);
+static uint8_t *stringDescriptorFromUtf8(const char *s);
+static int findConfig(struct EmuDeviceModel *m, unsigned index, const uint8_t **cfg, unsigned *len);
+static const uint8_t *findInterface(const uint8_t *cfg, unsigned len, unsigned number, unsigned altsetting);
+static struct EmuEndpoint *endpointFor(UsbusDevice *d, uint8_t ep);
+static int queuePush(struct EmuEndpoint *e, struct UsbusTransfer *t, uint64_t due, const struct RecordHeader *record);
+static int replaySubmit(UsbusDevice *d, struct EmuEndpoint *e, struct UsbusTransfer *t, uint64_t now);
+static void completeTransfer(struct UsbusTransfer *t, int length, enum UsbusStatus status);
+static void readyUpdate(struct EmuContext *ec, struct EmuEndpoint *e);
+static void readyRemove(struct EmuContext *ec, struct EmuEndpoint *e);
+static unsigned processEndpoint(UsbusDevice *d, struct EmuEndpoint *e, uint64_t now);
+static unsigned processCanceled(struct EmuContext *ec);
+static int syncTransfer(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
+
+
+/**************
+ * API
+ **************/
+
+int usbusEmuAddDevice(UsbusContext *ctx, const struct UsbusEmuDeviceConfig *cfg)
+{
+    /*
+     * Register a virtual device with the given context.
+     * Everything referenced by `cfg` is copied, so it needn't outlive this call.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (cfg->numEndpoints > 30) {
+        logerror("usbusEmuAddDevice(): too many endpoints (%d)", cfg->numEndpoints);
+        return UsbusBadParameter;
+    }
+
+    struct EmuDeviceModel *m = malloc(sizeof *m);
+    if (!m) {
+        logerror("usbusEmuAddDevice(): failed to allocate device model");
+        return -1;
+    }
+    memset(m, 0, sizeof *m);
+
+    m->descriptor = cfg->descriptor;
+    m->descriptor.bLength = DEVICE_DESC_LEN;
+    m->descriptor.bDescriptorType = UsbusDescriptorDevice;
+    m->speed = cfg->speed;
+
+    if (cfg->numEndpoints) {
+        m->endpoints = malloc(cfg->numEndpoints * sizeof *m->endpoints);
+        if (!m->endpoints) {
+            goto fail;
+        }
+        memcpy(m->endpoints, cfg->endpoints, cfg->numEndpoints * sizeof *m->endpoints);
+        m->numEndpoints = cfg->numEndpoints;
+    }
+
+    if (cfg->configDescriptors) {
+        m->configDescriptors = malloc(cfg->configDescriptorsLen);
+        if (!m->configDescriptors) {
+            goto fail;
+        }
+        memcpy(m->configDescriptors, cfg->configDescriptors, cfg->configDescriptorsLen);
+        m->configDescriptorsLen = cfg->configDescriptorsLen;
+    } else if (synthesizeConfig(m) != UsbusOK) {
+        goto fail;
+    }
+
+    if (cfg->bos) {
+        m->bos = malloc(cfg->bosLen);
+        if (!m->bos) {
+            goto fail;
+        }
+        memcpy(m->bos, cfg->bos, cfg->bosLen);
+        m->bosLen = cfg->bosLen;
+    }
+
+    if (cfg->numStrings) {
+        m->strings = malloc(cfg->numStrings * sizeof *m->strings);
+        if (!m->strings) {
+            goto fail;
+        }
+        for (m->numStrings = 0; m->numStrings < cfg->numStrings; ++m->numStrings) {
+            m->strings[m->numStrings] = stringDescriptorFromUtf8(cfg->strings[m->numStrings]);
+            if (!m->strings[m->numStrings]) {
+                goto fail;
+            }
+        }
+    }
+
+    if (m->descriptor.bNumConfigurations == 0) {
+        m->descriptor.bNumConfigurations = 1;
+    }
+
+    if (addModel(c, m) != UsbusOK) {
+        goto fail;
+    }
+
+    return UsbusOK;
+
+fail:
+    logerror("usbusEmuAddDevice(): failed to allocate device model");
+    freeModel(m);
+    return -1;
+}
+
+int usbusEmuAddReplay(UsbusContext *ctx, const char *path, unsigned speedup)
+{
+    /*
+     * Register a virtual device for each device in the recording at `path`.
+     * A `speedup` of 1 replays at the recorded pace, N at N times it, and
+     * 0 completes transfers as soon as they're processed.
+     *
+     * The recording stays mapped for the life of the context.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    struct ReplayLog *log = malloc(sizeof *log);
+    if (!log) {
+        logerror("usbusEmuAddReplay(): failed to malloc log");
+        return -1;
+    }
+
+    int r = replayOpen(log, path);
+    if (r != UsbusOK) {
+        free(log);
+        return r;
+    }
+
+    unsigned added = 0;
+    const struct RecordHeader *rec;
+    for (rec = replayFirst(log); rec; rec = replayNext(log, rec)) {
+        if (rec->kind != RecordDevice) {
+            continue;
+        }
+
+        struct EmuDeviceModel *m = replayModel(log, rec, speedup);
+        if (!m) {
+            r = -1;
+            break;
+        }
+        if (addModel(c, m) != UsbusOK) {
+            logerror("usbusEmuAddReplay(): failed to add device");
+            freeModel(m);
+            r = -1;
+            break;
+        }
+        added++;
+    }
+
+    if (added == 0) {
+        if (r == UsbusOK) {
+            logwarn("usbusEmuAddReplay(): no devices in %s", path);
+            r = UsbusNotFound;
+        }
+        replayClose(log);
+        free(log);
+    }
+
+    return r;
+}
+
+int emuListen(UsbusContext *ctx)
+{
+    /*
+     * Platform specific implementation of usbusListen()
+     *
+     * Report each registered device as connected. Devices added afterwards
+     * are reported as they're added.
+     */
+
+    struct EmuContext *ec = &ctx->emu;
+
+    if (ec->listening) {
+        loginfo("usbusListen called on context that's already listening.");
+        return UsbusOK;
+    }
+
+    ec->listening = 1;
+
+    unsigned i;
+    for (i = 0; i < ec->numModels; ++i) {
+        dispatchModel(ctx, ec->models[i], i);
+    }
+
+    return UsbusOK;
+}
+
+void emuStopListen(UsbusContext *ctx)
+{
+    ctx->emu.listening = 0;
+}
+
+
+int emuGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang, uint8_t *buf, unsigned len, unsigned *transferred)
+{
+    (void)lang;
+
+    struct EmuDeviceModel *m = d->emu.model;
+
+    // index 0 is the table of supported languages - US English only
+    static const uint8_t langIds[] = { 4, UsbusDescriptorString, 0x09, 0x04 };
+
+    const uint8_t *desc;
+    if (index == 0) {
+        desc = langIds;
+    } else if (index <= m->numStrings) {
+        desc = m->strings[index - 1];
+    } else {
+        logdebug("emuGetStringDescriptor(): no string at index %d", index);
+        return -1;
+    }
+
+    unsigned n = desc[0] < len ? desc[0] : len;
+    memcpy(buf, desc, n);
+    *transferred = n;
+    return UsbusOK;
+}
+
+
+int emuOpen(UsbusDevice *d)
+{
+    /*
+     * Platform specific implementation of usbusOpen()
+     *
+     * Set up the state for each endpoint, making sure the ready set
+     * has room for all of them.
+     */
+
+    struct EmuDevice *ed = &d->emu;
+    struct EmuDeviceModel *m = ed->model;
+    struct EmuContext *ec = &d->ctx->emu;
+
+    unsigned need = ec->numOpenEndpoints + m->numEndpoints;
+    if (need > ec->readyCapacity) {
+        unsigned cap = ec->readyCapacity ? ec->readyCapacity * 2 : EMU_QUEUE_INITIAL;
+        while (cap < need) {
+            cap *= 2;
+        }
+        struct EmuEndpoint **ready = realloc(ec->ready, cap * sizeof *ready);
+        if (!ready) {
+            logerror("emuOpen(): failed to grow ready set");
+            return -1;
+        }
+        ec->ready = ready;
+        ec->readyCapacity = cap;
+    }
+
+    ed->endpoints = calloc(m->numEndpoints ? m->numEndpoints : 1, sizeof *ed->endpoints);
+    if (!ed->endpoints) {
+        logerror("emuOpen(): failed to allocate endpoints");
+        return -1;
+    }
+    memset(ed->epSlots, 0, sizeof ed->epSlots);
+    ed->replayBase = 0;
+
+    unsigned i;
+    for (i = 0; i < m->numEndpoints; ++i) {
+        struct EmuEndpoint *e = &ed->endpoints[i];
+        e->cfg = &m->endpoints[i];
+        e->device = d;
+        e->latency = (uint64_t)e->cfg->latencyMicros * 1000;
+        ed->epSlots[endpointSlot(e->cfg->address)] = i + 1;
+    }
+
+    // pair up OUT loopback endpoints with the IN endpoint of the same number
+    for (i = 0; i < m->numEndpoints; ++i) {
+        struct EmuEndpoint *e = &ed->endpoints[i];
+        if (e->cfg->behavior == UsbusEmuLoopback && !(e->cfg->address & 0x80)) {
+            struct EmuEndpoint *in = endpointFor(d, e->cfg->address | 0x80);
+            if (in && in->cfg->behavior == UsbusEmuLoopback) {
+                e->peer = in;
+                in->feeder = e;
+            }
+        }
+    }
+
+    const uint8_t *cfg;
+    unsigned cfgLen;
+    if (findConfig(m, 0, &cfg, &cfgLen) == UsbusOK) {
+        ed->config = cfg[5];    // bConfigurationValue
+    }
+
+    ec->numOpenEndpoints += m->numEndpoints;
+    return UsbusOK;
+}
+
+void emuClose(UsbusDevice *d)
+{
+    /*
+     * Any transfers still pending are dropped without their callbacks,
+     * as they would be by closing a device node.
+     */
+
+    struct EmuDevice *ed = &d->emu;
+    struct EmuContext *ec = &d->ctx->emu;
+
+    unsigned i;
+    for (i = 0; i < ed->model->numEndpoints; ++i) {
+        readyRemove(ec, &ed->endpoints[i]);
+        free(ed->endpoints[i].queue);
+        free(ed->endpoints[i].fifo);
+    }
+    free(ed->endpoints);
+    ed->endpoints = 0;
+    ec->numOpenEndpoints -= ed->model->numEndpoints;
+
+    // drop any canceled transfers that belong to this device
+    unsigned n = 0;
+    for (i = 0; i < ec->numCanceled; ++i) {
+        if (ec->canceled[i]->device != d) {
+            ec->canceled[n++] = ec->canceled[i];
+        }
+    }
+    ec->numCanceled = n;
+}
+
+int emuGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                     uint8_t *buf, unsigned len, unsigned *transferred)
+{
+    const uint8_t *src;
+    unsigned srcLen;
+
+    switch (type) {
+    case UsbusDescriptorConfig:
+        if (findConfig(d->emu.model, index, &src, &srcLen) != UsbusOK) {
+            return UsbusNotFound;
+        }
+        break;
+
+    case UsbusDescriptorString:
+        return emuGetStringDescriptor(d, index, lang, buf, len, transferred);
+
+    case UsbusDescriptorBOS:
+        if (!d->emu.model->bos) {
+            return UsbusNotFound;
+        }
+        src = d->emu.model->bos;
+        srcLen = d->emu.model->bosLen;
+        break;
+
+    default:
+        return UsbusNotFound;
+    }
+
+    *transferred = srcLen < len ? srcLen : len;
+    memcpy(buf, src, *transferred);
+    return UsbusOK;
+}
+
+
+int emuGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc)
+{
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(d->emu.model, index, &cfg, &len) != UsbusOK) {
+        return UsbusNotFound;
+    }
+
+    desc->bLength = cfg[0];
+    desc->bDescriptorType = cfg[1];
+    desc->wTotalLength = cfg[2] | (cfg[3] << 8);
+    desc->bNumInterfaces = cfg[4];
+    desc->bConfigurationValue = cfg[5];
+    desc->iConfiguration = cfg[6];
+    desc->bmAttributes = cfg[7];
+    desc->bMaxPower = cfg[8];
+
+    return UsbusOK;
+}
+
+int emuGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc)
+{
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(d->emu.model, 0, &cfg, &len) != UsbusOK) {
+        return UsbusNotFound;
+    }
+
+    const uint8_t *intf = findInterface(cfg, len, index, altsetting);
+    if (!intf) {
+        return UsbusNotFound;
+    }
+
+    memcpy(desc, intf, sizeof(*desc));
+    return UsbusOK;
+}
+
+int emuGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc)
+{
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(d->emu.model, 0, &cfg, &len) != UsbusOK) {
+        return UsbusNotFound;
+    }
+
+    const uint8_t *p = findInterface(cfg, len, intfIndex, 0);
+    if (!p) {
+        return UsbusNotFound;
+    }
+
+    const uint8_t *pend = cfg + len;
+    unsigned e = 0;
+    for (p += p[0]; p + 2 <= pend && p[0] != 0; p += p[0]) {
+        if (p[1] == UsbusDescriptorInterface) {
+            break;
+        }
+
+        if (p[1] == UsbusDescriptorEndpoint && p[0] >= ENDPOINT_DESC_LEN) {
+            if (e++ == ep) {
+                desc->bLength = p[0];
+                desc->bDescriptorType = p[1];
+                desc->bEndpointAddress = p[2];
+                desc->bmAttributes = p[3];
+                desc->wMaxPacketSize = p[4] | (p[5] << 8);
+                desc->bInterval = p[6];
+                return UsbusOK;
+            }
+        }
+    }
+
+    return UsbusNotFound;
+}
+
+int emuOpenInterface(UsbusDevice *d, unsigned index)
+{
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(d->emu.model, 0, &cfg, &len) != UsbusOK || !findInterface(cfg, len, index, 0)) {
+        logdebug("emuOpenInterface(): no interface at index %d", index);
+        return -1;
+    }
+
+    return UsbusOK;
+}
+
+int emuCloseInterface(UsbusDevice *d, unsigned index)
+{
+    (void)d;
+    (void)index;
+    return UsbusOK;
+}
+
+int emuGetConfiguration(UsbusDevice *device, uint8_t *config)
+{
+    *config = device->emu.config;
+    return UsbusOK;
+}
+
+int emuSetConfiguration(UsbusDevice *device, uint8_t config)
+{
+    device->emu.config = config;
+    return UsbusOK;
+}
+
+
+int emuSubmitTransfer(struct UsbusTransfer *t)
+{
+    struct EmuEndpoint *e = endpointFor(t->device, t->endpoint);
+    if (!e) {
+        logwarn("emuSubmitTransfer(): no endpoint 0x%02x", t->endpoint);
+        // only replayed devices model endpoint 0
+        return usbusTransferIsControl(t) ? UsbusNotSupported : -1;
+    }
+
+    if (e->cfg->behavior == UsbusEmuReplay) {
+        return replaySubmit(t->device, e, t, monotonicNanos());
+    }
+
+    uint64_t due = e->latency ? monotonicNanos() + e->latency : 0;
+    return queuePush(e, t, due, 0);
+}
+
+
+int emuSubmitTransfers(struct UsbusTransfer **ts, unsigned n, int *results)
+{
+    /*
+     * All transfers are for the same device - read the clock at most once.
+     */
+
+    UsbusDevice *d = ts[0]->device;
+    uint64_t now = 0;
+    int r = UsbusOK;
+
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+        struct UsbusTransfer *t = ts[i];
+
+        struct EmuEndpoint *e = endpointFor(d, t->endpoint);
+        if (!e) {
+            logwarn("emuSubmitTransfers(): no endpoint 0x%02x", t->endpoint);
+            r = results[i] = usbusTransferIsControl(t) ? UsbusNotSupported : -1;
+            continue;
+        }
+
+        if ((e->latency || e->cfg->behavior == UsbusEmuReplay) && !now) {
+            now = monotonicNanos();
+        }
+
+        if (e->cfg->behavior == UsbusEmuReplay) {
+            results[i] = replaySubmit(d, e, t, now);
+        } else {
+            results[i] = queuePush(e, t, e->latency ? now + e->latency : 0, 0);
+        }
+        if (results[i] != UsbusOK) {
+            r = results[i];
+        }
+    }
+
+    return r;
+}
+
+
+int emuCancelTransfer(struct UsbusTransfer *t)
+{
+    /*
+     * Pull the transfer out of its endpoint's queue - its callback
+     * is invoked with UsbusCanceled on the next call to emuProcessEvents().
+     */
+
+    struct EmuEndpoint *e = endpointFor(t->device, t->endpoint);
+    if (!e) {
+        return -1;
+    }
+
+    unsigned i;
+    for (i = 0; i < e->count; ++i) {
+        if (e->queue[(e->head + i) & (e->capacity - 1)].t == t) {
+            break;
+        }
+    }
+
+    if (i == e->count) {
+        logdebug("emuCancelTransfer(): transfer not pending");
+        return -1;
+    }
+
+    // close the gap
+    for (; i + 1 < e->count; ++i) {
+        e->queue[(e->head + i) & (e->capacity - 1)] = e->queue[(e->head + i + 1) & (e->capacity - 1)];
+    }
+    e->count--;
+
+    struct EmuContext *ec = &t->device->ctx->emu;
+    readyUpdate(ec, e);
+    if (ec->numCanceled == ec->canceledCapacity) {
+        unsigned cap = ec->canceledCapacity ? ec->canceledCapacity * 2 : EMU_QUEUE_INITIAL;
+        struct UsbusTransfer **p = realloc(ec->canceled, cap * sizeof *p);
+        if (!p) {
+            logerror("emuCancelTransfer(): failed to grow cancel queue");
+            return -1;
+        }
+        ec->canceled = p;
+        ec->canceledCapacity = cap;
+    }
+    ec->canceled[ec->numCanceled++] = t;
+
+    return UsbusOK;
+}
+
+
+int emuProcessEvents(UsbusContext *ctx, unsigned timeoutMillis)
+{
+    /*
+     * Complete every transfer that's due, sleeping until the next one
+     * becomes due if there's nothing to do yet.
+     *
+     * Only endpoints in the ready set are visited, soonest first, so the
+     * cost follows the number of transfers completing rather than the
+     * number of devices open.
+     *
+     * Anything submitted while a pass is dispatching is due after the time
+     * of that pass, so the pass only services entries that were due when it
+     * started, and returns even if every callback resubmits.
+     */
+
+    struct EmuContext *ec = &ctx->emu;
+
+    uint64_t now = monotonicNanos();
+    uint64_t deadline = now + (uint64_t)timeoutMillis * 1000000;
+    uint64_t outerPass = ec->passStart;    // non-zero if called from a callback
+
+    for (;;) {
+        ec->passStart = now;
+        unsigned n = processCanceled(ec);
+
+        // each pass completes at least one transfer, or takes the endpoint out of the ready set
+        while (ec->numReady > 0 && ec->ready[0]->readyDue <= now) {
+            struct EmuEndpoint *e = ec->ready[0];
+            n += processEndpoint(e->device, e, now);
+        }
+        ec->passStart = outerPass;
+
+        if (n > 0 || now >= deadline) {
+            return UsbusOK;
+        }
+
+        if (atomicExchange32(&ec->wakeup, 0)) {
+            return UsbusOK;
+        }
+
+        uint64_t nextDue = ec->numReady > 0 ? ec->ready[0]->readyDue : UINT64_MAX;
+
+        // sleep in slices, so emuWakeup() isn't left waiting on a long timeout
+        uint64_t wait = (nextDue < deadline ? nextDue : deadline) - now;
+        sleepNanos(wait < EMU_WAKEUP_SLICE_NANOS ? wait : EMU_WAKEUP_SLICE_NANOS);
+        now = monotonicNanos();
+    }
+}
+
+
+void emuWakeup(UsbusContext *ctx)
+{
+    atomicStore32(&ctx->emu.wakeup, 1);
+}
+
+
+int emuReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written)
+{
+    return syncTransfer(d, ep, buf, len, written);
+}
+
+
+int emuWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written)
+{
+    return syncTransfer(d, ep, (uint8_t*)buf, len, written);
+}
+
+
+/************************************
+ * Internal Implementation/Helpers
+ ************************************/
+
+static int addModel(UsbusContext *ctx, struct EmuDeviceModel *m)
+{
+    struct EmuContext *ec = &ctx->emu;
+
+    if (ec->numModels == ec->modelCapacity) {
+        unsigned cap = ec->modelCapacity ? ec->modelCapacity * 2 : 8;
+        struct EmuDeviceModel **p = realloc(ec->models, cap * sizeof *p);
+        if (!p) {
+            return -1;
+        }
+        ec->models = p;
+        ec->modelCapacity = cap;
+    }
+
+    ec->models[ec->numModels++] = m;
+
+    // already listening? treat this as a hotplug event
+    if (ec->listening) {
+        dispatchModel(ctx, m, ec->numModels - 1);
+    }
+
+    return UsbusOK;
+}
+
+static void dispatchModel(UsbusContext *ctx, struct EmuDeviceModel *m, unsigned index)
+{
+    // virtual devices are all on bus 0
+    if (!matchDevice(ctx, &m->descriptor, 0)) {
+        return;
+    }
+    if (matchNeedsSerial(ctx)) {
+        uint8_t i = m->descriptor.iSerialNumber;
+        if (!matchSerialDescriptor(ctx, (i && i <= m->numStrings) ? m->strings[i - 1] : 0)) {
+            return;
+        }
+    }
+
+    UsbusDevice *d = allocateDevice();
+    if (d) {
+        d->descriptor = m->descriptor;
+        d->speed = m->speed;
+        d->address = index + 1;
+        d->emu.model = m;
+        dispatchConnectedDevice(ctx, d);
+    }
+}
+
+static void freeModel(struct EmuDeviceModel *m)
+{
+    unsigned i;
+    for (i = 0; i < m->numStrings; ++i) {
+        free(m->strings[i]);
+    }
+    free(m->strings);
+    free(m->configDescriptors);
+    free(m->endpoints);
+    free(m->bos);
+    if (m->replay) {
+        for (i = 0; m->replay->endpoints && i < m->numEndpoints; ++i) {
+            free(m->replay->endpoints[i].records);
+        }
+        free(m->replay->endpoints);
+        free(m->replay);
+    }
+    free(m);
+}
+
+static int synthesizeConfig(struct EmuDeviceModel *m)
+{
+    /*
+     * No config descriptors were provided - generate a single configuration
+     * with one vendor specific interface containing each of the endpoints.
+     */
+
+    unsigned len = CONFIG_DESC_LEN + INTERFACE_DESC_LEN + m->numEndpoints * ENDPOINT_DESC_LEN;
+    uint8_t *p = malloc(len);
+    if (!p) {
+        return -1;
+    }
+
+    m->configDescriptors = p;
+    m->configDescriptorsLen = len;
+
+    *p++ = CONFIG_DESC_LEN;
+    *p++ = UsbusDescriptorConfig;
+    *p++ = len & 0xff;
+    *p++ = len >> 8;
+    *p++ = 1;       // bNumInterfaces
+    *p++ = 1;       // bConfigurationValue
+    *p++ = 0;       // iConfiguration
+    *p++ = 0x80;    // bmAttributes: bus powered
+    *p++ = 50;      // bMaxPower: 100mA
+
+    *p++ = INTERFACE_DESC_LEN;
+    *p++ = UsbusDescriptorInterface;
+    *p++ = 0;       // bInterfaceNumber
+    *p++ = 0;       // bAlternateSetting
+    *p++ = m->numEndpoints;
+    *p++ = UsbusClassVendorSpecific;
+    *p++ = 0;       // bInterfaceSubClass
+    *p++ = 0;       // bInterfaceProtocol
+    *p++ = 0;       // iInterface
+
+    unsigned i;
+    for (i = 0; i < m->numEndpoints; ++i) {
+        const struct UsbusEmuEndpoint *e = &m->endpoints[i];
+        *p++ = ENDPOINT_DESC_LEN;
+        *p++ = UsbusDescriptorEndpoint;
+        *p++ = e->address;
+        *p++ = e->type & 0x3;
+        *p++ = e->maxPacketSize & 0xff;
+        *p++ = e->maxPacketSize >> 8;
+        *p++ = (e->type == UsbusTransferInterrupt) ? 1 : 0;
+    }
+
+    return UsbusOK;
+}
+
+static struct EmuDeviceModel *replayModel(struct ReplayLog *log, const struct RecordHeader *dev, unsigned speedup)
+{
+    /*
+     * Build a model from a RecordDevice: its descriptors and strings as
+     * recorded, and an endpoint for each one in its configurations.
+     */
+
+    const struct RecordDeviceInfo *info = (const struct RecordDeviceInfo*)recordPayload(dev);
+
+    struct EmuDeviceModel *m = calloc(1, sizeof *m);
+    if (!m) {
+        logerror("usbusEmuAddReplay(): failed to allocate device model");
+        return 0;
+    }
+
+    const uint8_t *dd = info->descriptor;
+    m->descriptor.bLength = DEVICE_DESC_LEN;
+    m->descriptor.bDescriptorType = UsbusDescriptorDevice;
+    m->descriptor.bcdUSB = usbusLE16(dd + 2);
+    m->descriptor.bDeviceClass = dd[4];
+    m->descriptor.bDeviceSubClass = dd[5];
+    m->descriptor.bDeviceProtocol = dd[6];
+    m->descriptor.bMaxPacketSize0 = dd[7];
+    m->descriptor.idVendor = usbusLE16(dd + 8);
+    m->descriptor.idProduct = usbusLE16(dd + 10);
+    m->descriptor.bcdDevice = usbusLE16(dd + 12);
+    m->descriptor.iManufacturer = dd[14];
+    m->descriptor.iProduct = dd[15];
+    m->descriptor.iSerialNumber = dd[16];
+    m->descriptor.bNumConfigurations = dd[17] ? dd[17] : 1;
+    m->speed = (enum UsbusSpeed)info->speed;
+
+    const uint8_t *cfg = (const uint8_t*)(info + 1);
+    if (info->configLen) {
+        m->configDescriptors = malloc(info->configLen);
+        if (!m->configDescriptors) {
+            goto fail;
+        }
+        memcpy(m->configDescriptors, cfg, info->configLen);
+        m->configDescriptorsLen = info->configLen;
+    }
+
+    // strings are stored sparsely, by index - fill any gaps with empty ones
+    const uint8_t *strings = cfg + info->configLen;
+    const uint8_t *p = strings;
+    unsigned i;
+    for (i = 0; i < info->numStrings; ++i, p += 1 + p[1]) {
+        if (p[0] > m->numStrings) {
+            m->numStrings = p[0];
+        }
+    }
+
+    if (m->numStrings) {
+        m->strings = calloc(m->numStrings, sizeof *m->strings);
+        if (!m->strings) {
+            goto fail;
+        }
+        for (i = 0, p = strings; i < info->numStrings; ++i, p += 1 + p[1]) {
+            uint8_t **s = &m->strings[p[0] - 1];
+            if (!*s && (*s = malloc(p[1]))) {
+                memcpy(*s, p + 1, p[1]);
+            }
+        }
+        for (i = 0; i < m->numStrings; ++i) {
+            if (!m->strings[i] && (m->strings[i] = malloc(2))) {
+                m->strings[i][0] = 2;
+                m->strings[i][1] = UsbusDescriptorString;
+            }
+            if (!m->strings[i]) {
+                goto fail;
+            }
+        }
+    }
+
+    m->replay = calloc(1, sizeof *m->replay);
+    if (!m->replay) {
+        goto fail;
+    }
+    m->replay->log = log;
+    m->replay->speedup = speedup;
+
+    if (replayEndpoints(m, log, dev->device) != UsbusOK) {
+        goto fail;
+    }
+
+    return m;
+
+fail:
+    logerror("usbusEmuAddReplay(): failed to allocate device model");
+    freeModel(m);
+    return 0;
+}
+
+static int compareSubmitted(const void *a, const void *b)
+{
+    const struct RecordHeader *x = *(const struct RecordHeader *const *)a;
+    const struct RecordHeader *y = *(const struct RecordHeader *const *)b;
+    if (x->submitted != y->submitted) {
+        return x->submitted < y->submitted ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+static int replayEndpoints(struct EmuDeviceModel *m, struct ReplayLog *log, unsigned device)
+{
+    /*
+     * One endpoint for each endpoint descriptor, plus any endpoint with
+     * transfers recorded on it that isn't described (ie. control transfers
+     * on endpoint 0), then gather each one's transfers in submission order.
+     *
+     * Canceled transfers are left out - they reflect what the application
+     * did, not the device.
+     */
+
+    uint8_t seen[32];
+    memset(seen, 0, sizeof seen);
+
+    m->endpoints = calloc(32, sizeof *m->endpoints);
+    m->replay->endpoints = calloc(32, sizeof *m->replay->endpoints);
+    if (!m->endpoints || !m->replay->endpoints) {
+        return -1;
+    }
+
+    const uint8_t *p = m->configDescriptors;
+    const uint8_t *pend = p + m->configDescriptorsLen;
+    for (; p + 2 <= pend && p[0] != 0 && p + p[0] <= pend; p += p[0]) {
+        if (p[1] == UsbusDescriptorEndpoint && p[0] >= ENDPOINT_DESC_LEN && !seen[endpointSlot(p[2])]) {
+            struct UsbusEmuEndpoint *e = &m->endpoints[m->numEndpoints];
+            e->address = p[2];
+            e->type = (enum UsbusTransferType)(p[3] & 0x3);
+            e->maxPacketSize = usbusLE16(p + 4);
+            e->behavior = UsbusEmuReplay;
+            seen[endpointSlot(p[2])] = ++m->numEndpoints;
+        }
+    }
+
+    uint64_t first = UINT64_MAX;
+    const struct RecordHeader *r;
+    for (r = replayFirst(log); r; r = replayNext(log, r)) {
+        if (r->kind != RecordTransfer || r->device != device || r->status == UsbusCanceled) {
+            continue;
+        }
+
+        unsigned slot = endpointSlot(r->endpoint);
+        if (!seen[slot]) {
+            struct UsbusEmuEndpoint *e = &m->endpoints[m->numEndpoints];
+            e->address = r->endpoint;
+            e->type = (enum UsbusTransferType)r->type;
+            e->maxPacketSize = m->descriptor.bMaxPacketSize0;
+            e->behavior = UsbusEmuReplay;
+            seen[slot] = ++m->numEndpoints;
+        }
+        m->replay->endpoints[seen[slot] - 1].numRecords++;
+
+        if (r->submitted < first) {
+            first = r->submitted;
+        }
+    }
+    m->replay->firstSubmitted = first;
+
+    unsigned i;
+    for (i = 0; i < m->numEndpoints; ++i) {
+        struct EmuReplayEndpoint *re = &m->replay->endpoints[i];
+        if (re->numRecords) {
+            re->records = malloc(re->numRecords * sizeof *re->records);
+            if (!re->records) {
+                return -1;
+            }
+            re->numRecords = 0;
+        }
+    }
+
+    for (r = replayFirst(log); r; r = replayNext(log, r)) {
+        if (r->kind == RecordTransfer && r->device == device && r->status != UsbusCanceled) {
+            struct EmuReplayEndpoint *re = &m->replay->endpoints[seen[endpointSlot(r->endpoint)] - 1];
+            re->records[re->numRecords++] = r;
+        }
+    }
+
+    // recorded in completion order, which needn't match submission order across a queue
+    for (i = 0; i < m->numEndpoints; ++i) {
+        struct EmuReplayEndpoint *re = &m->replay->endpoints[i];
+        qsort(re->records, re->numRecords, sizeof *re->records, compareSubmitted);
+    }
+
+    return UsbusOK;
+}
+
+static uint8_t *stringDescriptorFromUtf8(const char *s)
+{
+    /*
+     * Build a complete string descriptor, converting UTF-8 to UTF-16LE.
+     * Strings that don't fit in a descriptor are truncated.
+     */
+
+    uint8_t *desc = malloc(255);
+    if (!desc) {
+        return 0;
+    }
+
+    const uint8_t *p = (const uint8_t*)s;
+    unsigned n = 2;
+    while (*p) {
+        uint32_t c;
+        if (*p < 0x80) {
+            c = *p++;
+        } else if ((*p & 0xe0) == 0xc0 && p[1]) {
+            c = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+            p += 2;
+        } else if ((*p & 0xf0) == 0xe0 && p[1] && p[2]) {
+            c = ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+            p += 3;
+        } else if ((*p & 0xf8) == 0xf0 && p[1] && p[2] && p[3]) {
+            c = ((p[0] & 0x07) << 18) | ((p[1] & 0x3f) << 12) | ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+            p += 4;
+        } else {
+            c = '?';
+            p++;
+        }
+
+        if (c >= 0x10000) {
+            if (n + 4 > 254) {
+                break;
+            }
+            c -= 0x10000;
+            uint16_t hi = 0xd800 | (c >> 10);
+            uint16_t lo = 0xdc00 | (c & 0x3ff);
+            desc[n++] = hi & 0xff;
+            desc[n++] = hi >> 8;
+            desc[n++] = lo & 0xff;
+            desc[n++] = lo >> 8;
+        } else {
+            if (n + 2 > 254) {
+                break;
+            }
+            desc[n++] = c & 0xff;
+            desc[n++] = c >> 8;
+        }
+    }
+
+    desc[0] = n;
+    desc[1] = UsbusDescriptorString;
+    return desc;
+}
+
+static int findConfig(struct EmuDeviceModel *m, unsigned index, const uint8_t **cfg, unsigned *len)
+{
+    const uint8_t *p = m->configDescriptors;
+    const uint8_t *pend = p + m->configDescriptorsLen;
+
+    unsigned i;
+    for (i = 0; p + CONFIG_DESC_LEN <= pend; ++i) {
+
+        unsigned total = p[2] | (p[3] << 8);
+        if (p[1] != UsbusDescriptorConfig || total < CONFIG_DESC_LEN || p + total > pend) {
+            break;
+        }
+
+        if (i == index) {
+            *cfg = p;
+            *len = total;
+            return UsbusOK;
+        }
+
+        p += total;
+    }
+
+    return -1;
+}
+
+static const uint8_t *findInterface(const uint8_t *cfg, unsigned len, unsigned number, unsigned altsetting)
+{
+    const uint8_t *p = cfg;
+    const uint8_t *pend = cfg + len;
+
+    while (p + 2 <= pend && p[0] != 0) {
+        if (p[1] == UsbusDescriptorInterface && p[0] >= INTERFACE_DESC_LEN && p + p[0] <= pend &&
+            p[2] == number && p[3] == altsetting)
+        {
+            return p;
+        }
+        p += p[0];
+    }
+
+    return 0;
+}
+
+static struct EmuEndpoint *endpointFor(UsbusDevice *d, uint8_t ep)
+{
+    uint8_t slot = d->emu.epSlots[endpointSlot(ep)];
+    return slot ? &d->emu.endpoints[slot - 1] : 0;
+}
+
+static int queuePush(struct EmuEndpoint *e, struct UsbusTransfer *t, uint64_t due, const struct RecordHeader *record)
+{
+    if (e->count == e->capacity) {
+        /*
+         * Grow the ring, unwrapping it into the new allocation.
+         * Only happens until the queue depth reaches its high water mark.
+         */
+
+        unsigned cap = e->capacity ? e->capacity * 2 : EMU_QUEUE_INITIAL;
+        struct EmuPending *q = malloc(cap * sizeof *q);
+        if (!q) {
+            logerror("emuSubmitTransfer(): failed to grow endpoint queue");
+            return -1;
+        }
+
+        unsigned i;
+        for (i = 0; i < e->count; ++i) {
+            q[i] = e->queue[(e->head + i) & (e->capacity - 1)];
+        }
+
+        free(e->queue);
+        e->queue = q;
+        e->head = 0;
+        e->capacity = cap;
+    }
+
+    // a submission from a callback is left for the next pass, not the one dispatching it
+    struct EmuContext *ec = &e->device->ctx->emu;
+    if (ec->passStart && due <= ec->passStart) {
+        due = ec->passStart + 1;
+    }
+
+    struct EmuPending *p = &e->queue[(e->head + e->count) & (e->capacity - 1)];
+    p->t = t;
+    p->due = due;
+    p->record = record;
+    if (e->count++ == 0) {
+        readyUpdate(ec, e);
+    }
+
+    return UsbusOK;
+}
+
+static int replaySubmit(UsbusDevice *d, struct EmuEndpoint *e, struct UsbusTransfer *t, uint64_t now)
+{
+    /*
+     * Pair the transfer with the next one recorded on its endpoint. It's
+     * due when that completed, relative to the device's first submission,
+     * and never sooner after being submitted than that took, both scaled
+     * by the speedup. One that timed out in the recording completes with
+     * UsbusTimeout at the same point, so it holds up the endpoint no longer
+     * than it did then. Transfers beyond the end of the recording don't
+     * complete by themselves.
+     */
+
+    struct EmuReplay *rp = d->emu.model->replay;
+    const struct EmuReplayEndpoint *re = &rp->endpoints[e - d->emu.endpoints];
+
+    if (!d->emu.replayBase) {
+        d->emu.replayBase = now;
+    }
+
+    const struct RecordHeader *r = 0;
+    if (e->replayNext < re->numRecords) {
+        r = re->records[e->replayNext++];
+    }
+
+    uint64_t due = UINT64_MAX;
+    if (r) {
+        if (rp->speedup == 0) {
+            due = 0;
+        } else {
+            uint64_t scheduled = d->emu.replayBase + (r->completed - rp->firstSubmitted) / rp->speedup;
+            due = now + (r->completed - r->submitted) / rp->speedup;
+            if (due < scheduled) {
+                due = scheduled;
+            }
+        }
+    }
+
+    return queuePush(e, t, due, r);
+}
+
+static inline struct EmuPending *queueHead(struct EmuEndpoint *e) {
+    return &e->queue[e->head];
+}
+
+static inline void queuePop(struct EmuEndpoint *e) {
+    e->head = (e->head + 1) & (e->capacity - 1);
+    e->count--;
+}
+
+static void fifoCopyOut(struct EmuEndpoint *e, uint8_t *dst, unsigned len)
+{
+    unsigned off = e->fifoRd & (e->fifoSize - 1);
+    unsigned first = e->fifoSize - off < len ? e->fifoSize - off : len;
+    memcpy(dst, e->fifo + off, first);
+    memcpy(dst + first, e->fifo, len - first);
+}
+
+static void fifoRead(struct EmuEndpoint *e, void *dst, unsigned len)
+{
+    fifoCopyOut(e, dst, len);
+    e->fifoRd += len;
+}
+
+static void fifoPoke(struct EmuEndpoint *e, const void *src, unsigned len)
+{
+    // overwrite bytes at the read position, without consuming them
+    unsigned off = e->fifoRd & (e->fifoSize - 1);
+    unsigned first = e->fifoSize - off < len ? e->fifoSize - off : len;
+    memcpy(e->fifo + off, src, first);
+    memcpy(e->fifo, (const uint8_t*)src + first, len - first);
+}
+
+static void fifoWrite(struct EmuEndpoint *e, const void *src, unsigned len)
+{
+    unsigned off = e->fifoWr & (e->fifoSize - 1);
+    unsigned first = e->fifoSize - off < len ? e->fifoSize - off : len;
+    memcpy(e->fifo + off, src, first);
+    memcpy(e->fifo, (const uint8_t*)src + first, len - first);
+    e->fifoWr += len;
+}
+
+static void completeTransfer(struct UsbusTransfer *t, int length, enum UsbusStatus status)
+{
+    t->transferredlength = length;
+    dispatchTransferCompletion(t, status);
+}
+
+static int fifoReserve(struct EmuEndpoint *e, unsigned len)
+{
+    /*
+     * Ensure the loopback fifo could ever hold a message of `len` bytes.
+     * Returns whether there's room for it right now.
+     */
+
+    unsigned need = len + sizeof(uint32_t);
+    if (need > e->fifoSize) {
+        unsigned size = e->fifoSize ? e->fifoSize : EMU_LOOPBACK_FIFO;
+        while (size < need) {
+            size *= 2;
+        }
+
+        uint8_t *data = malloc(size);
+        if (!data) {
+            logerror("emuProcessEvents(): failed to grow loopback buffer");
+            return 0;
+        }
+
+        unsigned used = e->fifoWr - e->fifoRd;
+        if (used) {
+            fifoCopyOut(e, data, used);
+        }
+        free(e->fifo);
+        e->fifo = data;
+        e->fifoSize = size;
+        e->fifoRd = 0;
+        e->fifoWr = used;
+    }
+
+    return e->fifoSize - (e->fifoWr - e->fifoRd) >= need;
+}
+
+static inline void readyPlace(struct EmuContext *ec, unsigned i, struct EmuEndpoint *e)
+{
+    ec->ready[i] = e;
+    e->readyIndex = i + 1;
+}
+
+static void readySiftUp(struct EmuContext *ec, unsigned i)
+{
+    struct EmuEndpoint *e = ec->ready[i];
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+        if (ec->ready[parent]->readyDue <= e->readyDue) {
+            break;
+        }
+        readyPlace(ec, i, ec->ready[parent]);
+        i = parent;
+    }
+    readyPlace(ec, i, e);
+}
+
+static void readySiftDown(struct EmuContext *ec, unsigned i)
+{
+    struct EmuEndpoint *e = ec->ready[i];
+    for (;;) {
+        unsigned child = 2 * i + 1;
+        if (child >= ec->numReady) {
+            break;
+        }
+        if (child + 1 < ec->numReady && ec->ready[child + 1]->readyDue < ec->ready[child]->readyDue) {
+            child++;
+        }
+        if (e->readyDue <= ec->ready[child]->readyDue) {
+            break;
+        }
+        readyPlace(ec, i, ec->ready[child]);
+        i = child;
+    }
+    readyPlace(ec, i, e);
+}
+
+static void readyUpdate(struct EmuContext *ec, struct EmuEndpoint *e)
+{
+    /*
+     * Call whenever an endpoint's first queued transfer changes, or it
+     * becomes blocked or unblocked. Endpoints are ready while they have a
+     * transfer queued and aren't blocked, keyed by when that transfer is due.
+     * emuOpen() has already made room for every endpoint.
+     */
+
+    if (e->count == 0) {
+        e->blocked = 0;
+    }
+    if (e->count == 0 || e->blocked) {
+        readyRemove(ec, e);
+        return;
+    }
+
+    uint64_t due = queueHead(e)->due;
+    if (!e->readyIndex) {
+        e->readyDue = due;
+        readyPlace(ec, ec->numReady++, e);
+        readySiftUp(ec, ec->numReady - 1);
+    } else if (due != e->readyDue) {
+        e->readyDue = due;
+        readySiftUp(ec, e->readyIndex - 1);
+        readySiftDown(ec, e->readyIndex - 1);
+    }
+}
+
+static void readyRemove(struct EmuContext *ec, struct EmuEndpoint *e)
+{
+    if (!e->readyIndex) {
+        return;
+    }
+
+    unsigned i = e->readyIndex - 1;
+    e->readyIndex = 0;
+
+    struct EmuEndpoint *last = ec->ready[--ec->numReady];
+    if (last != e) {
+        readyPlace(ec, i, last);
+        readySiftUp(ec, i);
+        readySiftDown(ec, last->readyIndex - 1);
+    }
+}
+
+static unsigned processEndpoint(UsbusDevice *d, struct EmuEndpoint *e, uint64_t now)
+{
+    /*
+     * Complete all the transfers on this endpoint that are due, leaving it
+     * in the ready set by the next one, if any.
+     * Callbacks may resubmit (which only ever appends to the queue), or close
+     * the device (which frees the queue, and takes it out of the ready set),
+     * so re-check the device after each.
+     * Only the transfers queued on entry are considered: with no latency a
+     * resubmission is due immediately, and would otherwise be completed
+     * again by this same loop without ever returning to the caller.
+     */
+
+    struct EmuContext *ec = &d->ctx->emu;
+    unsigned queued = e->count;
+    unsigned n = 0;
+
+    while (d->isOpen && e->count > 0 && queued-- > 0) {
+
+        struct EmuPending *p = queueHead(e);
+        if (p->due > now) {
+            break;
+        }
+
+        struct UsbusTransfer *t = p->t;
+        int len = t->requestedLength;
+        enum UsbusStatus status = UsbusComplete;
+
+        switch (e->cfg->behavior) {
+        case UsbusEmuSink:
+            break;
+
+        case UsbusEmuSource:
+            memset(t->buffer, e->fill++, len);
+            break;
+
+        case UsbusEmuLoopback:
+            if (usbusTransferIsIN(t)) {
+
+                // wait for data to arrive from the OUT endpoint, which puts us back in the ready set
+                if (e->fifoWr == e->fifoRd) {
+                    e->blocked = 1;
+                    readyUpdate(ec, e);
+                    return n;
+                }
+
+                uint32_t msgLen;
+                fifoRead(e, &msgLen, sizeof msgLen);
+                if ((uint32_t)len >= msgLen) {
+                    len = msgLen;
+                    fifoRead(e, t->buffer, len);
+                } else {
+                    // leave the remainder of the message for the next IN transfer
+                    fifoRead(e, t->buffer, len);
+                    e->fifoRd -= sizeof msgLen;
+                    msgLen -= len;
+                    fifoPoke(e, &msgLen, sizeof msgLen);
+                }
+
+                if (e->feeder && e->feeder->blocked) {
+                    e->feeder->blocked = 0;
+                    readyUpdate(ec, e->feeder);
+                }
+
+            } else if (e->peer) {
+
+                // the device NAKs while its buffer is full, until the IN endpoint drains it
+                if (!fifoReserve(e->peer, len)) {
+                    e->blocked = 1;
+                    readyUpdate(ec, e);
+                    return n;
+                }
+
+                uint32_t msgLen = len;
+                fifoWrite(e->peer, &msgLen, sizeof msgLen);
+                fifoWrite(e->peer, t->buffer, len);
+
+                if (e->peer->blocked) {
+                    e->peer->blocked = 0;
+                    readyUpdate(ec, e->peer);
+                }
+            }
+            break;
+
+        case UsbusEmuReplay: {
+            const struct RecordHeader *r = p->record;
+            const uint8_t *payload = recordPayload(r);
+            uint32_t avail = r->dataLength;
+            uint8_t *dst = t->buffer;
+
+            // control transfers keep the caller's setup packet, only the data stage is replayed
+            if (usbusTransferIsControl(t)) {
+                len -= USBUS_CONTROL_SETUP_SIZE;
+                dst += USBUS_CONTROL_SETUP_SIZE;
+                payload += USBUS_CONTROL_SETUP_SIZE;
+                avail = avail > USBUS_CONTROL_SETUP_SIZE ? avail - USBUS_CONTROL_SETUP_SIZE : 0;
+            }
+            if (r->transferredLength < (uint32_t)len) {
+                len = r->transferredLength;
+            }
+            if (usbusTransferIsIN(t)) {
+                memcpy(dst, payload, avail < (uint32_t)len ? avail : (uint32_t)len);
+            }
+            status = (enum UsbusStatus)r->status;
+            break;
+        }
+        }
+
+        queuePop(e);
+        readyUpdate(ec, e);
+        completeTransfer(t, len, status);
+        n++;
+    }
+
+    return n;
+}
+
+static unsigned processCanceled(struct EmuContext *ec)
+{
+    /*
+     * Callbacks may cancel further transfers, so consume
+     * the queue from the front as it may grow.
+     */
+
+    unsigned i;
+    for (i = 0; i < ec->numCanceled; ++i) {
+        completeTransfer(ec->canceled[i], 0, UsbusCanceled);
+    }
+
+    ec->numCanceled = 0;
+    return i;
+}
+
+struct SyncState {
+    uint8_t done;
+    enum UsbusStatus status;
+};
+
+static void syncTransferComplete(struct UsbusTransfer *t, enum UsbusStatus s)
+{
+    struct SyncState *ss = t->userData;
+    ss->status = s;
+    ss->done = 1;
+}
+
+static int syncTransfer(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written)
+{
+    /*
+     * Sync I/O is an async transfer that we wait on. Other transfers
+     * that complete in the meantime are dispatched as usual.
+     */
+
+    struct SyncState ss = { 0, UsbusComplete };
+
+    struct UsbusTransfer *t = usbusAllocateTransfer();
+    if (!t) {
+        return -1;
+    }
+    usbusSetBulkTransferInfo(t, d, ep, buf, len, syncTransferComplete, &ss);
+
+    if (emuSubmitTransfer(t) != UsbusOK) {
+        usbusReleaseTransfer(t);
+        return -1;
+    }
+
+    while (!ss.done && d->isOpen) {
+        emuProcessEvents(d->ctx, 100);
+    }
+
+    // if closed while waiting, the transfer was dropped along with its queue
+    if (ss.done) {
+        *written = t->transferredlength;
+    }
+    usbusReleaseTransfer(t);
+
+    if (!ss.done) {
+        return -1;
+    }
+
+    return ss.status == UsbusComplete ? UsbusOK : -1;
+}
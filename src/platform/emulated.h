@@ -0,0 +1,67 @@
+#ifndef EMULATED_H
+#define EMULATED_H
+
+#include "usbus.h"
+
+struct EmuDeviceModel;
+struct EmuEndpoint;
+
+// emulated-specific potion of UsbusContext
+struct EmuContext {
+    struct EmuDeviceModel **models;     // registered via usbusEmuAddDevice()
+    unsigned numModels;
+    unsigned modelCapacity;
+    struct EmuEndpoint **ready;         // min-heap of endpoints with a transfer to complete, by due time
+    unsigned numReady;
+    unsigned readyCapacity;             // at least the number of endpoints on open devices
+    unsigned numOpenEndpoints;
+    uint64_t passStart;                 // time of the pass being dispatched, 0 outside emuProcessEvents()
+    struct UsbusTransfer **canceled;    // canceled transfers awaiting their callback
+    unsigned numCanceled;
+    unsigned canceledCapacity;
+    uint8_t listening;
+    volatile uint32_t wakeup;           // set by emuWakeup()
+};
+
+// emulated-specific potion of UsbusDevice
+struct EmuDevice {
+    struct EmuDeviceModel *model;
+    struct EmuEndpoint *endpoints;      // one per endpoint in the model, allocated at open
+    uint8_t epSlots[32];                // endpoint address -> index into endpoints + 1, 0 if unknown
+    uint8_t config;
+    uint64_t replayBase;                // monotonicNanos() at the first submission, for replayed devices
+};
+
+extern const struct UsbusPlatform platformEmulated;
+
+int emuListen(UsbusContext *ctx);
+void emuStopListen(UsbusContext *ctx);
+
+int emuGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang,
+                           uint8_t *buf, unsigned len, unsigned *transferred);
+
+int  emuOpen(UsbusDevice *d);
+void emuClose(UsbusDevice *d);
+
+int emuGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                     uint8_t *buf, unsigned len, unsigned *transferred);
+int emuGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc);
+int emuGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc);
+int emuGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc);
+
+int emuOpenInterface(UsbusDevice *d, unsigned index);
+int emuCloseInterface(UsbusDevice *d, unsigned index);
+
+int emuGetConfiguration(UsbusDevice *device, uint8_t *config);
+int emuSetConfiguration(UsbusDevice *device, uint8_t config);
+
+int emuSubmitTransfer(struct UsbusTransfer *t);
+int emuSubmitTransfers(struct UsbusTransfer **ts, unsigned n, int *results);
+int emuCancelTransfer(struct UsbusTransfer *t);
+int emuProcessEvents(UsbusContext *ctx, unsigned timeoutMillis);
+void emuWakeup(UsbusContext *ctx);
+
+int emuReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
+int emuWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written);
+
+#endif // EMULATED_H
@@ -4,6 +4,8 @@
 #include "platform/iokit.h"
 #include "logger.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOCFPlugIn.h>
 
@@ -25,7 +27,15 @@ const struct UsbusPlatform platformIOKit = {
     iokitCancelTransfer,
     iokitProcessEvents,
     iokitReadSync,
-    iokitWriteSync
+    iokitWriteSync,
+    0,
+    0,
+    0,
+    0,
+    iokitWakeup,
+    iokitOpenEndpoint,
+    iokitGetDescriptor,
+    0
 };
 
 /************************************************
@@ -108,10 +118,10 @@ static int pipeRefForEP(UsbusDevice *d, uint8_t ep, uint8_t *pipeRef, uint8_t *i
     struct IOKitDevice *id = &d->iokit;
 
     unsigned i, e;
-    for (i = 0; i < USBUS_MAX_INTERFACES; ++i) {
+    for (i = 0; i < id->numInterfaces; ++i) {
 
         struct IOKitInterface *ii = &id->interfaces[i];
-        for (e = 0; e < USBUS_MAX_ENDPOINTS; ++e) {
+        for (e = 0; e < ii->numEndpoints; ++e) {
             if (ii->epAddresses[e] == ep) {
                 *pipeRef = e + 1;
                 *intfIndex = i;
@@ -124,6 +134,76 @@ static int pipeRefForEP(UsbusDevice *d, uint8_t ep, uint8_t *pipeRef, uint8_t *i
     return -1;
 }
 
+static inline int transferRoute(struct UsbusTransfer *t, uint8_t *pipeRef, uint8_t *intfIndex)
+{
+    /*
+     * Transfers bound to an endpoint handle have their route resolved already.
+     */
+
+    if (t->endpointHandle) {
+        *pipeRef = t->endpointHandle->pipeRef;
+        *intfIndex = t->endpointHandle->interfaceIndex;
+        return UsbusOK;
+    }
+
+    return pipeRefForEP(t->device, t->endpoint, pipeRef, intfIndex);
+}
+
+static inline struct IOKitInterface *iokitInterface(UsbusDevice *d, unsigned index)
+{
+    /*
+     * Bounds checker for access to interfaces[]
+     */
+
+    if (index >= d->iokit.numInterfaces) {
+        logdebug("interface index %d is out of range (%d interfaces)", index, d->iokit.numInterfaces);
+        return NULL;
+    }
+    return &d->iokit.interfaces[index];
+}
+
+static int sizeInterfaces(UsbusDevice *d, IOUSBConfigurationDescriptorPtr cfgDesc)
+{
+    /*
+     * Size per-interface state for the given configuration.
+     * Any interfaces open under the previous configuration must have been closed.
+     */
+
+    struct IOKitDevice *id = &d->iokit;
+    unsigned n = cfgDesc->bNumInterfaces;
+
+    if (id->interfaces != id->inlineInterfaces) {
+        free(id->interfaces);
+    }
+
+    if (n <= IOKIT_INLINE_INTERFACES) {
+        id->interfaces = id->inlineInterfaces;
+    } else {
+        id->interfaces = malloc(n * sizeof *id->interfaces);
+        if (!id->interfaces) {
+            logerror("sizeInterfaces(): failed to malloc %d interfaces", n);
+            id->interfaces = id->inlineInterfaces;
+            id->numInterfaces = 0;
+            return -1;
+        }
+    }
+
+    memset(id->interfaces, 0, n * sizeof *id->interfaces);
+    id->numInterfaces = n;
+    return UsbusOK;
+}
+
+static void freeInterfaces(UsbusDevice *d)
+{
+    struct IOKitDevice *id = &d->iokit;
+
+    if (id->interfaces != id->inlineInterfaces) {
+        free(id->interfaces);
+    }
+    id->interfaces = id->inlineInterfaces;
+    id->numInterfaces = 0;
+}
+
 static inline uint8_t reconstructEPAddress(uint8_t direction, uint8_t number) {
     /*
      * Generate the endpoint address from the values provided by GetPipeProperties()
@@ -148,6 +228,17 @@ static int populateEPAddressesForInterface(UsbusDevice *d, unsigned index)
         return -1;
     }
 
+    if (numEndpoints <= IOKIT_INLINE_ENDPOINTS) {
+        ii->epAddresses = ii->inlineEpAddresses;
+    } else {
+        ii->epAddresses = malloc(numEndpoints);
+        if (!ii->epAddresses) {
+            logerror("populateEPAddressesForInterface(): failed to malloc %d endpoints", numEndpoints);
+            return -1;
+        }
+    }
+    ii->numEndpoints = numEndpoints;
+
     unsigned i;
     for (i = 1 ; i <= numEndpoints; ++i) {
 
@@ -199,6 +290,60 @@ static void* getPluginInterface(io_object_t iodev, CFUUIDRef type, CFUUIDRef uui
 }
 
 
+static int registryNumber(io_object_t io, CFStringRef key, SInt64 *value)
+{
+    CFTypeRef prop = IORegistryEntryCreateCFProperty(io, key, kCFAllocatorDefault, 0);
+    if (!prop) {
+        return -1;
+    }
+
+    int ok = CFGetTypeID(prop) == CFNumberGetTypeID() &&
+             CFNumberGetValue((CFNumberRef)prop, kCFNumberSInt64Type, value);
+    CFRelease(prop);
+    return ok ? UsbusOK : -1;
+}
+
+static int registryMatch(UsbusContext *ctx, io_object_t io)
+{
+    /*
+     * Evaluate the context's match filter from the registry entry alone,
+     * so we don't create a plugin interface for devices we won't report.
+     */
+
+    struct UsbusDeviceDescriptor desc;
+    SInt64 v;
+
+    memset(&desc, 0, sizeof desc);
+    if (registryNumber(io, CFSTR(kUSBVendorID), &v) == UsbusOK)       desc.idVendor = v;
+    if (registryNumber(io, CFSTR(kUSBProductID), &v) == UsbusOK)      desc.idProduct = v;
+    if (registryNumber(io, CFSTR(kUSBDeviceClass), &v) == UsbusOK)    desc.bDeviceClass = v;
+    if (registryNumber(io, CFSTR(kUSBDeviceSubClass), &v) == UsbusOK) desc.bDeviceSubClass = v;
+    if (registryNumber(io, CFSTR(kUSBDeviceProtocol), &v) == UsbusOK) desc.bDeviceProtocol = v;
+
+    uint8_t busNumber = 0;
+    if (registryNumber(io, CFSTR(kUSBDevicePropertyLocationID), &v) == UsbusOK) {
+        busNumber = (UInt32)v >> 24;
+    }
+
+    if (!matchDevice(ctx, &desc, busNumber)) {
+        return 0;
+    }
+
+    if (!matchNeedsSerial(ctx)) {
+        return 1;
+    }
+
+    char serial[256];
+    int haveSerial = 0;
+    CFTypeRef prop = IORegistryEntryCreateCFProperty(io, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
+    if (prop) {
+        haveSerial = CFGetTypeID(prop) == CFStringGetTypeID() &&
+                     CFStringGetCString((CFStringRef)prop, serial, sizeof serial, kCFStringEncodingUTF8);
+        CFRelease(prop);
+    }
+    return matchSerial(ctx, haveSerial ? serial : 0);
+}
+
 static void deviceDiscoveredCallback(void *p, io_iterator_t iterator)
 {
     /*
@@ -210,6 +355,11 @@ static void deviceDiscoveredCallback(void *p, io_iterator_t iterator)
     io_object_t io;
     while ((io = IOIteratorNext(iterator))) {
 
+        if (!registryMatch(ctx, io)) {
+            IOObjectRelease(io);
+            continue;
+        }
+
         IOUSBDeviceInterface_t **dev;
         dev = getPluginInterface(io, kIOUSBDeviceUserClientTypeID, kIOUSBDeviceInterfaceID320);
         IOObjectRelease(io);
@@ -245,6 +395,12 @@ static void deviceTerminatedCallback(void *p, io_iterator_t iterator)
     io_object_t io;
     while ((io = IOIteratorNext(iterator))) {
 
+        // devices that were filtered out were never reported as connected
+        if (!registryMatch(ctx, io)) {
+            IOObjectRelease(io);
+            continue;
+        }
+
         UsbusDevice device;
         device.ctx = ctx;
 
@@ -262,8 +418,9 @@ static void deviceTerminatedCallback(void *p, io_iterator_t iterator)
 static void iokitAsyncIOCallback(void *refcon, IOReturn result, void *arg0)
 {
     /*
-     * Called back from either WritePipeAsync or ReadPipeAsync upon
-     * completeion of a transfer.
+     * Called back from WritePipeAsync, ReadPipeAsync or ControlRequestAsync
+     * upon completeion of a transfer. For control requests, arg0 is the
+     * length of the data stage.
      *
      * Collect the status and transferred length, and forward the callback
      * if it's enabled.
@@ -302,9 +459,49 @@ static void iokitAsyncIOCallback(void *refcon, IOReturn result, void *arg0)
         break;
     }
 
-    if (t->callback) {
-        t->callback(t, status);
+    dispatchTransferCompletion(t, status);
+}
+
+
+static int submitControl(struct UsbusTransfer *t)
+{
+    /*
+     * Control transfers go out on the default pipe of the first open
+     * interface, so they complete via its run loop source like any other.
+     * The setup packet leads the buffer, see struct UsbusTransfer.
+     */
+
+    struct IOKitDevice *id = &t->device->iokit;
+    IOUSBInterfaceInterface_t **intf = NULL;
+
+    unsigned i;
+    for (i = 0; i < id->numInterfaces && !intf; ++i) {
+        intf = id->interfaces[i].intf;
+    }
+    if (!intf) {
+        logdebug("iokitSubmitTransfer(): control transfers need an open interface");
+        return -1;
     }
+
+    struct IOKitTransfer *it = &transferPriv(t)->platform.iokit;
+    const uint8_t *setup = t->buffer;
+
+    it->intf = intf;
+    it->request.bmRequestType = setup[0];
+    it->request.bRequest = setup[1];
+    it->request.wValue = usbusLE16(setup + 2);
+    it->request.wIndex = usbusLE16(setup + 4);
+    it->request.wLength = (UInt16)(t->requestedLength - USBUS_CONTROL_SETUP_SIZE);
+    it->request.pData = t->buffer + USBUS_CONTROL_SETUP_SIZE;
+    it->request.wLenDone = 0;
+
+    IOReturn r = (*intf)->ControlRequestAsync(intf, 0, &it->request, iokitAsyncIOCallback, t);
+    if (r != kIOReturnSuccess) {
+        logdebug("iokitSubmitTransfer() ControlRequestAsync: %08x (%s)", r, iokit_strerror(r));
+        return -1;
+    }
+
+    return UsbusOK;
 }
 
 
@@ -435,13 +632,20 @@ int iokitOpenInterface(UsbusDevice *d, unsigned index)
 
     IOUSBDeviceInterface_t **dev = d->iokit.dev;
 
+    struct IOKitInterface *ii = iokitInterface(d, index);
+    if (!ii) {
+        return -1;
+    }
+    if (ii->intf) {
+        // already open
+        return UsbusOK;
+    }
+
     io_service_t ioInterface = getIOInterface(dev, index);
     if (ioInterface == IO_OBJECT_NULL) {
         return -1;
     }
 
-    struct IOKitInterface *ii = &d->iokit.interfaces[index];
-
     ii->intf = getPluginInterface(ioInterface, kIOUSBInterfaceUserClientTypeID, kIOUSBInterfaceInterfaceID197);
     if (!ii->intf) {
         return -1;
@@ -479,13 +683,18 @@ int iokitOpenInterface(UsbusDevice *d, unsigned index)
 
 int iokitCloseInterface(UsbusDevice *d, unsigned index)
 {
-    struct IOKitInterface *ii = &d->iokit.interfaces[index];
-    IOUSBInterfaceInterface_t** intf = ii->intf;
-
-    if (!intf) {
+    struct IOKitInterface *ii = iokitInterface(d, index);
+    if (!ii || !ii->intf) {
         // not open? nop
         return UsbusOK;
     }
+    IOUSBInterfaceInterface_t** intf = ii->intf;
+
+    if (ii->epAddresses != ii->inlineEpAddresses) {
+        free(ii->epAddresses);
+    }
+    ii->epAddresses = 0;
+    ii->numEndpoints = 0;
 
     CFRunLoopRemoveSource(d->ctx->iokit.runLoopRef, ii->runLoopSourceRef, kCFRunLoopDefaultMode);
     CFRelease(ii->runLoopSourceRef);
@@ -565,16 +774,17 @@ int iokitOpen(struct UsbusDevice *d)
         }
     }
 
-    return UsbusOK;
+    return sizeInterfaces(d, d->iokit.cfgDesc);
 }
 
 
 void iokitClose(struct UsbusDevice *d)
 {
     unsigned i;
-    for (i = 0; i < USBUS_MAX_INTERFACES; ++i) {
+    for (i = 0; i < d->iokit.numInterfaces; ++i) {
         iokitCloseInterface(d, i);
     }
+    freeInterfaces(d);
 
     IOUSBDeviceInterface_t** dev = d->iokit.dev;
     (*dev)->USBDeviceClose(dev);
@@ -583,6 +793,49 @@ void iokitClose(struct UsbusDevice *d)
 }
 
 
+int iokitGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                       uint8_t *buf, unsigned len, unsigned *transferred)
+{
+    /*
+     * IOKit caches configuration descriptors, so prefer those
+     * over a request to the device.
+     */
+
+    IOUSBDeviceInterface_t** dev = d->iokit.dev;
+
+    if (type == UsbusDescriptorConfig) {
+        IOUSBConfigurationDescriptorPtr cfgDesc;
+        IOReturn r = (*dev)->GetConfigurationDescriptorPtr(dev, index, &cfgDesc);
+        if (r != kIOReturnSuccess) {
+            logdebug("iokitGetDescriptor() GetConfigurationDescriptorPtr: %08x (%s)", r, iokit_strerror(r));
+            return -1;
+        }
+
+        unsigned total = USBToHostWord(cfgDesc->wTotalLength);
+        *transferred = total < len ? total : len;
+        memcpy(buf, cfgDesc, *transferred);
+        return UsbusOK;
+    }
+
+    IOUSBDevRequest req;
+    req.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBStandard, kUSBDevice);
+    req.bRequest = kUSBRqGetDescriptor;
+    req.wValue = (type << 8) | index;
+    req.wIndex = lang;
+    req.wLength = len;
+    req.pData = buf;
+
+    IOReturn r = (*dev)->DeviceRequest(dev, &req);
+    if (r != kIOReturnSuccess) {
+        logdebug("iokitGetDescriptor() DeviceRequest: %08x (%s)", r, iokit_strerror(r));
+        return -1;
+    }
+
+    *transferred = req.wLenDone;
+    return UsbusOK;
+}
+
+
 int iokitGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc)
 {
     IOUSBDeviceInterface_t** dev = d->iokit.dev;
@@ -603,7 +856,8 @@ int iokitGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigD
 int iokitGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc)
 {
     IOUSBConfigurationDescriptorPtr cfgDesc = d->iokit.cfgDesc;
-    IOUSBInterfaceInterface_t **intf = d->iokit.interfaces[index].intf;
+    struct IOKitInterface *ii = iokitInterface(d, index);
+    IOUSBInterfaceInterface_t **intf = ii ? ii->intf : 0;
 
     if (!intf) {
         logdebug("iokitGetInterfaceDescriptor(): interface %d has not been opened", index);
@@ -647,7 +901,8 @@ int iokitGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsett
 
 int iokitGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc)
 {
-    IOUSBInterfaceInterface_t **intf = d->iokit.interfaces[intfIndex].intf;
+    struct IOKitInterface *ii = iokitInterface(d, intfIndex);
+    IOUSBInterfaceInterface_t **intf = ii ? ii->intf : 0;
 
     if (!intf) {
         logdebug("iokitGetEndpointDescriptor(): interface %d has not been opened", intfIndex);
@@ -689,26 +944,58 @@ int iokitGetConfiguration(UsbusDevice *device, uint8_t *config)
 
 int iokitSetConfiguration(UsbusDevice *device, uint8_t config)
 {
+    /*
+     * Interfaces of the previous configuration go away,
+     * so close them and size our state for the new one.
+     */
+
     IOUSBDeviceInterface_t** dev = device->iokit.dev;
 
+    unsigned i;
+    for (i = 0; i < device->iokit.numInterfaces; ++i) {
+        iokitCloseInterface(device, i);
+    }
+
     IOReturn ret = (*dev)->SetConfiguration(dev, config);
     if (ret != kIOReturnSuccess) {
         printf("Couldn’t set configuration to value %d (err = %08x)\n", 0, ret);
         return -1;
     }
+
+    uint8_t numConfigs = device->descriptor.bNumConfigurations;
+    for (i = 0; i < numConfigs; ++i) {
+        IOUSBConfigurationDescriptorPtr cfgDesc;
+        if ((*dev)->GetConfigurationDescriptorPtr(dev, i, &cfgDesc) == kIOReturnSuccess &&
+            cfgDesc->bConfigurationValue == config)
+        {
+            device->iokit.cfgDesc = cfgDesc;
+            return sizeInterfaces(device, cfgDesc);
+        }
+    }
+
+    freeInterfaces(device);
     return UsbusOK;
 }
 
 
 int iokitSubmitTransfer(struct UsbusTransfer *t)
 {
+    if (usbusTransferIsControl(t)) {
+        return submitControl(t);
+    }
+
     uint8_t pipeRef, intfIndex;
-    if (pipeRefForEP(t->device, t->endpoint, &pipeRef, &intfIndex) != UsbusOK) {
+    if (transferRoute(t, &pipeRef, &intfIndex) != UsbusOK) {
+        return -1;
+    }
+
+    struct IOKitInterface *ii = iokitInterface(t->device, intfIndex);
+    if (!ii || !ii->intf) {
         return -1;
     }
 
     IOReturn r;
-    IOUSBInterfaceInterface_t **intf = t->device->iokit.interfaces[intfIndex].intf;
+    IOUSBInterfaceInterface_t **intf = ii->intf;
 
     if (usbusTransferIsIN(t)) {
 
@@ -735,18 +1022,34 @@ int iokitCancelTransfer(struct UsbusTransfer *t)
 {
     /*
      * Abort transactions and clear the data toggle bit to avoid losing any data.
-     * XXX: may need to look up pipe ref from endpoint value...
+     * This aborts every transfer on the pipe - dispatchTransferCompletion()
+     * resubmits the others.
      */
 
+    if (usbusTransferIsControl(t)) {
+        IOUSBInterfaceInterface_t **intf = transferPriv(t)->platform.iokit.intf;
+        IOReturn r = (*intf)->AbortPipe(intf, 0);
+        if (r != kIOReturnSuccess) {
+            logerror("error canceling control transfer. abort %08x", r);
+            return -1;
+        }
+        return UsbusOK;
+    }
+
     uint8_t pipeRef, intfIndex;
-    if (pipeRefForEP(t->device, t->endpoint, &pipeRef, &intfIndex) != UsbusOK) {
+    if (transferRoute(t, &pipeRef, &intfIndex) != UsbusOK) {
         return -1;
     }
 
-    IOUSBInterfaceInterface_t **intf = t->device->iokit.interfaces[intfIndex].intf;
+    struct IOKitInterface *ii = iokitInterface(t->device, intfIndex);
+    if (!ii || !ii->intf) {
+        return -1;
+    }
 
-    IOReturn r1 = (*intf)->AbortPipe(intf, t->endpoint);
-    IOReturn r2 = (*intf)->ClearPipeStallBothEnds(intf, t->endpoint);
+    IOUSBInterfaceInterface_t **intf = ii->intf;
+
+    IOReturn r1 = (*intf)->AbortPipe(intf, pipeRef);
+    IOReturn r2 = (*intf)->ClearPipeStallBothEnds(intf, pipeRef);
     if (r1 != kIOReturnSuccess || r2 != kIOReturnSuccess) {
         logerror("error canceling. abort %08x clearpipe %08x", r1, r2);
         return -1;
@@ -793,6 +1096,21 @@ int iokitProcessEvents(UsbusContext *ctx, unsigned timeoutMillis)
 }
 
 
+void iokitWakeup(UsbusContext *ctx)
+{
+    // makes a pending or in-progress CFRunLoopRunInMode() return
+    if (ctx->iokit.runLoopRef) {
+        CFRunLoopStop(ctx->iokit.runLoopRef);
+    }
+}
+
+
+int iokitOpenEndpoint(UsbusDevice *d, struct UsbusEndpoint *e)
+{
+    return pipeRefForEP(d, e->address, &e->pipeRef, &e->interfaceIndex);
+}
+
+
 int iokitReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written)
 {
     uint8_t pipeRef, intfIndex;
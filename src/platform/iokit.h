@@ -24,19 +24,35 @@ struct IOKitContext {
     CFRunLoopRef runLoopRef;
 };
 
+// per-device state is sized from the configuration descriptor when the device is opened.
+// most devices have only a couple of interfaces with a few endpoints each, which fit
+// inline without a separate allocation.
+#define IOKIT_INLINE_INTERFACES     2
+#define IOKIT_INLINE_ENDPOINTS      4
+
 // internal structure for tracking state per interface.
 // only used as a member of IOKitDevice.
 struct IOKitInterface {
     IOUSBInterfaceInterface_t **intf;           // iokit reference for this interface
-    uint8_t epAddresses[USBUS_MAX_ENDPOINTS];   // map endpoint addresses to pipe refs
     CFRunLoopSourceRef runLoopSourceRef;        // event source per interface
+    uint8_t *epAddresses;                       // map pipe refs - 1 to endpoint addresses
+    uint8_t numEndpoints;
+    uint8_t inlineEpAddresses[IOKIT_INLINE_ENDPOINTS];
 };
 
 // iokit-specific potion of UsbusDevice
 struct IOKitDevice {
     IOUSBDeviceInterface_t **dev;
     IOUSBConfigurationDescriptorPtr cfgDesc;
-    struct IOKitInterface interfaces[USBUS_MAX_INTERFACES];
+    struct IOKitInterface *interfaces;          // one per interface in the active configuration
+    uint8_t numInterfaces;
+    struct IOKitInterface inlineInterfaces[IOKIT_INLINE_INTERFACES];
+};
+
+// iokit-specific portion of UsbusTransferPriv, for control transfers only
+struct IOKitTransfer {
+    IOUSBDevRequest request;                    // must outlive ControlRequestAsync()
+    IOUSBInterfaceInterface_t **intf;           // the interface it was submitted through
 };
 
 extern const struct UsbusPlatform platformIOKit;
@@ -50,6 +66,8 @@ int iokitGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang,
 int  iokitOpen(UsbusDevice *d);
 void iokitClose(UsbusDevice *d);
 
+int iokitGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                       uint8_t *buf, unsigned len, unsigned *transferred);
 int iokitGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc);
 int iokitGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc);
 int iokitGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc);
@@ -63,6 +81,8 @@ int iokitSetConfiguration(UsbusDevice *device, uint8_t config);
 int iokitSubmitTransfer(struct UsbusTransfer *t);
 int iokitCancelTransfer(struct UsbusTransfer *t);
 int iokitProcessEvents(UsbusContext *ctx, unsigned timeoutMillis);
+void iokitWakeup(UsbusContext *ctx);
+int iokitOpenEndpoint(UsbusDevice *d, struct UsbusEndpoint *e);
 
 int iokitReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
 int iokitWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written);
@@ -0,0 +1,1124 @@
+
+#include "usbfs.h"
+#include "usbus.h"
+#include "usbus_private.h"
+#include "logger.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define SYSFS_DEVICES           "/sys/bus/usb/devices"
+#define USBFS_DEVICES           "/dev/bus/usb"
+
+#define USBFS_CONTROL_TIMEOUT   1000    // millis
+#define USBFS_MAX_EVENTS        64      // ready devices handled per usbfsProcessEvents()
+#define DEVICE_DESC_LEN         18
+#define CONFIG_DESC_LEN         9
+
+const struct UsbusPlatform platformUsbfs = {
+    "usbfs",
+    usbfsListen,
+    usbfsStopListen,
+    usbfsGetStringDescriptor,
+    usbfsOpen,
+    usbfsClose,
+    usbfsGetConfigDescriptor,
+    usbfsGetInterfaceDescriptor,
+    usbfsGetEndpointDescriptor,
+    usbfsOpenInterface,
+    usbfsCloseInterface,
+    usbfsGetConfiguration,
+    usbfsSetConfiguration,
+    usbfsSubmitTransfer,
+    usbfsCancelTransfer,
+    usbfsProcessEvents,
+    usbfsReadSync,
+    usbfsWriteSync,
+    usbfsAllocateBuffer,
+    usbfsFreeBuffer,
+    usbfsSubmitTransfers,
+    usbfsGetEventFd,
+    usbfsWakeup,
+    0,
+    usbfsGetDescriptor,
+    0
+};
+
+static int enumerateSysfsDevices(UsbusContext *ctx);
+static int enumerateDevfsDevices(UsbusContext *ctx);
+static int devfsMatchSerial(UsbusContext *ctx, int fd, const struct UsbusDeviceDescriptor *desc);
+static int sysfsReadAttr(const char *dev, const char *attr, char *buf, unsigned len);
+static enum UsbusSpeed speedFromSysfs(const char *speed);
+static void devicePath(UsbusDevice *d, char *path, unsigned len);
+static int readDescriptors(struct UsbfsDevice *ud);
+static int findConfig(struct UsbfsDevice *ud, unsigned index, const uint8_t **cfg, unsigned *len);
+static const uint8_t *findInterface(const uint8_t *cfg, unsigned len, unsigned number, unsigned altsetting);
+static int controlTransfer(int fd, uint8_t reqType, uint8_t req, uint16_t value, uint16_t index,
+                           void *data, uint16_t len, unsigned *transferred);
+static int bulkTransfer(int fd, uint8_t ep, void *data, unsigned len, unsigned *transferred);
+static void reapDevice(UsbusDevice *d);
+static enum UsbusStatus statusForUrb(int status);
+static void releaseBuffer(struct UsbfsBuffer *b);
+
+
+/**************
+ * API
+ **************/
+
+int usbfsListen(UsbusContext *ctx)
+{
+    /*
+     * Platform specific implementation of usbusListen()
+     *
+     * usbfs doesn't deliver connect/disconnect events itself (that requires
+     * a netlink/udev monitor), so for now we only report devices that are
+     * already connected.
+     */
+
+    struct UsbfsContext *uc = &ctx->usbfs;
+
+    if (uc->listening) {
+        loginfo("usbusListen called on context that's already listening.");
+        return UsbusOK;
+    }
+
+    uc->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (uc->epollFd < 0) {
+        logerror("usbfsListen() epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+
+    // lets other threads interrupt epoll_wait(), see usbfsWakeup()
+    uc->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (uc->wakeFd < 0) {
+        logerror("usbfsListen() eventfd: %s", strerror(errno));
+        close(uc->epollFd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;    // no device
+    if (epoll_ctl(uc->epollFd, EPOLL_CTL_ADD, uc->wakeFd, &ev) < 0) {
+        logerror("usbfsListen() epoll_ctl: %s", strerror(errno));
+        close(uc->wakeFd);
+        close(uc->epollFd);
+        return -1;
+    }
+
+    // applications polling the descriptors themselves must wake for queued ops too
+    if (addPollFd(ctx, uc->wakeFd, POLLIN) != UsbusOK) {
+        close(uc->wakeFd);
+        close(uc->epollFd);
+        return -1;
+    }
+
+    uc->listening = 1;
+
+    // prefer sysfs, since it lets us inspect devices without touching the device nodes
+    if (enumerateSysfsDevices(ctx) != UsbusOK) {
+        if (enumerateDevfsDevices(ctx) != UsbusOK) {
+            usbfsStopListen(ctx);
+            return UsbusIoErr;
+        }
+    }
+
+    return UsbusOK;
+}
+
+void usbfsStopListen(UsbusContext *ctx)
+{
+    struct UsbfsContext *uc = &ctx->usbfs;
+
+    if (uc->listening) {
+        removePollFd(ctx, uc->wakeFd);
+        close(uc->wakeFd);
+        uc->wakeFd = -1;
+        close(uc->epollFd);
+        uc->epollFd = -1;
+        uc->listening = 0;
+    }
+}
+
+
+int usbfsGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang, uint8_t *buf, unsigned len, unsigned *transferred)
+{
+    return controlTransfer(d->usbfs.fd, 0x80, 0x06, (UsbusDescriptorString << 8) | index, lang,
+                           buf, len, transferred);
+}
+
+
+int usbfsOpen(UsbusDevice *d)
+{
+    /*
+     * Platform specific implementation of usbusOpen()
+     *
+     * Open the device node, and set its first configuration
+     * if the device is not configured yet.
+     */
+
+    struct UsbfsDevice *ud = &d->usbfs;
+    struct UsbfsContext *uc = &d->ctx->usbfs;
+
+    char path[64];
+    devicePath(d, path, sizeof path);
+
+    ud->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (ud->fd < 0) {
+        logdebug("usbfsOpen() open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (readDescriptors(ud) != UsbusOK) {
+        close(ud->fd);
+        return -1;
+    }
+
+    if (ioctl(ud->fd, USBDEVFS_GET_CAPABILITIES, &ud->caps) < 0) {
+        ud->caps = 0;
+    }
+
+    uint8_t config;
+    if (usbfsGetConfiguration(d, &config) == UsbusOK && config == 0) {
+        const uint8_t *cfg;
+        unsigned cfgLen;
+        if (findConfig(ud, 0, &cfg, &cfgLen) == UsbusOK) {
+            usbfsSetConfiguration(d, cfg[5]);   // bConfigurationValue
+        }
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    // usbfs signals reapable urbs as writable - edge triggered, as reapDevice() always drains them all
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.ptr = d;
+    if (epoll_ctl(uc->epollFd, EPOLL_CTL_ADD, ud->fd, &ev) < 0) {
+        logwarn("usbfsOpen() epoll_ctl: %s", strerror(errno));
+        free(ud->descriptors);
+        ud->descriptors = 0;
+        close(ud->fd);
+        return -1;
+    }
+
+    addPollFd(d->ctx, ud->fd, POLLOUT);
+
+    return UsbusOK;
+}
+
+void usbfsClose(UsbusDevice *d)
+{
+    struct UsbfsDevice *ud = &d->usbfs;
+
+    unsigned i;
+    for (i = 0; i < USBUS_MAX_INTERFACES; ++i) {
+        if (ud->claimed[i / 32] & (1u << (i % 32))) {
+            usbfsCloseInterface(d, i);
+        }
+    }
+
+    epoll_ctl(d->ctx->usbfs.epollFd, EPOLL_CTL_DEL, ud->fd, 0);
+    removePollFd(d->ctx, ud->fd);
+
+    /*
+     * Closing the device node kills any urbs that are still in flight,
+     * and waits for them to be given back, so the transfers are free
+     * to be reused afterwards.
+     */
+    close(ud->fd);
+    ud->fd = -1;
+    ud->pending = 0;
+
+    // any transfer buffers that haven't been freed are no longer usable
+    while (ud->buffers) {
+        struct UsbfsBuffer *b = ud->buffers;
+        ud->buffers = b->next;
+        releaseBuffer(b);
+    }
+
+    free(ud->descriptors);
+    ud->descriptors = 0;
+    ud->descriptorsLen = 0;
+}
+
+int usbfsGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                       uint8_t *buf, unsigned len, unsigned *transferred)
+{
+    /*
+     * Configuration descriptors are served from those read from
+     * the device node, other types go to the device.
+     */
+
+    if (type == UsbusDescriptorConfig) {
+        const uint8_t *cfg;
+        unsigned cfgLen;
+        if (findConfig(&d->usbfs, index, &cfg, &cfgLen) != UsbusOK) {
+            return UsbusNotFound;
+        }
+        *transferred = cfgLen < len ? cfgLen : len;
+        memcpy(buf, cfg, *transferred);
+        return UsbusOK;
+    }
+
+    return controlTransfer(d->usbfs.fd, 0x80, 0x06, (type << 8) | index, lang, buf, len, transferred);
+}
+
+
+int usbfsGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc)
+{
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(&d->usbfs, index, &cfg, &len) != UsbusOK) {
+        logdebug("usbfsGetConfigDescriptor(): no config at index %d", index);
+        return UsbusNotFound;
+    }
+
+    desc->bLength = cfg[0];
+    desc->bDescriptorType = cfg[1];
+    desc->wTotalLength = cfg[2] | (cfg[3] << 8);
+    desc->bNumInterfaces = cfg[4];
+    desc->bConfigurationValue = cfg[5];
+    desc->iConfiguration = cfg[6];
+    desc->bmAttributes = cfg[7];
+    desc->bMaxPower = cfg[8];
+
+    return UsbusOK;
+}
+
+int usbfsGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc)
+{
+    /*
+     * As with IOKit, interfaces are looked up in the first configuration.
+     */
+
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(&d->usbfs, 0, &cfg, &len) != UsbusOK) {
+        return UsbusNotFound;
+    }
+
+    const uint8_t *intf = findInterface(cfg, len, index, altsetting);
+    if (!intf) {
+        return UsbusNotFound;
+    }
+
+    memcpy(desc, intf, sizeof(*desc));
+    return UsbusOK;
+}
+
+int usbfsGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc)
+{
+    const uint8_t *cfg;
+    unsigned len;
+    if (findConfig(&d->usbfs, 0, &cfg, &len) != UsbusOK) {
+        return UsbusNotFound;
+    }
+
+    const uint8_t *p = findInterface(cfg, len, intfIndex, 0);
+    if (!p) {
+        return UsbusNotFound;
+    }
+
+    /*
+     * Step through the descriptors that follow the interface descriptor,
+     * until we hit the next interface.
+     */
+
+    const uint8_t *pend = cfg + len;
+    unsigned e = 0;
+    for (p += p[0]; p + 2 <= pend && p[0] != 0; p += p[0]) {
+        if (p[1] == UsbusDescriptorInterface) {
+            break;
+        }
+
+        if (p[1] == UsbusDescriptorEndpoint && p[0] >= 7) {
+            if (e++ == ep) {
+                desc->bLength = p[0];
+                desc->bDescriptorType = p[1];
+                desc->bEndpointAddress = p[2];
+                desc->bmAttributes = p[3];
+                desc->wMaxPacketSize = p[4] | (p[5] << 8);
+                desc->bInterval = p[6];
+                return UsbusOK;
+            }
+        }
+    }
+
+    return UsbusNotFound;
+}
+
+int usbfsOpenInterface(UsbusDevice *d, unsigned index)
+{
+    struct UsbfsDevice *ud = &d->usbfs;
+
+    if (index >= USBUS_MAX_INTERFACES) {
+        logdebug("usbfsOpenInterface(): interface index %d is too high", index);
+        return -1;
+    }
+
+    if (ud->claimed[index / 32] & (1u << (index % 32))) {
+        return UsbusOK;
+    }
+
+    unsigned int intf = index;
+    if (ioctl(ud->fd, USBDEVFS_CLAIMINTERFACE, &intf) < 0) {
+        logdebug("usbfsOpenInterface() USBDEVFS_CLAIMINTERFACE: %s", strerror(errno));
+        return -1;
+    }
+
+    ud->claimed[index / 32] |= 1u << (index % 32);
+    return UsbusOK;
+}
+
+int usbfsCloseInterface(UsbusDevice *d, unsigned index)
+{
+    struct UsbfsDevice *ud = &d->usbfs;
+
+    if (index >= USBUS_MAX_INTERFACES) {
+        logdebug("usbfsCloseInterface(): interface index %d is too high", index);
+        return -1;
+    }
+
+    if (!(ud->claimed[index / 32] & (1u << (index % 32)))) {
+        return UsbusOK;
+    }
+
+    ud->claimed[index / 32] &= ~(1u << (index % 32));
+
+    unsigned int intf = index;
+    if (ioctl(ud->fd, USBDEVFS_RELEASEINTERFACE, &intf) < 0) {
+        logdebug("usbfsCloseInterface() USBDEVFS_RELEASEINTERFACE: %s", strerror(errno));
+        return -1;
+    }
+
+    return UsbusOK;
+}
+
+int usbfsGetConfiguration(UsbusDevice *device, uint8_t *config)
+{
+    unsigned transferred;
+    int r = controlTransfer(device->usbfs.fd, 0x80, 0x08, 0, 0, config, 1, &transferred);
+    if (r != UsbusOK || transferred != 1) {
+        return -1;
+    }
+
+    return UsbusOK;
+}
+
+int usbfsSetConfiguration(UsbusDevice *device, uint8_t config)
+{
+    unsigned int c = config;
+    if (ioctl(device->usbfs.fd, USBDEVFS_SETCONFIGURATION, &c) < 0) {
+        logdebug("usbfsSetConfiguration() USBDEVFS_SETCONFIGURATION: %s", strerror(errno));
+        return -1;
+    }
+
+    return UsbusOK;
+}
+
+
+static inline int submitUrb(struct UsbfsDevice *ud, struct UsbusTransfer *t)
+{
+    struct UsbfsTransfer *ut = &transferPriv(t)->platform.usbfs;
+
+    memset(ut, 0, sizeof(*ut));
+    ut->t = t;
+
+    /*
+     * usbfs quietly converts bulk urbs to interrupt urbs for interrupt
+     * endpoints, so bulk is a fine default. Control urbs start with their
+     * setup packet, which the kernel takes the direction from.
+     * Isochronous urbs need a packet descriptor table we don't build yet.
+     */
+    if (usbusTransferIsControl(t)) {
+        ut->urb.type = USBDEVFS_URB_TYPE_CONTROL;
+        ut->urb.endpoint = 0;
+    } else if (t->type == UsbusTransferIsochronous) {
+        logdebug("usbfsSubmitTransfer(): isochronous transfers aren't supported");
+        return UsbusNotSupported;
+    } else {
+        ut->urb.type = (t->type == UsbusTransferInterrupt) ? USBDEVFS_URB_TYPE_INTERRUPT : USBDEVFS_URB_TYPE_BULK;
+        ut->urb.endpoint = t->endpoint;
+    }
+    ut->urb.buffer = t->buffer;
+    ut->urb.buffer_length = t->requestedLength;
+    ut->urb.usercontext = ut;
+
+    if (ioctl(ud->fd, USBDEVFS_SUBMITURB, &ut->urb) < 0) {
+        logdebug("usbfsSubmitTransfer() USBDEVFS_SUBMITURB: %s", strerror(errno));
+        return -1;
+    }
+
+    ut->next = ud->pending;
+    if (ud->pending) {
+        ud->pending->prev = ut;
+    }
+    ud->pending = ut;
+
+    return UsbusOK;
+}
+
+int usbfsSubmitTransfer(struct UsbusTransfer *t)
+{
+    return submitUrb(&t->device->usbfs, t);
+}
+
+
+int usbfsSubmitTransfers(struct UsbusTransfer **ts, unsigned n, int *results)
+{
+    /*
+     * usbfs has no way to submit several urbs in one syscall, but we can
+     * at least issue them back to back. All transfers are for the same device.
+     */
+
+    struct UsbfsDevice *ud = &ts[0]->device->usbfs;
+    int r = UsbusOK;
+
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+        results[i] = submitUrb(ud, ts[i]);
+        if (results[i] != UsbusOK) {
+            r = results[i];
+        }
+    }
+
+    return r;
+}
+
+
+int usbfsCancelTransfer(struct UsbusTransfer *t)
+{
+    /*
+     * Unlike IOKit and WinUSB, usbfs can discard an individual urb.
+     * The transfer completes with UsbusCanceled once it has been reaped.
+     */
+
+    struct UsbfsDevice *ud = &t->device->usbfs;
+    struct UsbfsTransfer *ut = &transferPriv(t)->platform.usbfs;
+
+    if (ioctl(ud->fd, USBDEVFS_DISCARDURB, &ut->urb) < 0) {
+        // EINVAL means it already completed, and is waiting to be reaped
+        if (errno != EINVAL) {
+            logdebug("usbfsCancelTransfer() USBDEVFS_DISCARDURB: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return UsbusOK;
+}
+
+
+int usbfsProcessEvents(UsbusContext *ctx, unsigned timeoutMillis)
+{
+    /*
+     * epoll only reports devices with urbs to reap, so the cost here follows
+     * the devices that are ready rather than those that are open. Any beyond
+     * USBFS_MAX_EVENTS stay queued in the epoll instance for the next call.
+     */
+
+    struct UsbfsContext *uc = &ctx->usbfs;
+
+    struct epoll_event events[USBFS_MAX_EVENTS];
+    int n = epoll_wait(uc->epollFd, events, USBFS_MAX_EVENTS, (int)timeoutMillis);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return UsbusOK;
+        }
+        logwarn("usbfsProcessEvents() epoll_wait: %s", strerror(errno));
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (events[i].data.ptr) {
+            reapDevice(events[i].data.ptr);
+        } else {
+            uint64_t count;
+            if (read(uc->wakeFd, &count, sizeof count) < 0 && errno != EAGAIN) {
+                logdebug("usbfsProcessEvents() read: %s", strerror(errno));
+            }
+        }
+    }
+
+    return UsbusOK;
+}
+
+
+void usbfsWakeup(UsbusContext *ctx)
+{
+    uint64_t one = 1;
+    if (write(ctx->usbfs.wakeFd, &one, sizeof one) < 0 && errno != EAGAIN) {
+        logdebug("usbfsWakeup() write: %s", strerror(errno));
+    }
+}
+
+
+int usbfsGetEventFd(UsbusContext *ctx, int *fd)
+{
+    /*
+     * The epoll descriptor itself is readable whenever
+     * any open device has urbs to reap.
+     */
+
+    struct UsbfsContext *uc = &ctx->usbfs;
+
+    if (!uc->listening) {
+        return UsbusNotOpen;
+    }
+
+    *fd = uc->epollFd;
+    return UsbusOK;
+}
+
+
+int usbfsReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written)
+{
+    return bulkTransfer(d->usbfs.fd, ep, buf, len, written);
+}
+
+
+int usbfsWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written)
+{
+    return bulkTransfer(d->usbfs.fd, ep, (uint8_t*)buf, len, written);
+}
+
+
+uint8_t *usbfsAllocateBuffer(UsbusDevice *d, unsigned len)
+{
+    /*
+     * Memory mapped from the device node is allocated by the kernel, and
+     * recognized by usbfs when an urb refers to it - data is then transferred
+     * in place rather than being copied to/from a kernel buffer.
+     *
+     * Fall back to regular memory if the kernel doesn't support it,
+     * or the usbfs memory limit has been reached.
+     */
+
+    struct UsbfsDevice *ud = &d->usbfs;
+
+    struct UsbfsBuffer *b = malloc(sizeof *b);
+    if (!b) {
+        logerror("usbfsAllocateBuffer(): failed to allocate UsbfsBuffer");
+        return 0;
+    }
+
+    b->len = len;
+    b->mapped = 0;
+    b->data = 0;
+
+    if (ud->caps & USBDEVFS_CAP_MMAP) {
+        void *p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, ud->fd, 0);
+        if (p != MAP_FAILED) {
+            b->data = p;
+            b->mapped = 1;
+        } else {
+            logdebug("usbfsAllocateBuffer() mmap: %s", strerror(errno));
+        }
+    }
+
+    if (!b->data) {
+        b->data = malloc(len);
+        if (!b->data) {
+            logerror("usbfsAllocateBuffer(): failed to allocate %d bytes", len);
+            free(b);
+            return 0;
+        }
+    }
+
+    b->next = ud->buffers;
+    ud->buffers = b;
+
+    return b->data;
+}
+
+
+void usbfsFreeBuffer(UsbusDevice *d, uint8_t *buf)
+{
+    struct UsbfsDevice *ud = &d->usbfs;
+
+    struct UsbfsBuffer **pb;
+    for (pb = &ud->buffers; *pb; pb = &(*pb)->next) {
+        if ((*pb)->data == buf) {
+            struct UsbfsBuffer *b = *pb;
+            *pb = b->next;
+            releaseBuffer(b);
+            return;
+        }
+    }
+
+    logwarn("usbfsFreeBuffer(): unknown buffer %p", buf);
+}
+
+
+/************************************
+ * Internal Implementation/Helpers
+ ************************************/
+
+static int enumerateSysfsDevices(UsbusContext *ctx)
+{
+    /*
+     * Each device appears in sysfs as a directory named after its port path (1-1.4),
+     * while its interfaces appear alongside it with a config/interface suffix (1-1.4:1.0).
+     * Root hubs show up as usbN.
+     */
+
+    DIR *dir = opendir(SYSFS_DEVICES);
+    if (!dir) {
+        logdebug("opendir %s: %s", SYSFS_DEVICES, strerror(errno));
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+
+        if (ent->d_name[0] == '.' || strchr(ent->d_name, ':')) {
+            continue;
+        }
+
+        char buf[DEVICE_DESC_LEN];
+        char attr[32];
+        if (sysfsReadAttr(ent->d_name, "descriptors", buf, sizeof buf) != DEVICE_DESC_LEN) {
+            continue;
+        }
+
+        struct UsbusDeviceDescriptor desc;
+        memcpy(&desc, buf, sizeof desc);
+
+        // filter out hubs - we don't offer any API to do anything interesting with them
+        if (desc.bDeviceClass == UsbusClassHub) {
+            continue;
+        }
+
+        if (sysfsReadAttr(ent->d_name, "busnum", attr, sizeof attr - 1) <= 0) {
+            continue;
+        }
+        unsigned busnum = strtoul(attr, 0, 10);
+
+        if (!matchDevice(ctx, &desc, busnum)) {
+            continue;
+        }
+
+        if (matchNeedsSerial(ctx)) {
+            char serial[256];
+            int n = sysfsReadAttr(ent->d_name, "serial", serial, sizeof serial - 1);
+            if (n > 0 && serial[n - 1] == '\n') {
+                serial[n - 1] = 0;
+            }
+            if (!matchSerial(ctx, n > 0 ? serial : 0)) {
+                continue;
+            }
+        }
+
+        if (sysfsReadAttr(ent->d_name, "devnum", attr, sizeof attr - 1) <= 0) {
+            continue;
+        }
+        unsigned devnum = strtoul(attr, 0, 10);
+
+        UsbusDevice *d = allocateDevice();
+        if (d) {
+            d->descriptor = desc;
+            d->busNumber = busnum;
+            d->address = devnum;
+            if (sysfsReadAttr(ent->d_name, "speed", attr, sizeof attr - 1) > 0) {
+                d->speed = speedFromSysfs(attr);
+            }
+            dispatchConnectedDevice(ctx, d);
+        }
+    }
+
+    closedir(dir);
+    return UsbusOK;
+}
+
+static int enumerateDevfsDevices(UsbusContext *ctx)
+{
+    /*
+     * Fallback for systems without sysfs mounted: walk /dev/bus/usb/BBB/DDD
+     * and read the device descriptor from the head of each device node.
+     */
+
+    DIR *busDir = opendir(USBFS_DEVICES);
+    if (!busDir) {
+        logerror("opendir %s: %s", USBFS_DEVICES, strerror(errno));
+        return -1;
+    }
+
+    struct dirent *busEnt;
+    while ((busEnt = readdir(busDir))) {
+
+        char *end;
+        unsigned busnum = strtoul(busEnt->d_name, &end, 10);
+        if (busEnt->d_name[0] == '.' || *end != 0) {
+            continue;
+        }
+
+        char path[64];
+        snprintf(path, sizeof path, "%s/%03u", USBFS_DEVICES, busnum);
+
+        DIR *devDir = opendir(path);
+        if (!devDir) {
+            continue;
+        }
+
+        struct dirent *devEnt;
+        while ((devEnt = readdir(devDir))) {
+
+            unsigned devnum = strtoul(devEnt->d_name, &end, 10);
+            if (devEnt->d_name[0] == '.' || *end != 0) {
+                continue;
+            }
+
+            char devPath[64];
+            snprintf(devPath, sizeof devPath, "%s/%03u/%03u", USBFS_DEVICES, busnum, devnum);
+
+            // control requests for the serial number need a writable node
+            int fd = open(devPath, (matchNeedsSerial(ctx) ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+
+            struct UsbusDeviceDescriptor desc;
+            ssize_t n = read(fd, &desc, DEVICE_DESC_LEN);
+
+            if (n != DEVICE_DESC_LEN || desc.bDeviceClass == UsbusClassHub ||
+                !matchDevice(ctx, &desc, busnum) ||
+                (matchNeedsSerial(ctx) && !devfsMatchSerial(ctx, fd, &desc)))
+            {
+                close(fd);
+                continue;
+            }
+            close(fd);
+
+            UsbusDevice *d = allocateDevice();
+            if (d) {
+                d->descriptor = desc;
+                d->busNumber = busnum;
+                d->address = devnum;
+                dispatchConnectedDevice(ctx, d);
+            }
+        }
+
+        closedir(devDir);
+    }
+
+    closedir(busDir);
+    return UsbusOK;
+}
+
+static int devfsMatchSerial(UsbusContext *ctx, int fd, const struct UsbusDeviceDescriptor *desc)
+{
+    /*
+     * Without sysfs, the serial number must be requested from the device.
+     * Standard requests to the device don't require claiming an interface.
+     */
+
+    if (desc->iSerialNumber == 0) {
+        return matchSerial(ctx, 0);
+    }
+
+    uint8_t langs[4];
+    unsigned n;
+    if (controlTransfer(fd, 0x80, 0x06, UsbusDescriptorString << 8, 0, langs, sizeof langs, &n) != UsbusOK || n < 4) {
+        return matchSerial(ctx, 0);
+    }
+
+    uint8_t str[255];
+    uint16_t lang = langs[2] | (langs[3] << 8);
+    if (controlTransfer(fd, 0x80, 0x06, (UsbusDescriptorString << 8) | desc->iSerialNumber, lang,
+                        str, sizeof str, &n) != UsbusOK || n < 2) {
+        return matchSerial(ctx, 0);
+    }
+
+    if (str[0] > n) {
+        str[0] = n;
+    }
+    return matchSerialDescriptor(ctx, str);
+}
+
+static int sysfsReadAttr(const char *dev, const char *attr, char *buf, unsigned len)
+{
+    /*
+     * Read up to `len` bytes of the given sysfs attribute.
+     * Returns the number of bytes read, and null terminates text attributes
+     * if there's room to do so.
+     */
+
+    char path[256];
+    snprintf(path, sizeof path, "%s/%s/%s", SYSFS_DEVICES, dev, attr);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t n = read(fd, buf, len);
+    close(fd);
+
+    if (n >= 0 && (unsigned)n < len) {
+        buf[n] = 0;
+    }
+
+    return (int)n;
+}
+
+static enum UsbusSpeed speedFromSysfs(const char *speed)
+{
+    /*
+     * sysfs reports speed in Mbps.
+     */
+
+    unsigned mbps = strtoul(speed, 0, 10);
+    if (mbps >= 5000) {
+        return UsbusSuperSpeed;
+    }
+    if (mbps >= 480) {
+        return UsbusHighSpeed;
+    }
+    if (mbps >= 12) {
+        return UsbusFullSpeed;
+    }
+    return UsbusLowSpeed;
+}
+
+static void devicePath(UsbusDevice *d, char *path, unsigned len)
+{
+    snprintf(path, len, "%s/%03u/%03u", USBFS_DEVICES, d->busNumber, d->address);
+}
+
+static int readDescriptors(struct UsbfsDevice *ud)
+{
+    /*
+     * Reading the device node yields the device descriptor, followed
+     * by each of the device's full configuration descriptors.
+     * Capture them all, since they're the source for the descriptor APIs.
+     */
+
+    unsigned cap = 0;
+    ud->descriptors = 0;
+    ud->descriptorsLen = 0;
+
+    for (;;) {
+        if (ud->descriptorsLen == cap) {
+            cap += 1024;
+            uint8_t *p = realloc(ud->descriptors, cap);
+            if (!p) {
+                logerror("readDescriptors(): failed to allocate descriptor buffer");
+                break;
+            }
+            ud->descriptors = p;
+        }
+
+        ssize_t n = read(ud->fd, ud->descriptors + ud->descriptorsLen, cap - ud->descriptorsLen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        ud->descriptorsLen += n;
+    }
+
+    if (ud->descriptorsLen < DEVICE_DESC_LEN) {
+        logdebug("readDescriptors(): short read (%d bytes)", ud->descriptorsLen);
+        free(ud->descriptors);
+        ud->descriptors = 0;
+        ud->descriptorsLen = 0;
+        return -1;
+    }
+
+    return UsbusOK;
+}
+
+static int findConfig(struct UsbfsDevice *ud, unsigned index, const uint8_t **cfg, unsigned *len)
+{
+    /*
+     * Locate the full configuration descriptor at the given index.
+     */
+
+    if (!ud->descriptors) {
+        return -1;
+    }
+
+    const uint8_t *p = ud->descriptors + ud->descriptors[0];
+    const uint8_t *pend = ud->descriptors + ud->descriptorsLen;
+
+    unsigned i;
+    for (i = 0; p + CONFIG_DESC_LEN <= pend; ++i) {
+
+        unsigned total = p[2] | (p[3] << 8);
+        if (p[1] != UsbusDescriptorConfig || total < CONFIG_DESC_LEN || p + total > pend) {
+            break;
+        }
+
+        if (i == index) {
+            *cfg = p;
+            *len = total;
+            return UsbusOK;
+        }
+
+        p += total;
+    }
+
+    return -1;
+}
+
+static const uint8_t *findInterface(const uint8_t *cfg, unsigned len, unsigned number, unsigned altsetting)
+{
+    /*
+     * Step through the descriptors within a configuration descriptor,
+     * looking for the requested interface.
+     */
+
+    const uint8_t *p = cfg;
+    const uint8_t *pend = cfg + len;
+
+    while (p + 2 <= pend && p[0] != 0) {
+        if (p[1] == UsbusDescriptorInterface && p[0] >= 9 && p + p[0] <= pend &&
+            p[2] == number && p[3] == altsetting)
+        {
+            return p;
+        }
+        p += p[0];
+    }
+
+    return 0;
+}
+
+static int controlTransfer(int fd, uint8_t reqType, uint8_t req, uint16_t value, uint16_t index,
+                           void *data, uint16_t len, unsigned *transferred)
+{
+    struct usbdevfs_ctrltransfer ctrl;
+    ctrl.bRequestType = reqType;
+    ctrl.bRequest = req;
+    ctrl.wValue = value;
+    ctrl.wIndex = index;
+    ctrl.wLength = len;
+    ctrl.timeout = USBFS_CONTROL_TIMEOUT;
+    ctrl.data = data;
+
+    int r;
+    do {
+        r = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        logdebug("controlTransfer() USBDEVFS_CONTROL: %s", strerror(errno));
+        return -1;
+    }
+
+    *transferred = r;
+    return UsbusOK;
+}
+
+static int bulkTransfer(int fd, uint8_t ep, void *data, unsigned len, unsigned *transferred)
+{
+    struct usbdevfs_bulktransfer bulk;
+    bulk.ep = ep;
+    bulk.len = len;
+    bulk.timeout = 0;   // wait indefinitely, as the other platforms do
+    bulk.data = data;
+
+    int r;
+    do {
+        r = ioctl(fd, USBDEVFS_BULK, &bulk);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        logdebug("bulkTransfer() USBDEVFS_BULK: %s", strerror(errno));
+        return -1;
+    }
+
+    *transferred = r;
+    return UsbusOK;
+}
+
+static void reapDevice(UsbusDevice *d)
+{
+    /*
+     * Reap every urb that has completed on this device, and dispatch
+     * its completion. The device is registered edge triggered, so it's
+     * only reported again once something new completes - stopping short
+     * of EAGAIN would leave urbs unreaped.
+     *
+     * A callback may close the device, so check that it's still open
+     * before reaping the next one.
+     */
+
+    struct UsbfsDevice *ud = &d->usbfs;
+
+    while (d->isOpen) {
+
+        struct usbdevfs_urb *urb;
+        if (ioctl(ud->fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+            if (errno == ENODEV) {
+                // device has gone away - stop waking up for it
+                logwarn("device %03d/%03d disconnected", d->busNumber, d->address);
+                epoll_ctl(d->ctx->usbfs.epollFd, EPOLL_CTL_DEL, ud->fd, 0);
+                removePollFd(d->ctx, ud->fd);
+            } else if (errno != EAGAIN) {
+                logdebug("reapDevice() USBDEVFS_REAPURBNDELAY: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct UsbfsTransfer *ut = urb->usercontext;
+        if (ut->prev) {
+            ut->prev->next = ut->next;
+        } else {
+            ud->pending = ut->next;
+        }
+        if (ut->next) {
+            ut->next->prev = ut->prev;
+        }
+
+        struct UsbusTransfer *t = ut->t;
+        t->transferredlength = urb->actual_length;
+        dispatchTransferCompletion(t, statusForUrb(urb->status));
+    }
+}
+
+static enum UsbusStatus statusForUrb(int status)
+{
+    switch (status) {
+    case 0:
+    case -EREMOTEIO:    // short packet
+        return UsbusComplete;
+
+    case -ENOENT:
+    case -ECONNRESET:
+        return UsbusCanceled;
+
+    case -EPIPE:
+        return UsbusStalled;
+
+    case -EOVERFLOW:
+        return UsbusOverflow;
+
+    case -ETIMEDOUT:
+        return UsbusTimeout;
+
+    default:
+        logdebug("unknown urb status: %d", status);
+        return UsbusStatusGenericError;
+    }
+}
+
+static void releaseBuffer(struct UsbfsBuffer *b)
+{
+    if (b->mapped) {
+        munmap(b->data, b->len);
+    } else {
+        free(b->data);
+    }
+    free(b);
+}
@@ -0,0 +1,81 @@
+#ifndef USBFS_H
+#define USBFS_H
+
+#include "usbus.h"
+#include "usbus_limits.h"
+
+#include <linux/usbdevice_fs.h>
+
+// usbfs-specific potion of UsbusContext
+struct UsbfsContext {
+    int epollFd;            // readiness for all open devices
+    int wakeFd;             // eventfd, signaled by usbfsWakeup()
+    uint8_t listening;
+};
+
+// struct to track transfers through usbfs, stored inline in each pooled transfer.
+// the urb's usercontext points back to this struct so it can be
+// recovered when the urb is reaped.
+struct UsbfsTransfer {
+    struct usbdevfs_urb urb;
+    struct UsbusTransfer *t;
+    struct UsbfsTransfer *prev;
+    struct UsbfsTransfer *next;
+};
+
+// transfer buffer handed out by usbfsAllocateBuffer()
+struct UsbfsBuffer {
+    uint8_t *data;
+    unsigned len;
+    uint8_t mapped;                     // mapped from the device node, rather than malloc'd
+    struct UsbfsBuffer *next;
+};
+
+// usbfs-specific potion of UsbusDevice
+struct UsbfsDevice {
+    int fd;
+    uint8_t *descriptors;               // raw device + config descriptors, as read from the device node
+    unsigned descriptorsLen;
+    uint32_t claimed[(USBUS_MAX_INTERFACES + 31) / 32];    // bitmap of claimed interfaces
+    struct UsbfsTransfer *pending;      // urbs submitted but not yet reaped
+    struct UsbfsBuffer *buffers;        // allocated transfer buffers
+    uint32_t caps;                      // USBDEVFS_CAP_*
+};
+
+extern const struct UsbusPlatform platformUsbfs;
+
+int usbfsListen(UsbusContext *ctx);
+void usbfsStopListen(UsbusContext *ctx);
+
+int usbfsGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang,
+                             uint8_t *buf, unsigned len, unsigned *transferred);
+
+int  usbfsOpen(UsbusDevice *d);
+void usbfsClose(UsbusDevice *d);
+
+int usbfsGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                       uint8_t *buf, unsigned len, unsigned *transferred);
+int usbfsGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc);
+int usbfsGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc);
+int usbfsGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc);
+
+int usbfsOpenInterface(UsbusDevice *d, unsigned index);
+int usbfsCloseInterface(UsbusDevice *d, unsigned index);
+
+int usbfsGetConfiguration(UsbusDevice *device, uint8_t *config);
+int usbfsSetConfiguration(UsbusDevice *device, uint8_t config);
+
+int usbfsSubmitTransfer(struct UsbusTransfer *t);
+int usbfsSubmitTransfers(struct UsbusTransfer **ts, unsigned n, int *results);
+int usbfsCancelTransfer(struct UsbusTransfer *t);
+int usbfsProcessEvents(UsbusContext *ctx, unsigned timeoutMillis);
+int usbfsGetEventFd(UsbusContext *ctx, int *fd);
+void usbfsWakeup(UsbusContext *ctx);
+
+int usbfsReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
+int usbfsWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written);
+
+uint8_t *usbfsAllocateBuffer(UsbusDevice *d, unsigned len);
+void usbfsFreeBuffer(UsbusDevice *d, uint8_t *buf);
+
+#endif // USBFS_H
@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
  * XXX: the only MinGW version I've seen that ships with winusb.h is MinGW-64
@@ -21,6 +22,9 @@
 #include <api/usbiodef.h>
 #endif
 
+#define WINUSB_MAX_EVENTS       64                  // completions dequeued per winusbProcessEvents()
+#define WIN_STATUS_CANCELLED    ((LONG)0xC0000120)  // NTSTATUS of an aborted transfer
+
 #if !defined(GUID_DEVINTERFACE_USB_DEVICE)
 const GUID GUID_DEVINTERFACE_USB_DEVICE = { 0xA5DCBF10, 0x6530, 0x11D2, {0x90, 0x1F, 0x00, 0xC0, 0x4F, 0xB9, 0x51, 0xED} };
 #endif
@@ -43,13 +47,24 @@ const struct UsbusPlatform platformWinUSB = {
     winusbCancelTransfer,
     winusbProcessEvents,
     winusbReadSync,
-    winusbWriteSync
+    winusbWriteSync,
+    0,
+    0,
+    0,
+    0,
+    winusbWakeup,
+    winusbOpenEndpoint,
+    winusbGetDescriptor,
+    winusbDispose
 };
 
 static char *win32ErrorString(uint32_t errorCode);
 
 static void enumerateConnectedDevices(UsbusContext *ctx, const GUID *guid);
 static WINUSB_INTERFACE_HANDLE intfHandle(struct WinUSBDevice *wd, unsigned index);
+static WINUSB_INTERFACE_HANDLE transferHandle(struct UsbusTransfer *t);
+static int sizeHandles(UsbusDevice *d);
+static int instanceMatch(UsbusContext *ctx, HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData);
 static int populateDeviceDetails(UsbusDevice *d, HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, const GUID *guid);
 static int getDevicePath(UsbusDevice *d, HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, const GUID *guid);
 static int getDeviceSpeed(UsbusDevice *d, WINUSB_INTERFACE_HANDLE h);
@@ -137,10 +152,10 @@ int winusbOpen(UsbusDevice *d)
     struct WinUSBDevice *wd = &d->winusb;
     struct WinUSBContext *wc = &d->ctx->winusb;
 
-    unsigned i;
-    for (i = 0; i < ARRAYSIZE(wd->winusbHandles); ++i) {
-        wd->winusbHandles[i] = NULL;
-    }
+    // enough to initialize the first interface, until we've seen the configuration
+    wd->winusbHandles = wd->inlineHandles;
+    wd->numHandles = WINUSB_INLINE_INTERFACES;
+    ZeroMemory(wd->inlineHandles, sizeof wd->inlineHandles);
 
     wd->deviceHandle = CreateFile(wd->path,
                                   GENERIC_READ | GENERIC_WRITE,
@@ -160,6 +175,11 @@ int winusbOpen(UsbusDevice *d)
         return -1;
     }
 
+    if (sizeHandles(d) != UsbusOK) {
+        winusbClose(d);
+        return -1;
+    }
+
     /*
      * Add this handle to our completion port.
      * If the completion port hasn't been created yet, do it now.
@@ -190,14 +210,47 @@ void winusbClose(UsbusDevice *d)
     }
 
     unsigned i;
-    for (i = 0; i < ARRAYSIZE(wd->winusbHandles); ++i) {
+    for (i = 0; i < wd->numHandles; ++i) {
         if (wd->winusbHandles[i] != NULL) {
             WinUsb_Free(wd->winusbHandles[i]);
             wd->winusbHandles[i] = NULL;
         }
     }
+
+    if (wd->winusbHandles != wd->inlineHandles) {
+        free(wd->winusbHandles);
+    }
+    wd->winusbHandles = wd->inlineHandles;
+    wd->numHandles = 0;
 }
 
+void winusbDispose(UsbusDevice *d)
+{
+    /*
+     * Platform specific portion of usbusDispose()
+     */
+
+    free(d->winusb.path);
+    d->winusb.path = NULL;
+}
+
+int winusbGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                        uint8_t *buf, unsigned len, unsigned *transferred)
+{
+    struct WinUSBDevice *wd = &d->winusb;
+
+    ULONG sz;
+    if (!WinUsb_GetDescriptor(wd->winusbHandles[0], type, index, lang, buf, len, &sz)) {
+        logdebug("winusbGetDescriptor() WinUsb_GetDescriptor: %s",
+                 win32ErrorString(GetLastError()));
+        return -1;
+    }
+
+    *transferred = sz;
+    return UsbusOK;
+}
+
+
 int winusbGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc)
 {
     struct WinUSBDevice *wd = &d->winusb;
@@ -265,7 +318,7 @@ int winusbOpenInterface(UsbusDevice *d, unsigned index)
 {
     struct WinUSBDevice *wd = &d->winusb;
 
-    if (index >= ARRAYSIZE(wd->winusbHandles)) {
+    if (index >= wd->numHandles) {
         logdebug("winusbClaimInterface(): interface index %d is too high\n", index);
         return -1;
     }
@@ -288,8 +341,8 @@ int winusbCloseInterface(UsbusDevice *d, unsigned index)
 {
     struct WinUSBDevice *wd = &d->winusb;
 
-    if (index >= ARRAYSIZE(wd->winusbHandles)) {
-        logdebug("winusbGetEndpointDescriptor(): interface index %d is too high\n", index);
+    if (index >= wd->numHandles) {
+        logdebug("winusbCloseInterface(): interface index %d is too high\n", index);
         return -1;
     }
 
@@ -314,20 +367,39 @@ int winusbSetConfiguration(UsbusDevice *device, uint8_t config)
 
 int winusbSubmitTransfer(struct UsbusTransfer *t)
 {
-    struct WinUSBDevice *wd = &t->device->winusb;
-    struct WinOverlappedTransfer *wot;
-
-    wot = malloc(sizeof(*wot));
-    if (!wot) {
-        logwarn("winusbSubmitTransfer(): failed to allocate WinOverlappedTransfer");
+    WINUSB_INTERFACE_HANDLE h = transferHandle(t);
+    if (h == NULL) {
+        logdebug("winusbSubmitTransfer(): interface for endpoint 0x%x not open", t->endpoint);
         return -1;
     }
+
+    struct WinOverlappedTransfer *wot = &transferPriv(t)->platform.winusb;
+
     memset(&wot->ov, 0, sizeof(wot->ov));
     wot->t = t;
 
-    if (usbusTransferIsIN(t)) {
+    if (usbusTransferIsControl(t)) {
+
+        // the setup packet leads the buffer, see struct UsbusTransfer
+        const uint8_t *b = t->buffer;
+        WINUSB_SETUP_PACKET setup;
+        setup.RequestType = b[0];
+        setup.Request = b[1];
+        setup.Value = usbusLE16(b + 2);
+        setup.Index = usbusLE16(b + 4);
+        setup.Length = (USHORT)(t->requestedLength - USBUS_CONTROL_SETUP_SIZE);
 
-        if (!WinUsb_ReadPipe(wd->winusbHandles[0], t->endpoint, t->buffer, t->requestedLength, 0, &wot->ov)) {
+        if (!WinUsb_ControlTransfer(h, setup, t->buffer + USBUS_CONTROL_SETUP_SIZE, setup.Length, 0, &wot->ov)) {
+
+            if (ERROR_IO_PENDING != GetLastError()) {
+                logdebug("winusbSubmitTransfer() WinUsb_ControlTransfer: %s", win32ErrorString(GetLastError()));
+                return -1;
+            }
+        }
+
+    } else if (usbusTransferIsIN(t)) {
+
+        if (!WinUsb_ReadPipe(h, t->endpoint, t->buffer, t->requestedLength, 0, &wot->ov)) {
 
             if (ERROR_IO_PENDING != GetLastError()) {
                 logdebug("winusbSubmitTransfer() WinUsb_ReadPipe: %s", win32ErrorString(GetLastError()));
@@ -337,7 +409,7 @@ int winusbSubmitTransfer(struct UsbusTransfer *t)
 
     } else {
 
-        if (!WinUsb_WritePipe(wd->winusbHandles[0], t->endpoint, t->buffer, t->requestedLength, 0, &wot->ov)) {
+        if (!WinUsb_WritePipe(h, t->endpoint, t->buffer, t->requestedLength, 0, &wot->ov)) {
 
             if (ERROR_IO_PENDING != GetLastError()) {
                 logdebug("winusbSubmitTransfer() WinUsb_WritePipe: %s", win32ErrorString(GetLastError()));
@@ -352,9 +424,24 @@ int winusbSubmitTransfer(struct UsbusTransfer *t)
 
 int winusbCancelTransfer(struct UsbusTransfer *t)
 {
-    struct WinUSBDevice *wd = &t->device->winusb;
+    WINUSB_INTERFACE_HANDLE h = transferHandle(t);
+    if (h == NULL) {
+        logdebug("winusbCancelTransfer(): interface for endpoint 0x%x not open", t->endpoint);
+        return -1;
+    }
+
+    if (usbusTransferIsControl(t)) {
+        // the default pipe can't be aborted, cancel just this request instead
+        struct WinOverlappedTransfer *wot = &transferPriv(t)->platform.winusb;
+        if (!CancelIoEx(t->device->winusb.deviceHandle, &wot->ov)) {
+            logdebug("winusbCancelTransfer() CancelIoEx: %s", win32ErrorString(GetLastError()));
+            return -1;
+        }
+        return UsbusOK;
+    }
 
-    if (!WinUsb_AbortPipe(wd->winusbHandles[0], t->endpoint)) {
+    // aborts every transfer on the pipe - dispatchTransferCompletion() resubmits the others
+    if (!WinUsb_AbortPipe(h, t->endpoint)) {
         logdebug("winusbCancelTransfer() WinUsb_AbortPipe: %s", win32ErrorString(GetLastError()));
         return -1;
     }
@@ -365,45 +452,82 @@ int winusbCancelTransfer(struct UsbusTransfer *t)
 
 int winusbProcessEvents(UsbusContext *ctx, unsigned timeoutMillis)
 {
-    struct WinUSBContext *wc = &ctx->winusb;
-
-    OVERLAPPED* ov;
-    DWORD transferred;
-    ULONG_PTR completionKey;
+    /*
+     * Dequeue a batch of completions, from any number of devices, in a
+     * single call. The port only ever holds finished I/O, so the cost
+     * follows transfers completing rather than devices open.
+     */
 
-    enum UsbusStatus status = UsbusOK;
+    struct WinUSBContext *wc = &ctx->winusb;
 
-    if (!GetQueuedCompletionStatus(wc->completionPort, &transferred, &completionKey, &ov, timeoutMillis)) {
+    OVERLAPPED_ENTRY entries[WINUSB_MAX_EVENTS];
+    ULONG n;
 
+    if (!GetQueuedCompletionStatusEx(wc->completionPort, entries, WINUSB_MAX_EVENTS, &n, timeoutMillis, FALSE)) {
         if (WAIT_TIMEOUT == GetLastError()) {
             return UsbusOK;
         }
+        logwarn("winusbProcessEvents() GetQueuedCompletionStatusEx: %s", win32ErrorString(GetLastError()));
+        return -1;
+    }
+
+    ULONG i;
+    for (i = 0; i < n; ++i) {
+
+        // posted by winusbWakeup()
+        if (entries[i].lpOverlapped == NULL) {
+            continue;
+        }
+
+        struct WinOverlappedTransfer* wot = (struct WinOverlappedTransfer*)entries[i].lpOverlapped;
+        struct UsbusTransfer *t = wot->t;
 
         /*
-         * If GetQueuedCompletionStatus returned false but ov is still valid, then we can still dispatch
-         * an event for the failed transfer.
+         * Unlike GetQueuedCompletionStatus(), failures aren't reported per entry,
+         * so check the NTSTATUS the OVERLAPPED was completed with.
          */
 
-        if (ov == NULL) {
-            logwarn("winusbProcessEvents() GetQueuedCompletionStatus: %s", win32ErrorString(GetLastError()));
-            return -1;
+        enum UsbusStatus status = UsbusComplete;
+        LONG ntStatus = (LONG)wot->ov.Internal;
+        if (ntStatus == WIN_STATUS_CANCELLED) {
+            status = UsbusCanceled;
+        } else if (ntStatus < 0) {
+            // XXX: determine a more specific error type if possible
+            status = UsbusIoErr;
         }
 
-        // XXX: determine a more specific error type if possible
-        status = UsbusIoErr;
+        t->transferredlength = entries[i].dwNumberOfBytesTransferred;
+        dispatchTransferCompletion(t, status);
     }
 
-    struct WinOverlappedTransfer* wot = (struct WinOverlappedTransfer*)ov;
-    struct UsbusTransfer *t = wot->t;
-    t->transferredlength = transferred;
-    if (t->callback) {
-        t->callback(t, status);
+    // XXX: figure out how to integrate both IO event processing and device notification event processing...
+
+    return UsbusOK;
+}
+
+
+void winusbWakeup(UsbusContext *ctx)
+{
+    if (!PostQueuedCompletionStatus(ctx->winusb.completionPort, 0, 0, NULL)) {
+        logdebug("winusbWakeup() PostQueuedCompletionStatus: %s", win32ErrorString(GetLastError()));
     }
+}
 
-    free(wot);
 
-    // XXX: figure out how to integrate both IO event processing and device notification event processing...
+int winusbOpenEndpoint(UsbusDevice *d, struct UsbusEndpoint *e)
+{
+    /*
+     * Endpoints are looked up by interface number, but handles are kept
+     * in descriptor order, so route by the interface's position instead.
+     */
 
+    unsigned position;
+    if (interfacePosition(d, e->interfaceIndex, &position) != UsbusOK || !intfHandle(&d->winusb, position)) {
+        logdebug("winusbOpenEndpoint(): interface %d is not open", e->interfaceIndex);
+        return -1;
+    }
+
+    e->interfaceIndex = (uint8_t)position;
     return UsbusOK;
 }
 
@@ -483,7 +607,7 @@ static WINUSB_INTERFACE_HANDLE intfHandle(struct WinUSBDevice *wd, unsigned inde
      * Bounds checker for access to winusbHandles[]
      */
 
-    if (index >= ARRAYSIZE(wd->winusbHandles)) {
+    if (index >= wd->numHandles) {
         return NULL;
     }
 
@@ -491,6 +615,78 @@ static WINUSB_INTERFACE_HANDLE intfHandle(struct WinUSBDevice *wd, unsigned inde
 }
 
 
+static WINUSB_INTERFACE_HANDLE transferHandle(struct UsbusTransfer *t)
+{
+    /*
+     * Transfers bound to an endpoint handle go to that endpoint's interface,
+     * others to the default interface.
+     */
+
+    struct WinUSBDevice *wd = &t->device->winusb;
+
+    return intfHandle(wd, t->endpointHandle ? t->endpointHandle->interfaceIndex : 0);
+}
+
+
+static int sizeHandles(UsbusDevice *d)
+{
+    /*
+     * Size the interface handles from the active configuration's
+     * descriptor, once the first interface has been initialized.
+     *
+     * WinUSB has no call for the active configuration, so ask the device,
+     * falling back to the first - which is what WinUSB selects by default.
+     */
+
+    struct WinUSBDevice *wd = &d->winusb;
+    ULONG sz;
+
+    UCHAR config = 0;
+    WINUSB_SETUP_PACKET getConfig = { 0x80, 0x08, 0, 0, sizeof config };
+    if (!WinUsb_ControlTransfer(wd->winusbHandles[0], getConfig, &config, sizeof config, &sz, NULL) || sz != sizeof config) {
+        logdebug("sizeHandles() GET_CONFIGURATION: %s", win32ErrorString(GetLastError()));
+        config = 0;
+    }
+
+    USB_CONFIGURATION_DESCRIPTOR cfg;
+    unsigned numConfigs = d->descriptor.bNumConfigurations ? d->descriptor.bNumConfigurations : 1;
+    unsigned i;
+    for (i = 0; i < numConfigs; ++i) {
+        USB_CONFIGURATION_DESCRIPTOR c;
+        if (!WinUsb_GetDescriptor(wd->winusbHandles[0], USB_CONFIGURATION_DESCRIPTOR_TYPE,
+                                  (UCHAR)i, 0, (PUCHAR)&c, sizeof c, &sz) || sz < sizeof c)
+        {
+            logerror("sizeHandles() WinUsb_GetDescriptor: %s", win32ErrorString(GetLastError()));
+            return -1;
+        }
+
+        if (i == 0 || c.bConfigurationValue == config) {
+            cfg = c;
+        }
+        if (c.bConfigurationValue == config) {
+            break;
+        }
+    }
+
+    unsigned n = cfg.bNumInterfaces ? cfg.bNumInterfaces : 1;
+    if (n <= WINUSB_INLINE_INTERFACES) {
+        wd->numHandles = n;
+        return UsbusOK;
+    }
+
+    WINUSB_INTERFACE_HANDLE *handles = calloc(n, sizeof *handles);
+    if (!handles) {
+        logerror("sizeHandles(): failed to allocate %d interface handles", n);
+        return -1;
+    }
+
+    handles[0] = wd->winusbHandles[0];
+    wd->winusbHandles = handles;
+    wd->numHandles = n;
+    return UsbusOK;
+}
+
+
 static void enumerateConnectedDevices(UsbusContext *ctx, const GUID *guid)
 {
     /*
@@ -512,10 +708,20 @@ static void enumerateConnectedDevices(UsbusContext *ctx, const GUID *guid)
 
     for (i = 0; SetupDiEnumDeviceInfo(devInfo, i, &devInfoData); i++) {
 
+        if (!instanceMatch(ctx, devInfo, &devInfoData)) {
+            continue;
+        }
+
         UsbusDevice *d = allocateDevice();
         if (d) {
-            if (populateDeviceDetails(d, devInfo, &devInfoData, guid) == UsbusOK) {
+            d->ctx = ctx;
+            // class and bus aren't part of the instance ID, so are checked against the real descriptor
+            if (populateDeviceDetails(d, devInfo, &devInfoData, guid) == UsbusOK &&
+                matchDevice(ctx, &d->descriptor, d->busNumber))
+            {
                 dispatchConnectedDevice(ctx, d);
+            } else {
+                usbusDispose(d);
             }
         }
     }
@@ -523,6 +729,41 @@ static void enumerateConnectedDevices(UsbusContext *ctx, const GUID *guid)
     SetupDiDestroyDeviceInfoList(devInfo);
 }
 
+static int instanceMatch(UsbusContext *ctx, HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData)
+{
+    /*
+     * Pre-filter devices on their instance ID, which takes the form
+     * USB\VID_xxxx&PID_xxxx\<serial>, so that devices we won't report
+     * needn't be opened to read their descriptor.
+     * Windows generates the last component, containing '&', for devices
+     * without a serial number.
+     */
+
+    char id[MAX_DEVICE_ID_LEN];
+    if (!SetupDiGetDeviceInstanceId(devInfo, devInfoData, id, sizeof id, NULL)) {
+        logdebug("SetupDiGetDeviceInstanceId: %s", win32ErrorString(GetLastError()));
+        return 1;   // let populateDeviceDetails() decide
+    }
+
+    unsigned vid, pid;
+    if (sscanf(id, "USB\\VID_%4x&PID_%4x", &vid, &pid) == 2 && !matchIds(ctx, vid, pid)) {
+        return 0;
+    }
+
+    if (matchNeedsSerial(ctx)) {
+        const char *serial = strrchr(id, '\\');
+        if (serial) {
+            serial++;
+        }
+        if (!serial || strchr(serial, '&')) {
+            serial = 0;
+        }
+        return matchSerial(ctx, serial);
+    }
+
+    return 1;
+}
+
 static int populateDeviceDetails(UsbusDevice *d, HDEVINFO devInfo, PSP_DEVINFO_DATA devInfoData, const GUID *guid)
 {
     /*
@@ -627,7 +868,15 @@ static int getDevicePath(UsbusDevice *d, HDEVINFO devInfo, PSP_DEVINFO_DATA devI
         return -1;
     }
 
-    strncpy(d->winusb.path, interfaceDetailData->DevicePath, strlen(interfaceDetailData->DevicePath));
+    size_t pathSize = (lstrlen(interfaceDetailData->DevicePath) + 1) * sizeof(TCHAR);
+    free(d->winusb.path);
+    d->winusb.path = malloc(pathSize);
+    if (!d->winusb.path) {
+        logerror("getDevicePath(): failed to malloc path");
+        LocalFree(interfaceDetailData);
+        return -1;
+    }
+    memcpy(d->winusb.path, interfaceDetailData->DevicePath, pathSize);
     LocalFree(interfaceDetailData);
 
     return UsbusOK;
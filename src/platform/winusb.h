@@ -19,16 +19,22 @@ struct WinUSBContext {
 };
 
 // winusb-specific potion of UsbusDevice
+// interface handles are sized from the configuration descriptor when the device is opened.
+// most devices have only a couple of interfaces, which fit inline without a separate allocation.
+#define WINUSB_INLINE_INTERFACES    2
+
 struct WinUSBDevice {
-    TCHAR path[MAX_PATH];
+    TCHAR *path;                                // device interface path, freed by winusbDispose()
     HANDLE deviceHandle;
     // we maintain an array of interface handles such that we can respond to descriptor requests for any interface,
     // but we currently only allow reading/writing to a single "open" interface at a time.
     // WinUSB always opens the first interface by default in WinUSB_Initialize().
-    WINUSB_INTERFACE_HANDLE winusbHandles[USBUS_MAX_INTERFACES];
+    WINUSB_INTERFACE_HANDLE *winusbHandles;     // one per interface in the configuration
+    unsigned numHandles;
+    WINUSB_INTERFACE_HANDLE inlineHandles[WINUSB_INLINE_INTERFACES];
 };
 
-// struct to track transfers through IOCP.
+// struct to track transfers through IOCP, stored inline in each pooled transfer.
 // OVERLAPPED must be first member in struct so we can cast the LPOVERLAPPED
 // pointer to our full struct.
 struct WinOverlappedTransfer {
@@ -46,7 +52,10 @@ int winusbGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang,
 
 int winusbOpen(UsbusDevice *d);
 void winusbClose(UsbusDevice *d);
+void winusbDispose(UsbusDevice *d);
 
+int winusbGetDescriptor(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                        uint8_t *buf, unsigned len, unsigned *transferred);
 int winusbGetConfigDescriptor(UsbusDevice *d, unsigned index, struct UsbusConfigDescriptor *desc);
 int winusbGetInterfaceDescriptor(UsbusDevice *d, unsigned index, unsigned altsetting, struct UsbusInterfaceDescriptor *desc);
 int winusbGetEndpointDescriptor(UsbusDevice *d, unsigned intfIndex, unsigned ep, struct UsbusEndpointDescriptor *desc);
@@ -60,6 +69,8 @@ int winusbSetConfiguration(UsbusDevice *device, uint8_t config);
 int winusbSubmitTransfer(struct UsbusTransfer *t);
 int winusbCancelTransfer(struct UsbusTransfer *t);
 int winusbProcessEvents(UsbusContext *ctx, unsigned timeoutMillis);
+void winusbWakeup(UsbusContext *ctx);
+int winusbOpenEndpoint(UsbusDevice *d, struct UsbusEndpoint *e);
 
 int winusbReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
 int winusbWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written);
@@ -0,0 +1,141 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "usbus_limits.h"
+#include "atomics.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Lock-free pool of UsbusTransferPriv.
+ *
+ * Entries are allocated a slab at a time and never returned to the heap.
+ * Free entries form a stack linked by index, and the head carries a tag
+ * that's bumped on every update to guard against ABA, so any thread may
+ * allocate or release.
+ */
+
+#define INDEX_MASK  0xffffffffULL
+
+static int growPool(struct UsbusTransferPool *pool);
+
+static inline struct UsbusTransferPriv *poolEntry(struct UsbusTransferPool *pool, uint32_t index) {
+    return &pool->slabs[index / USBUS_TRANSFER_SLAB_SIZE][index % USBUS_TRANSFER_SLAB_SIZE];
+}
+
+static inline uint64_t nextHead(uint64_t head, uint32_t link) {
+    return (((head >> 32) + 1) << 32) | link;
+}
+
+struct UsbusTransferPriv *transferPoolAlloc(struct UsbusTransferPool *pool)
+{
+    uint64_t head = atomicLoad64(&pool->freeList);
+
+    for (;;) {
+        uint32_t link = head & INDEX_MASK;
+        if (link == 0) {
+            if (growPool(pool) != UsbusOK) {
+                return 0;
+            }
+            head = atomicLoad64(&pool->freeList);
+            continue;
+        }
+
+        /*
+         * If another thread pops this entry first, the value of nextFree
+         * we read may be stale, but the tag ensures our CAS then fails.
+         */
+        struct UsbusTransferPriv *tp = poolEntry(pool, link - 1);
+        uint32_t next = atomicLoad32(&tp->nextFree);
+
+        if (atomicCompareExchange64(&pool->freeList, &head, nextHead(head, next))) {
+            return tp;
+        }
+    }
+}
+
+void transferPoolFree(struct UsbusTransferPool *pool, struct UsbusTransferPriv *tp)
+{
+    uint64_t head = atomicLoad64(&pool->freeList);
+    do {
+        atomicStore32(&tp->nextFree, head & INDEX_MASK);
+    } while (!atomicCompareExchange64(&pool->freeList, &head, nextHead(head, tp->index + 1)));
+}
+
+int transferPoolOwns(struct UsbusTransferPool *pool, const struct UsbusTransfer *t)
+{
+    /*
+     * Whether `t` is the public part of one of the pool's entries, judged by
+     * address alone - the private area in front of anything else can't be
+     * read safely. There are rarely more than a few slabs to check.
+     */
+
+    uint32_t n = atomicLoad32(&pool->numSlabs);
+    uint32_t i;
+    for (i = 0; i < n; ++i) {
+        const struct UsbusTransferPriv *slab = pool->slabs[i];
+        const char *base = (const char*)&slab[0].transfer;
+        const char *p = (const char*)t;
+        if (p >= base && p < base + USBUS_TRANSFER_SLAB_SIZE * sizeof *slab) {
+            return (p - base) % sizeof *slab == 0;
+        }
+    }
+
+    return 0;
+}
+
+static int growPool(struct UsbusTransferPool *pool)
+{
+    /*
+     * Add a slab of entries to the free list.
+     * Growth is rare, so a spin lock is fine to serialize it.
+     */
+
+    while (atomicExchange32(&pool->growLock, 1)) {
+        cpuRelax();
+    }
+
+    int r = UsbusOK;
+
+    // someone else may have grown the pool while we waited
+    if ((atomicLoad64(&pool->freeList) & INDEX_MASK) != 0) {
+        goto done;
+    }
+
+    uint32_t n = pool->numSlabs;
+    if (n == USBUS_MAX_TRANSFER_SLABS) {
+        logerror("transfer pool exhausted (%d transfers)", n * USBUS_TRANSFER_SLAB_SIZE);
+        r = -1;
+        goto done;
+    }
+
+    struct UsbusTransferPriv *slab = calloc(USBUS_TRANSFER_SLAB_SIZE, sizeof *slab);
+    if (!slab) {
+        logerror("failed to allocate transfer slab");
+        r = -1;
+        goto done;
+    }
+
+    uint32_t base = n * USBUS_TRANSFER_SLAB_SIZE;
+    unsigned i;
+    for (i = 0; i < USBUS_TRANSFER_SLAB_SIZE; ++i) {
+        slab[i].pool = pool;
+        slab[i].index = base + i;
+        slab[i].nextFree = base + i + 2;
+    }
+
+    pool->slabs[n] = slab;
+    atomicStore32(&pool->numSlabs, n + 1);
+
+    // splice the whole slab onto the free list
+    struct UsbusTransferPriv *last = &slab[USBUS_TRANSFER_SLAB_SIZE - 1];
+    uint64_t head = atomicLoad64(&pool->freeList);
+    do {
+        atomicStore32(&last->nextFree, head & INDEX_MASK);
+    } while (!atomicCompareExchange64(&pool->freeList, &head, nextHead(head, base + 1)));
+
+done:
+    atomicStore32(&pool->growLock, 0);
+    return r;
+}
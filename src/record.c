@@ -0,0 +1,462 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "record.h"
+#include "atomics.h"
+#include "clock.h"
+#include "logger.h"
+#include "filering.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Traffic recording, for replay via usbusEmuAddReplay().
+ *
+ * Each completed transfer is written with its submit and completion times
+ * and its payload, preceded the first time a device appears by everything
+ * needed to impersonate it: its descriptors, and whichever strings have
+ * been read. Records go through a FileRing like captures do, so recording
+ * never waits on the disk - but a record that doesn't fit is lost, so the
+ * ring is sized generously. Lost records are marked by a RecordGap, where
+ * replay stops, since what follows no longer lines up.
+ */
+
+#if (USBUS_RECORD_RING_SIZE & (USBUS_RECORD_RING_SIZE - 1)) != 0
+#error USBUS_RECORD_RING_SIZE must be a power of 2
+#endif
+
+struct Recorder {
+    struct FileRing out;
+    uint64_t start;                     // monotonicNanos() when recording started
+    uint32_t session;                   // tags the devices described in this log
+    uint16_t numDevices;
+    uint32_t maxData;                   // largest payload that's guaranteed to fit in the ring
+    uint32_t dropped;                   // transfers lost since the last RecordGap
+};
+
+static volatile uint32_t gSessions;
+
+static int describeDevice(struct Recorder *rec, UsbusDevice *d);
+static int writeGap(struct Recorder *rec);
+static inline uint32_t recordPadding(uint32_t len) {
+    return (RECORD_ALIGN - (len & (RECORD_ALIGN - 1))) & (RECORD_ALIGN - 1);
+}
+
+
+/**************
+ * API
+ **************/
+
+int usbusStartRecording(UsbusContext *ctx, const char *path)
+{
+    /*
+     * Record every transfer on `ctx` that's submitted from now on, with
+     * its payload and timing, to a log at `path` for replay.
+     *
+     * Call from the thread processing events.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+
+    if (c->recorder) {
+        return UsbusBadParameter;
+    }
+
+    struct Recorder *rec = calloc(1, sizeof *rec);
+    if (!rec) {
+        logerror("usbusStartRecording(): failed to malloc recorder");
+        return -1;
+    }
+
+    struct RecordFileHeader fh;
+    memset(&fh, 0, sizeof fh);
+    memcpy(fh.magic, "USBUSREC", sizeof fh.magic);
+    fh.version = RECORD_VERSION;
+    fh.byteOrder = RECORD_BYTE_ORDER;
+    fh.startRealtime = realtimeNanos();
+
+    if (fileRingOpen(&rec->out, path, USBUS_RECORD_RING_SIZE, &fh, sizeof fh) != 0) {
+        logerror("usbusStartRecording(): failed to start recording");
+        free(rec);
+        return -1;
+    }
+
+    rec->start = monotonicNanos();
+    rec->session = atomicFetchAdd32(&gSessions, 1) + 1;
+    rec->maxData = USBUS_RECORD_RING_SIZE / 4;
+
+    c->recorder = rec;
+    return UsbusOK;
+}
+
+void usbusStopRecording(UsbusContext *ctx)
+{
+    /*
+     * Flush everything recorded so far and close the log. Transfers still
+     * in flight aren't included.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    struct Recorder *rec = c->recorder;
+
+    if (!rec) {
+        return;
+    }
+    c->recorder = 0;
+
+    // the writer is still running, so there'll be room for the last gap soon enough
+    if (rec->dropped) {
+        fileRingWait(&rec->out, sizeof(struct RecordHeader));
+        writeGap(rec);
+    }
+    if (fileRingClose(&rec->out) != 0) {
+        logerror("usbusStopRecording(): failed to write recording");
+    }
+    if (rec->out.dropped) {
+        logwarn("usbusStopRecording(): recording ring full, dropped %u records", rec->out.dropped);
+    }
+
+    free(rec);
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+void recorderWrite(struct UsbusTransfer *t, enum UsbusStatus status)
+{
+    /*
+     * Called via recordCompleted(). OUT transfers carry what was sent, IN
+     * transfers what was received. Control transfers carry their setup
+     * packet, followed by the data in whichever direction it declares.
+     */
+
+    struct Recorder *rec = t->device->ctx->recorder;
+    struct UsbusTransferPriv *tp = transferPriv(t);
+    uint64_t submitted = tp->recordedAt;
+    tp->recordedAt = 0;
+
+    // submitted during an earlier recording
+    if (submitted < rec->start) {
+        return;
+    }
+
+    // replay can't carry on past lost transfers, so mark where they were before anything else
+    if (rec->dropped && writeGap(rec) != UsbusOK) {
+        rec->dropped++;
+        return;
+    }
+
+    if ((t->device->recordTag >> 16) != (rec->session & 0xffff)) {
+        if (describeDevice(rec, t->device) != UsbusOK) {
+            return;
+        }
+    }
+
+    uint32_t dataLength;
+    if (usbusTransferIsControl(t)) {
+        // the setup packet, then whichever data stage the device saw or returned
+        dataLength = usbusTransferIsIN(t) ? USBUS_CONTROL_SETUP_SIZE + t->transferredlength : t->requestedLength;
+    } else {
+        dataLength = usbusTransferIsIN(t) ? t->transferredlength : t->requestedLength;
+    }
+    if (dataLength > (uint32_t)t->requestedLength) {
+        dataLength = t->requestedLength;
+    }
+    if (dataLength > rec->maxData) {
+        dataLength = rec->maxData;
+    }
+
+    struct RecordHeader h;
+    memset(&h, 0, sizeof h);
+    h.kind = RecordTransfer;
+    h.endpoint = t->endpoint;
+    h.device = (t->device->recordTag & 0xffff) - 1;
+    h.submitted = submitted - rec->start;
+    h.completed = monotonicNanos() - rec->start;
+    h.status = status;
+    h.requestedLength = t->requestedLength;
+    h.transferredLength = t->transferredlength;
+    h.dataLength = dataLength;
+    h.type = (uint8_t)t->type;
+    h.length = sizeof h + dataLength + recordPadding(dataLength);
+
+    if (!fileRingReserve(&rec->out, h.length)) {
+        rec->dropped++;
+        return;
+    }
+
+    static const uint8_t zeros[RECORD_ALIGN];
+    fileRingPut(&rec->out, 0, &h, sizeof h);
+    fileRingPut(&rec->out, sizeof h, t->buffer, dataLength);
+    fileRingPut(&rec->out, sizeof h + dataLength, zeros, recordPadding(dataLength));
+    fileRingCommit(&rec->out, h.length);
+}
+
+static int describeDevice(struct Recorder *rec, UsbusDevice *d)
+{
+    /*
+     * Write a RecordDevice for `d`, and tag it as described. Strings are
+     * only those already in the device's cache, so no I/O happens here.
+     */
+
+    if (!d->descriptors || rec->numDevices == 0xffff) {
+        return -1;
+    }
+
+    struct RecordDeviceInfo info;
+    memset(&info, 0, sizeof info);
+
+    const struct DescriptorTree *tree = d->descriptors;
+    unsigned i;
+    for (i = 0; i < tree->numConfigs; ++i) {
+        info.configLen += tree->configs[i].rawLen;
+    }
+
+    const struct UsbusDeviceDescriptor *dd = &d->descriptor;
+    uint8_t *p = info.descriptor;
+    *p++ = 18;
+    *p++ = UsbusDescriptorDevice;
+    *p++ = dd->bcdUSB & 0xff;
+    *p++ = dd->bcdUSB >> 8;
+    *p++ = dd->bDeviceClass;
+    *p++ = dd->bDeviceSubClass;
+    *p++ = dd->bDeviceProtocol;
+    *p++ = dd->bMaxPacketSize0;
+    *p++ = dd->idVendor & 0xff;
+    *p++ = dd->idVendor >> 8;
+    *p++ = dd->idProduct & 0xff;
+    *p++ = dd->idProduct >> 8;
+    *p++ = dd->bcdDevice & 0xff;
+    *p++ = dd->bcdDevice >> 8;
+    *p++ = dd->iManufacturer;
+    *p++ = dd->iProduct;
+    *p++ = dd->iSerialNumber;
+    *p++ = dd->bNumConfigurations;
+
+    info.speed = (uint8_t)d->speed;
+    info.busNumber = d->busNumber;
+    info.address = d->address;
+
+    uint32_t stringsLen = 0;
+    for (i = 0; i < d->strings.numEntries && info.numStrings < 255; ++i) {
+        if (d->strings.entries[i].index != 0) {
+            stringsLen += 1 + d->strings.entries[i].desc[0];
+            info.numStrings++;
+        }
+    }
+
+    struct RecordHeader h;
+    memset(&h, 0, sizeof h);
+    h.kind = RecordDevice;
+    h.device = rec->numDevices;
+    h.dataLength = sizeof info + info.configLen + stringsLen;
+    h.length = sizeof h + h.dataLength + recordPadding(h.dataLength);
+
+    if (h.dataLength > rec->maxData) {
+        return -1;
+    }
+    if (!fileRingReserve(&rec->out, h.length)) {
+        // along with the transfer that needed it
+        rec->dropped++;
+        return -1;
+    }
+
+    uint32_t off = 0;
+    fileRingPut(&rec->out, off, &h, sizeof h);
+    off += sizeof h;
+    fileRingPut(&rec->out, off, &info, sizeof info);
+    off += sizeof info;
+
+    for (i = 0; i < tree->numConfigs; ++i) {
+        fileRingPut(&rec->out, off, tree->configs[i].raw, tree->configs[i].rawLen);
+        off += tree->configs[i].rawLen;
+    }
+
+    unsigned n = 0;
+    for (i = 0; i < d->strings.numEntries && n < info.numStrings; ++i) {
+        const struct StringCacheEntry *s = &d->strings.entries[i];
+        if (s->index != 0) {
+            fileRingPut(&rec->out, off, &s->index, 1);
+            fileRingPut(&rec->out, off + 1, s->desc, s->desc[0]);
+            off += 1 + s->desc[0];
+            n++;
+        }
+    }
+
+    static const uint8_t zeros[RECORD_ALIGN];
+    fileRingPut(&rec->out, off, zeros, recordPadding(h.dataLength));
+    fileRingCommit(&rec->out, h.length);
+
+    d->recordTag = ((rec->session & 0xffff) << 16) | (uint32_t)(rec->numDevices + 1);
+    rec->numDevices++;
+    return UsbusOK;
+}
+
+static int writeGap(struct Recorder *rec)
+{
+    /*
+     * Mark the transfers lost since the last gap, once there's room again.
+     */
+
+    struct RecordHeader h;
+    memset(&h, 0, sizeof h);
+    h.kind = RecordGap;
+    h.completed = monotonicNanos() - rec->start;
+    h.transferredLength = rec->dropped;
+    h.length = sizeof h;
+
+    if (!fileRingReserve(&rec->out, h.length)) {
+        return -1;
+    }
+
+    fileRingPut(&rec->out, 0, &h, sizeof h);
+    fileRingCommit(&rec->out, h.length);
+    rec->dropped = 0;
+    return UsbusOK;
+}
+
+int replayOpen(struct ReplayLog *log, const char *path)
+{
+    /*
+     * Map the log at `path`, and check its records hang together. A log
+     * whose recording was cut short is truncated after its last complete
+     * record, and one that lost transfers is truncated where it did.
+     */
+
+    memset(log, 0, sizeof *log);
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) {
+        logerror("replayOpen(): failed to open %s", path);
+        return -1;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = 0;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)sizeof(struct RecordFileHeader)) {
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    }
+    CloseHandle(file);
+    if (!mapping) {
+        logerror("replayOpen(): failed to map %s", path);
+        return -1;
+    }
+    log->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!log->data) {
+        logerror("replayOpen(): failed to map %s", path);
+        CloseHandle(mapping);
+        return -1;
+    }
+    log->mapping = mapping;
+    log->length = log->mappingLength = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        logerror("replayOpen(): failed to open %s", path);
+        return -1;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct RecordFileHeader)) {
+        data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        logerror("replayOpen(): failed to map %s", path);
+        return -1;
+    }
+    log->data = data;
+    log->length = log->mappingLength = (size_t)st.st_size;
+    log->mapping = data;
+#endif
+
+    const struct RecordFileHeader *fh = (const struct RecordFileHeader*)log->data;
+    if (memcmp(fh->magic, "USBUSREC", sizeof fh->magic) != 0 || fh->version != RECORD_VERSION) {
+        logerror("replayOpen(): %s isn't a recording", path);
+        replayClose(log);
+        return UsbusBadParameter;
+    }
+    if (fh->byteOrder != RECORD_BYTE_ORDER) {
+        logerror("replayOpen(): %s was recorded on a host of different byte order", path);
+        replayClose(log);
+        return UsbusNotSupported;
+    }
+
+    size_t off = sizeof *fh;
+    unsigned numDevices = 0;
+
+    while (log->length - off >= sizeof(struct RecordHeader)) {
+        const struct RecordHeader *r = (const struct RecordHeader*)(log->data + off);
+
+        if (r->length % RECORD_ALIGN != 0 || r->length > log->length - off ||
+            r->length < sizeof *r || r->dataLength > r->length - sizeof *r) {
+            break;
+        }
+
+        if (r->kind == RecordDevice) {
+            const struct RecordDeviceInfo *info = (const struct RecordDeviceInfo*)recordPayload(r);
+            if (r->device != numDevices || r->dataLength < sizeof *info ||
+                info->configLen > r->dataLength - sizeof *info) {
+                break;
+            }
+
+            // each string is an index byte, then a descriptor no longer than its length byte says
+            const uint8_t *p = (const uint8_t*)(info + 1) + info->configLen;
+            const uint8_t *pend = recordPayload(r) + r->dataLength;
+            unsigned i;
+            for (i = 0; i < info->numStrings && p + 2 <= pend && p[1] >= 2 && p + 1 + p[1] <= pend; ++i) {
+                p += 1 + p[1];
+            }
+            if (i != info->numStrings) {
+                break;
+            }
+            numDevices++;
+
+        } else if (r->kind == RecordGap) {
+            logwarn("replayOpen(): %s lost %u transfers while recording, replaying only what came before",
+                    path, r->transferredLength);
+            log->length = off;
+            break;
+
+        } else if (r->kind != RecordTransfer || r->device >= numDevices) {
+            break;
+        }
+
+        off += r->length;
+    }
+
+    if (off != log->length) {
+        logwarn("replayOpen(): ignoring %u bytes of incomplete records at the end of %s",
+                (unsigned)(log->length - off), path);
+        log->length = off;
+    }
+
+    return UsbusOK;
+}
+
+void replayClose(struct ReplayLog *log)
+{
+    if (!log->mapping) {
+        return;
+    }
+
+#if defined(_WIN32)
+    UnmapViewOfFile(log->data);
+    CloseHandle(log->mapping);
+#else
+    munmap(log->mapping, log->mappingLength);
+#endif
+    log->mapping = 0;
+}
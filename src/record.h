@@ -0,0 +1,87 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Traffic log format, see usbusStartRecording().
+ *
+ * A RecordFileHeader, followed by records, each a RecordHeader and its
+ * payload, padded so the next starts on an 8 byte boundary. Fields are in
+ * the recording host's byte order, which `byteOrder` identifies. Nothing
+ * needs unpacking, so a log can be used in place once mapped.
+ */
+
+#define RECORD_VERSION      1
+#define RECORD_BYTE_ORDER   0x01020304
+#define RECORD_ALIGN        8
+
+struct RecordFileHeader {
+    char magic[8];                      // "USBUSREC"
+    uint32_t version;
+    uint32_t byteOrder;                 // RECORD_BYTE_ORDER, as the recording host stores it
+    uint64_t startRealtime;             // realtimeNanos() when recording started
+};
+
+enum RecordKind {
+    RecordDevice = 1,                   // a device, before its first transfer - payload is a RecordDeviceInfo
+    RecordTransfer,                     // a completed transfer - payload is its data
+    RecordGap                           // transfers were lost here, the ring being full - `transferredLength` counts them
+};
+
+struct RecordHeader {
+    uint32_t length;                    // of the whole record, including padding
+    uint8_t kind;
+    uint8_t endpoint;
+    uint16_t device;                    // numbered in order of their RecordDevice records
+    uint64_t submitted;                 // nanos since recording started
+    uint64_t completed;
+    int32_t status;                     // UsbusStatus
+    uint32_t requestedLength;
+    uint32_t transferredLength;
+    uint32_t dataLength;                // payload bytes, possibly fewer than were transferred
+    uint8_t type;                       // UsbusTransferType
+    uint8_t reserved[7];
+};
+
+/*
+ * Followed by `configLen` bytes of configuration descriptors, then
+ * `numStrings` string descriptors, each preceded by its index.
+ */
+struct RecordDeviceInfo {
+    uint32_t configLen;
+    uint8_t descriptor[18];             // device descriptor, as sent on the wire
+    uint8_t speed;                      // UsbusSpeed
+    uint8_t busNumber;
+    uint8_t address;
+    uint8_t numStrings;
+    uint8_t reserved[6];
+};
+
+// a log opened for replay - every record in [data, data + length) has been validated
+struct ReplayLog {
+    const uint8_t *data;
+    size_t length;
+    void *mapping;
+    size_t mappingLength;
+};
+
+int replayOpen(struct ReplayLog *log, const char *path);
+void replayClose(struct ReplayLog *log);
+
+static inline const struct RecordHeader *replayFirst(const struct ReplayLog *log) {
+    size_t off = sizeof(struct RecordFileHeader);
+    return off < log->length ? (const struct RecordHeader*)(log->data + off) : 0;
+}
+
+static inline const struct RecordHeader *replayNext(const struct ReplayLog *log, const struct RecordHeader *r) {
+    const uint8_t *next = (const uint8_t*)r + r->length;
+    return next < log->data + log->length ? (const struct RecordHeader*)next : 0;
+}
+
+static inline const uint8_t *recordPayload(const struct RecordHeader *r) {
+    return (const uint8_t*)(r + 1);
+}
+
+#endif // _RECORD_H
@@ -0,0 +1,259 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "clock.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-endpoint counters. Submissions and completions are both recorded on
+ * the thread that owns the context (the event thread, in thread-safe mode),
+ * so plain non-atomic updates suffice. Stats for an endpoint are allocated
+ * the first time it's used, and kept for the life of the UsbusDevice.
+ */
+
+#if !defined(USBUS_DISABLE_STATS)
+static struct UsbusEndpointStats *statsFor(UsbusDevice *d, uint8_t ep);
+static unsigned latencyBucket(uint64_t micros);
+static unsigned highestBit(uint64_t v);
+#endif
+
+
+/**************
+ * API
+ **************/
+
+int usbusGetEndpointStats(UsbusDevice *d, uint8_t ep, struct UsbusEndpointStats *stats)
+{
+    /*
+     * Copy out the stats for `ep`. Endpoints that haven't been used yet
+     * report all zeroes.
+     */
+
+#if defined(USBUS_DISABLE_STATS)
+    (void)d;
+    (void)ep;
+    (void)stats;
+    return UsbusNotSupported;
+#else
+    const struct UsbusEndpointStats *s = d->stats ? d->stats[endpointSlot(ep)] : 0;
+    if (s) {
+        *stats = *s;
+    } else {
+        memset(stats, 0, sizeof *stats);
+    }
+    return UsbusOK;
+#endif
+}
+
+void usbusResetEndpointStats(UsbusDevice *d)
+{
+    /*
+     * Zero the stats for all endpoints, other than the current in-flight depth.
+     */
+
+    if (!d->stats) {
+        return;
+    }
+
+    unsigned i;
+    for (i = 0; i < USBUS_ENDPOINT_SLOTS; ++i) {
+        struct UsbusEndpointStats *s = d->stats[i];
+        if (s) {
+            uint32_t inFlight = s->inFlight;
+            memset(s, 0, sizeof *s);
+            s->inFlight = s->maxInFlight = inFlight;
+        }
+    }
+}
+
+uint64_t usbusLatencyBucketMicros(unsigned bucket)
+{
+    /*
+     * The lowest latency counted in `bucket`.
+     */
+
+    if (bucket < USBUS_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    unsigned exponent = bucket / USBUS_LATENCY_SUB_BUCKETS + 2;
+    unsigned sub = bucket % USBUS_LATENCY_SUB_BUCKETS;
+    return (uint64_t)(USBUS_LATENCY_SUB_BUCKETS + sub) << (exponent - 3);
+}
+
+uint64_t usbusLatencyPercentileMicros(const struct UsbusEndpointStats *stats, double percentile)
+{
+    /*
+     * Upper bound of the bucket holding the given percentile (0 - 100)
+     * of completed transfers, or 0 if there are none.
+     */
+
+    uint64_t total = 0;
+    unsigned i;
+    for (i = 0; i < USBUS_LATENCY_BUCKETS; ++i) {
+        total += stats->latency[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t count = 0;
+    for (i = 0; i < USBUS_LATENCY_BUCKETS - 1; ++i) {
+        count += stats->latency[i];
+        if (count >= target) {
+            break;
+        }
+    }
+
+    return i < USBUS_LATENCY_BUCKETS - 1 ? usbusLatencyBucketMicros(i + 1) - 1 : usbusLatencyBucketMicros(i);
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+#if !defined(USBUS_DISABLE_STATS)
+
+void statsSubmitted(struct UsbusTransfer *t)
+{
+    /*
+     * Called just before the transfer is handed to the platform,
+     * since it may complete before the platform returns.
+     */
+
+    struct UsbusEndpointStats *s = statsFor(t->device, t->endpoint);
+    if (!s) {
+        return;
+    }
+
+    s->transfersSubmitted++;
+    s->bytesSubmitted += t->requestedLength;
+    if (++s->inFlight > s->maxInFlight) {
+        s->maxInFlight = s->inFlight;
+    }
+    transferPriv(t)->submittedAt = monotonicNanos();
+}
+
+void statsSubmitFailed(struct UsbusTransfer *t)
+{
+    struct UsbusEndpointStats *s = statsFor(t->device, t->endpoint);
+    if (!s) {
+        return;
+    }
+
+    s->transfersSubmitted--;
+    s->bytesSubmitted -= t->requestedLength;
+    s->inFlight--;
+}
+
+void statsCompleted(struct UsbusTransfer *t, enum UsbusStatus status)
+{
+    struct UsbusEndpointStats *s = statsFor(t->device, t->endpoint);
+    if (!s) {
+        return;
+    }
+
+    s->transfersCompleted++;
+    s->bytesCompleted += t->transferredlength;
+    if ((unsigned)status <= UsbusStatusGenericError) {
+        s->completions[status]++;
+    }
+    if (s->inFlight) {
+        s->inFlight--;
+    }
+
+    uint64_t submittedAt = transferPriv(t)->submittedAt;
+    if (submittedAt) {
+        s->latency[latencyBucket((monotonicNanos() - submittedAt) / 1000)]++;
+        transferPriv(t)->submittedAt = 0;
+    }
+}
+
+#endif // USBUS_DISABLE_STATS
+
+void statsDeviceClosed(UsbusDevice *d)
+{
+    /*
+     * Transfers still pending when a device is closed are dropped without completing.
+     */
+
+    if (d->stats) {
+        unsigned i;
+        for (i = 0; i < USBUS_ENDPOINT_SLOTS; ++i) {
+            if (d->stats[i]) {
+                d->stats[i]->inFlight = 0;
+            }
+        }
+    }
+}
+
+void freeEndpointStats(UsbusDevice *d)
+{
+    if (d->stats) {
+        unsigned i;
+        for (i = 0; i < USBUS_ENDPOINT_SLOTS; ++i) {
+            free(d->stats[i]);
+        }
+        free(d->stats);
+        d->stats = 0;
+    }
+}
+
+#if !defined(USBUS_DISABLE_STATS)
+
+static struct UsbusEndpointStats *statsFor(UsbusDevice *d, uint8_t ep)
+{
+    if (!d->stats) {
+        d->stats = calloc(USBUS_ENDPOINT_SLOTS, sizeof *d->stats);
+        if (!d->stats) {
+            logerror("failed to allocate endpoint stats");
+            return 0;
+        }
+    }
+
+    unsigned slot = endpointSlot(ep);
+    if (!d->stats[slot]) {
+        d->stats[slot] = calloc(1, sizeof **d->stats);
+        if (!d->stats[slot]) {
+            logerror("failed to allocate endpoint stats");
+        }
+    }
+    return d->stats[slot];
+}
+
+static unsigned latencyBucket(uint64_t micros)
+{
+    if (micros < USBUS_LATENCY_SUB_BUCKETS) {
+        return (unsigned)micros;
+    }
+
+    // 8 sub-buckets per power of 2, from the 3 bits below the leading one
+    unsigned exponent = highestBit(micros);
+    unsigned bucket = (exponent - 2) * USBUS_LATENCY_SUB_BUCKETS +
+                      (unsigned)((micros >> (exponent - 3)) & (USBUS_LATENCY_SUB_BUCKETS - 1));
+
+    return bucket < USBUS_LATENCY_BUCKETS ? bucket : USBUS_LATENCY_BUCKETS - 1;
+}
+
+static unsigned highestBit(uint64_t v)
+{
+#if defined(__GNUC__)
+    return 63 - (unsigned)__builtin_clzll(v);
+#else
+    unsigned n = 0;
+    while (v >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+#endif // USBUS_DISABLE_STATS
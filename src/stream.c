@@ -0,0 +1,495 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "atomics.h"
+#include "clock.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Streams keep an endpoint permanently busy on the application's behalf.
+ *
+ * IN streams hold a fixed set of transfers in flight, copying each
+ * completion into a single-producer/single-consumer ring that the
+ * application reads from. The event thread is the only producer, and the
+ * reader may be any one thread. Transfers are resubmitted as soon as their
+ * data has been copied out, so the endpoint never goes idle waiting on the
+ * reader - if the ring is full, the data is dropped and counted as an overrun.
+ *
+ * OUT streams coalesce small writes into a pair of buffers sized to a
+ * multiple of the endpoint's wMaxPacketSize. While one buffer is in flight
+ * the other fills, and is sent once it's full, once the in-flight transfer
+ * completes, or once the flush deadline for its oldest byte passes -
+ * whichever comes first. OUT streams are serviced from usbusProcessEvents(),
+ * and may only be written from the thread processing events.
+ */
+
+#define OUT_STREAM_BUFFERS  2
+#define STREAM_MAX_SIZE     (1u << 30)      // for rings and transfers, whose lengths are ints
+
+struct UsbusStream {
+    UsbusDevice *device;
+    uint8_t endpoint;
+
+    struct UsbusTransfer **transfers;
+    unsigned numTransfers;
+    unsigned inFlight;
+    uint8_t stopping;
+    enum UsbusStatus lastError;
+
+    // ring - head is only written by the event thread, tail only by the reader
+    uint8_t *ring;
+    uint32_t ringSize;                  // power of 2
+    volatile uint32_t head;
+    volatile uint32_t tail;
+
+    volatile uint32_t overruns;         // completions dropped because the ring was full
+
+    // OUT streams - transfers[fillIndex] is filling, the other may be in flight
+    unsigned bufferSize;
+    unsigned fill;
+    unsigned fillIndex;
+    uint8_t busy[OUT_STREAM_BUFFERS];
+    uint64_t flushNanos;
+    uint64_t flushDeadline;             // for the oldest buffered byte
+    struct UsbusStream *prevOut;        // list of OUT streams on the context
+    struct UsbusStream *nextOut;
+};
+
+static void onStreamInComplete(struct UsbusTransfer *t, enum UsbusStatus status);
+static void onStreamOutComplete(struct UsbusTransfer *t, enum UsbusStatus status);
+static int allocateTransfers(struct UsbusStream *s, unsigned n, unsigned size, UsbusTransferCallback cb);
+static int submitFill(struct UsbusStream *s);
+static uint32_t roundUpPow2(uint32_t v);
+static void freeStream(struct UsbusStream *s);
+
+
+/**************
+ * API
+ **************/
+
+struct UsbusStream *usbusStreamIn(UsbusDevice *d, uint8_t ep, unsigned numTransfers,
+                                  unsigned transferSize, unsigned ringSize)
+{
+    /*
+     * Start streaming from IN endpoint `ep`, with `numTransfers` transfers
+     * of `transferSize` bytes each in flight at all times.
+     *
+     * `ringSize` is rounded up to a power of 2, and should comfortably exceed
+     * numTransfers * transferSize so that a slow reader doesn't cause overruns.
+     */
+
+    if (!d->isOpen || !(ep & 0x80) || numTransfers == 0 || transferSize == 0) {
+        return 0;
+    }
+    if (transferSize > STREAM_MAX_SIZE || ringSize > STREAM_MAX_SIZE) {
+        logerror("usbusStreamIn(): transfer or ring size beyond %u", STREAM_MAX_SIZE);
+        return 0;
+    }
+
+    struct UsbusStream *s = calloc(1, sizeof *s);
+    if (!s) {
+        logerror("failed to allocate stream");
+        return 0;
+    }
+
+    s->device = d;
+    s->endpoint = ep;
+    s->lastError = UsbusComplete;
+    s->ringSize = roundUpPow2(ringSize > transferSize ? ringSize : transferSize);
+    s->ring = malloc(s->ringSize);
+    if (!s->ring) {
+        logerror("failed to allocate stream");
+        freeStream(s);
+        return 0;
+    }
+
+    if (allocateTransfers(s, numTransfers, transferSize, onStreamInComplete) != UsbusOK) {
+        freeStream(s);
+        return 0;
+    }
+
+    unsigned i;
+    for (i = 0; i < s->numTransfers; ++i) {
+        if (usbusSubmitTransfer(s->transfers[i]) != UsbusOK) {
+            logwarn("usbusStreamIn(): failed to submit transfer %u", i);
+            break;
+        }
+        s->inFlight++;
+    }
+
+    if (s->inFlight == 0) {
+        freeStream(s);
+        return 0;
+    }
+
+    return s;
+}
+
+struct UsbusStream *usbusStreamOut(UsbusDevice *d, uint8_t ep, unsigned bufferSize, unsigned flushMicros)
+{
+    /*
+     * Start a coalescing stream to OUT endpoint `ep`.
+     *
+     * `bufferSize` is rounded down to a multiple of the endpoint's
+     * wMaxPacketSize (and up to at least one packet). Buffered data is sent
+     * no later than `flushMicros` after it was written - with a deadline of 0,
+     * data is sent immediately if nothing is already in flight.
+     */
+
+    if (!d->isOpen || (ep & 0x80)) {
+        return 0;
+    }
+    if (bufferSize > STREAM_MAX_SIZE) {
+        logerror("usbusStreamOut(): buffer size beyond %u", STREAM_MAX_SIZE);
+        return 0;
+    }
+
+    unsigned maxPacket = d->speed >= UsbusHighSpeed ? 512 : 64;
+    struct UsbusEndpointDescriptor epDesc;
+    if (findEndpointDescriptor(d, ep, &epDesc, 0) == UsbusOK && epDesc.wMaxPacketSize > 0) {
+        maxPacket = epDesc.wMaxPacketSize & 0x7ff;
+    }
+
+    struct UsbusStream *s = calloc(1, sizeof *s);
+    if (!s) {
+        logerror("failed to allocate stream");
+        return 0;
+    }
+
+    s->device = d;
+    s->endpoint = ep;
+    s->lastError = UsbusComplete;
+    s->bufferSize = bufferSize - bufferSize % maxPacket;
+    if (s->bufferSize == 0) {
+        s->bufferSize = maxPacket;
+    }
+    s->flushNanos = (uint64_t)flushMicros * 1000;
+
+    if (allocateTransfers(s, OUT_STREAM_BUFFERS, s->bufferSize, onStreamOutComplete) != UsbusOK) {
+        freeStream(s);
+        return 0;
+    }
+
+    UsbusContext *c = d->ctx;
+    s->nextOut = c->outStreams;
+    if (c->outStreams) {
+        c->outStreams->prevOut = s;
+    }
+    c->outStreams = s;
+
+    return s;
+}
+
+unsigned usbusStreamWrite(struct UsbusStream *s, const uint8_t *buf, unsigned len)
+{
+    /*
+     * Buffer up to `len` bytes for sending. Returns the number of bytes
+     * accepted, which is less than `len` if both buffers are in use -
+     * process events and try the remainder again.
+     */
+
+    unsigned written = 0;
+
+    while (written < len && !s->busy[s->fillIndex]) {
+
+        if (s->fill == 0 && s->flushNanos) {
+            s->flushDeadline = monotonicNanos() + s->flushNanos;
+        }
+
+        unsigned n = s->bufferSize - s->fill;
+        if (n > len - written) {
+            n = len - written;
+        }
+
+        memcpy(s->transfers[s->fillIndex]->buffer + s->fill, buf + written, n);
+        s->fill += n;
+        written += n;
+
+        if (s->fill == s->bufferSize && submitFill(s) != UsbusOK) {
+            break;
+        }
+    }
+
+    if (s->fill > 0 && s->flushNanos == 0 && s->inFlight == 0) {
+        submitFill(s);
+    }
+
+    return written;
+}
+
+int usbusStreamFlush(struct UsbusStream *s)
+{
+    /*
+     * Send any buffered data now, rather than waiting for its deadline.
+     */
+
+    if (s->fill == 0) {
+        return UsbusOK;
+    }
+
+    return submitFill(s);
+}
+
+unsigned usbusStreamRead(struct UsbusStream *s, uint8_t *buf, unsigned len)
+{
+    /*
+     * Copy up to `len` bytes of received data into `buf`.
+     * May be called from any one thread. Returns the number of bytes copied.
+     */
+
+    uint32_t tail = s->tail;
+    uint32_t avail = atomicLoad32(&s->head) - tail;
+    uint32_t n = avail < len ? avail : len;
+
+    uint32_t off = tail & (s->ringSize - 1);
+    uint32_t first = s->ringSize - off < n ? s->ringSize - off : n;
+    memcpy(buf, s->ring + off, first);
+    memcpy(buf + first, s->ring, n - first);
+
+    atomicStore32(&s->tail, tail + n);
+    return n;
+}
+
+unsigned usbusStreamReadAvailable(struct UsbusStream *s)
+{
+    return atomicLoad32(&s->head) - atomicLoad32(&s->tail);
+}
+
+unsigned usbusStreamOverruns(struct UsbusStream *s)
+{
+    return atomicLoad32(&s->overruns);
+}
+
+int usbusStreamStatus(struct UsbusStream *s)
+{
+    /*
+     * Returns UsbusOK until one of the stream's transfers fails, typically
+     * because the device has gone away.
+     */
+
+    if (!s->device->isOpen) {
+        return UsbusNotOpen;
+    }
+    return s->lastError == UsbusComplete ? UsbusOK : -1;
+}
+
+void usbusStreamClose(struct UsbusStream *s)
+{
+    /*
+     * IN streams cancel their transfers, and OUT streams send whatever is
+     * still buffered. Either way, wait for the transfers to be returned,
+     * processing events on the device's context as needed.
+     *
+     * Must be called from the thread processing events, but not from
+     * within a transfer callback.
+     */
+
+    if (!s) {
+        return;
+    }
+
+    unsigned i;
+    if (s->endpoint & 0x80) {
+        s->stopping = 1;
+        for (i = 0; i < s->numTransfers; ++i) {
+            usbusCancelTransfer(s->transfers[i]);
+        }
+    } else {
+        while (s->fill > 0 && s->device->isOpen && s->lastError == UsbusComplete) {
+            if (s->busy[s->fillIndex]) {
+                usbusProcessEvents(s->device->ctx, 10);
+            } else if (submitFill(s) != UsbusOK) {
+                break;
+            }
+        }
+        s->stopping = 1;
+    }
+
+    while (s->inFlight > 0 && s->device->isOpen) {
+        usbusProcessEvents(s->device->ctx, 10);
+    }
+
+    freeStream(s);
+}
+
+
+/************************************
+ * Internal Implementation/Helpers
+ ************************************/
+
+unsigned serviceStreams(UsbusContext *ctx, unsigned timeoutMillis)
+{
+    /*
+     * Flush OUT streams whose deadline has passed, and shorten the
+     * timeout for waiting on events such that the next deadline isn't missed.
+     */
+
+    uint64_t now = monotonicNanos();
+
+    struct UsbusStream *s;
+    for (s = ctx->outStreams; s; s = s->nextOut) {
+        if (s->fill != 0 && s->flushDeadline != 0 && !s->busy[s->fillIndex] && now >= s->flushDeadline) {
+            submitFill(s);
+        }
+    }
+
+    return streamWaitMillis(ctx, timeoutMillis);
+}
+
+unsigned streamWaitMillis(UsbusContext *ctx, unsigned timeoutMillis)
+{
+    /*
+     * Limit `timeoutMillis` such that a wait ends by the next flush deadline,
+     * without flushing anything.
+     */
+
+    uint64_t now = monotonicNanos();
+
+    struct UsbusStream *s;
+    for (s = ctx->outStreams; s; s = s->nextOut) {
+        if (s->fill == 0 || s->flushDeadline == 0 || s->busy[s->fillIndex]) {
+            continue;
+        }
+
+        uint64_t millis = now >= s->flushDeadline ? 0 : (s->flushDeadline - now + 999999) / 1000000;
+        if (millis < timeoutMillis) {
+            timeoutMillis = (unsigned)millis;
+        }
+    }
+
+    return timeoutMillis;
+}
+
+static void onStreamInComplete(struct UsbusTransfer *t, enum UsbusStatus status)
+{
+    struct UsbusStream *s = t->userData;
+
+    if (status != UsbusComplete || s->stopping) {
+        if (status != UsbusComplete && status != UsbusCanceled) {
+            s->lastError = status;
+        }
+        s->inFlight--;
+        return;
+    }
+
+    uint32_t head = s->head;
+    uint32_t n = t->transferredlength;
+
+    if (s->ringSize - (head - atomicLoad32(&s->tail)) < n) {
+        atomicFetchAdd32(&s->overruns, 1);
+    } else {
+        uint32_t off = head & (s->ringSize - 1);
+        uint32_t first = s->ringSize - off < n ? s->ringSize - off : n;
+        memcpy(s->ring + off, t->buffer, first);
+        memcpy(s->ring, t->buffer + first, n - first);
+        atomicStore32(&s->head, head + n);
+    }
+
+    if (usbusSubmitTransfer(t) != UsbusOK) {
+        s->lastError = UsbusStatusGenericError;
+        s->inFlight--;
+    }
+}
+
+static void onStreamOutComplete(struct UsbusTransfer *t, enum UsbusStatus status)
+{
+    struct UsbusStream *s = t->userData;
+
+    s->busy[t == s->transfers[0] ? 0 : 1] = 0;
+    s->inFlight--;
+
+    if (status != UsbusComplete) {
+        s->lastError = status;
+        return;
+    }
+
+    // the endpoint is free again - send whatever accumulated in the meantime
+    if (s->fill > 0 && !s->stopping) {
+        submitFill(s);
+    }
+}
+
+static int allocateTransfers(struct UsbusStream *s, unsigned n, unsigned size, UsbusTransferCallback cb)
+{
+    s->transfers = calloc(n, sizeof *s->transfers);
+    if (!s->transfers) {
+        logerror("failed to allocate stream");
+        return -1;
+    }
+
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+        struct UsbusTransfer *t = usbusAllocateTransfer();
+        uint8_t *buf = t ? usbusAllocateTransferBuffer(s->device, size) : 0;
+        if (!buf) {
+            usbusReleaseTransfer(t);
+            return -1;
+        }
+
+        t->type = UsbusTransferBulk;
+        usbusSetBulkTransferInfo(t, s->device, s->endpoint, buf, size, cb, s);
+        s->transfers[s->numTransfers++] = t;
+    }
+
+    return UsbusOK;
+}
+
+static int submitFill(struct UsbusStream *s)
+{
+    /*
+     * Send the buffer that's been filling, and switch to the other one.
+     */
+
+    struct UsbusTransfer *t = s->transfers[s->fillIndex];
+    t->requestedLength = s->fill;
+
+    int r = usbusSubmitTransfer(t);
+    if (r != UsbusOK) {
+        s->lastError = UsbusStatusGenericError;
+        return r;
+    }
+
+    s->busy[s->fillIndex] = 1;
+    s->inFlight++;
+    s->fillIndex = (s->fillIndex + 1) % OUT_STREAM_BUFFERS;
+    s->fill = 0;
+    s->flushDeadline = 0;
+    return UsbusOK;
+}
+
+static uint32_t roundUpPow2(uint32_t v)
+{
+    // beyond 2^31 there's no uint32_t power of 2 - callers keep to STREAM_MAX_SIZE
+    v--;
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    v++;
+    return v ? v : 1;
+}
+
+static void freeStream(struct UsbusStream *s)
+{
+    if (s->prevOut) {
+        s->prevOut->nextOut = s->nextOut;
+    } else if (s->device->ctx->outStreams == s) {
+        s->device->ctx->outStreams = s->nextOut;
+    }
+    if (s->nextOut) {
+        s->nextOut->prevOut = s->prevOut;
+    }
+
+    unsigned i;
+    for (i = 0; i < s->numTransfers; ++i) {
+        usbusFreeTransferBuffer(s->device, s->transfers[i]->buffer);
+        usbusReleaseTransfer(s->transfers[i]);
+    }
+
+    free(s->transfers);
+    free(s->ring);
+    free(s);
+}
@@ -0,0 +1,70 @@
+#include "thread.h"
+
+#include <stdlib.h>
+
+struct ThreadStart {
+    ThreadFunc fn;
+    void *arg;
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI threadEntry(LPVOID p);
+#else
+static void *threadEntry(void *p);
+#endif
+
+
+int threadStart(Thread *t, ThreadFunc fn, void *arg)
+{
+    /*
+     * Returns 0 on success, -1 on failure.
+     */
+
+    struct ThreadStart *s = malloc(sizeof *s);
+    if (!s) {
+        return -1;
+    }
+    s->fn = fn;
+    s->arg = arg;
+
+#if defined(_WIN32)
+    *t = CreateThread(NULL, 0, threadEntry, s, 0, NULL);
+    if (!*t) {
+        free(s);
+        return -1;
+    }
+#else
+    if (pthread_create(t, 0, threadEntry, s) != 0) {
+        free(s);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void threadJoin(Thread t)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, 0);
+#endif
+}
+
+
+/************************************
+ * Internal Implementation/Helpers
+ ************************************/
+
+#if defined(_WIN32)
+static DWORD WINAPI threadEntry(LPVOID p)
+#else
+static void *threadEntry(void *p)
+#endif
+{
+    struct ThreadStart s = *(struct ThreadStart*)p;
+    free(p);
+    s.fn(s.arg);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+/*
+ * Minimal threads, for the library's own background work.
+ */
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+typedef HANDLE Thread;
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+#endif
+
+typedef void (*ThreadFunc)(void *arg);
+
+int threadStart(Thread *t, ThreadFunc fn, void *arg);
+void threadJoin(Thread t);
+
+#endif // _THREAD_H
@@ -0,0 +1,281 @@
+#include "timer.h"
+#include "clock.h"
+
+#define TIMER_EXPIRED   0xffff
+#define TIMER_RANGE     (1ull << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+static uint64_t nowMillis();
+static void place(struct TimerWheel *w, struct TimerEntry *e);
+static void linkEntry(struct TimerEntry **head, struct TimerEntry *e);
+static void unlinkEntry(struct TimerWheel *w, struct TimerEntry *e);
+static void cascade(struct TimerWheel *w, unsigned level, unsigned index);
+static void expireSlot(struct TimerWheel *w, unsigned index);
+static unsigned lowestBit(uint64_t v);
+
+
+void timerArm(struct TimerWheel *w, struct TimerEntry *e, unsigned millis)
+{
+    /*
+     * (Re)arm `e` to expire `millis` from now.
+     */
+
+    if (e->pprev) {
+        unlinkEntry(w, e);
+    }
+
+    uint64_t now = nowMillis();
+
+    // nothing in flight - no need to step through the idle time
+    if (!timerPending(w) || w->now > now) {
+        w->now = now;
+    }
+
+    e->expires = now + (millis ? millis : 1);
+    place(w, e);
+}
+
+void timerDisarm(struct TimerWheel *w, struct TimerEntry *e)
+{
+    /*
+     * Safe to call for entries that aren't armed.
+     */
+
+    if (e->pprev) {
+        unlinkEntry(w, e);
+    }
+}
+
+void timerDisarmMatching(struct TimerWheel *w, int (*match)(struct TimerEntry *e, void *arg), void *arg)
+{
+    /*
+     * Disarm everything that `match` selects. Walks the whole wheel,
+     * so only suitable for infrequent cleanup.
+     */
+
+    unsigned level, index;
+    for (level = 0; level < TIMER_LEVELS; ++level) {
+        for (index = 0; index < TIMER_SLOTS; ++index) {
+            struct TimerEntry *e = w->slots[level][index];
+            while (e) {
+                struct TimerEntry *next = e->next;
+                if (match(e, arg)) {
+                    unlinkEntry(w, e);
+                }
+                e = next;
+            }
+        }
+    }
+
+    struct TimerEntry *e = w->expired;
+    while (e) {
+        struct TimerEntry *next = e->next;
+        if (match(e, arg)) {
+            unlinkEntry(w, e);
+        }
+        e = next;
+    }
+}
+
+void timerAdvance(struct TimerWheel *w)
+{
+    /*
+     * Process ticks up to the current time, moving entries that are due
+     * onto the expired list and cascading higher levels down as lower ones wrap.
+     */
+
+    uint64_t target = nowMillis();
+
+    while (w->now < target) {
+
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+
+        // nothing in level 0 - skip ahead to the tick before it next wraps
+        if (!w->occupied[0]) {
+            uint64_t last = w->now | (TIMER_SLOTS - 1);
+            if (last >= target) {
+                w->now = target;
+                break;
+            }
+            w->now = last;
+        }
+
+        w->now++;
+
+        unsigned level;
+        for (level = 1; level < TIMER_LEVELS; ++level) {
+            unsigned shift = TIMER_LEVEL_BITS * level;
+            if (w->now & ((1ull << shift) - 1)) {
+                break;
+            }
+            cascade(w, level, (w->now >> shift) & (TIMER_SLOTS - 1));
+        }
+
+        expireSlot(w, w->now & (TIMER_SLOTS - 1));
+    }
+}
+
+struct TimerEntry *timerNextExpired(struct TimerWheel *w)
+{
+    /*
+     * Pop the next expired entry, if any. Entries stay linked until
+     * popped, so they can still be disarmed in the meantime.
+     */
+
+    struct TimerEntry *e = w->expired;
+    if (e) {
+        unlinkEntry(w, e);
+    }
+    return e;
+}
+
+unsigned timerWaitMillis(struct TimerWheel *w, unsigned timeoutMillis)
+{
+    /*
+     * Limit `timeoutMillis` such that a wait ends by the time the next
+     * entry is due. Entries beyond level 0 only need us to wake when it
+     * next wraps, at which point they're cascaded down.
+     */
+
+    if (w->expired) {
+        return 0;
+    }
+    if (w->count == 0) {
+        return timeoutMillis;
+    }
+
+    uint64_t next;
+    if (w->occupied[0]) {
+        unsigned from = (w->now + 1) & (TIMER_SLOTS - 1);
+        uint64_t occ = w->occupied[0];
+        uint64_t rotated = from ? (occ >> from) | (occ << (TIMER_SLOTS - from)) : occ;
+        next = w->now + 1 + lowestBit(rotated);
+    } else {
+        next = (w->now | (TIMER_SLOTS - 1)) + 1;
+    }
+
+    uint64_t now = nowMillis();
+    uint64_t wait = next > now ? next - now : 0;
+    return wait < timeoutMillis ? (unsigned)wait : timeoutMillis;
+}
+
+
+/************************************
+ * Internal Implementation/Helpers
+ ************************************/
+
+static uint64_t nowMillis()
+{
+    return monotonicNanos() / 1000000;
+}
+
+static void place(struct TimerWheel *w, struct TimerEntry *e)
+{
+    /*
+     * Slot `e` by how far away it is. Entries further out than the wheel
+     * reaches are slotted as far out as possible, and placed again once
+     * they reach level 0.
+     */
+
+    if (e->expires <= w->now) {
+        e->slot = TIMER_EXPIRED;
+        linkEntry(&w->expired, e);
+        return;
+    }
+
+    uint64_t expires = e->expires;
+    uint64_t delta = expires - w->now;
+    if (delta >= TIMER_RANGE) {
+        delta = TIMER_RANGE - 1;
+        expires = w->now + delta;
+    }
+
+    unsigned level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ull << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    unsigned index = (expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1);
+    e->slot = level * TIMER_SLOTS + index;
+    linkEntry(&w->slots[level][index], e);
+    w->occupied[level] |= 1ull << index;
+    w->count++;
+}
+
+static void linkEntry(struct TimerEntry **head, struct TimerEntry *e)
+{
+    e->next = *head;
+    if (e->next) {
+        e->next->pprev = &e->next;
+    }
+    e->pprev = head;
+    *head = e;
+}
+
+static void unlinkEntry(struct TimerWheel *w, struct TimerEntry *e)
+{
+    *e->pprev = e->next;
+    if (e->next) {
+        e->next->pprev = e->pprev;
+    }
+    e->next = 0;
+    e->pprev = 0;
+
+    if (e->slot != TIMER_EXPIRED) {
+        unsigned level = e->slot / TIMER_SLOTS;
+        unsigned index = e->slot % TIMER_SLOTS;
+        if (!w->slots[level][index]) {
+            w->occupied[level] &= ~(1ull << index);
+        }
+        w->count--;
+    }
+}
+
+static void cascade(struct TimerWheel *w, unsigned level, unsigned index)
+{
+    /*
+     * Everything in this slot is due within the span of one slot at this
+     * level, so lands in a lower level (or expires) when placed again.
+     */
+
+    struct TimerEntry *e = w->slots[level][index];
+    w->slots[level][index] = 0;
+    w->occupied[level] &= ~(1ull << index);
+
+    while (e) {
+        struct TimerEntry *next = e->next;
+        w->count--;
+        place(w, e);
+        e = next;
+    }
+}
+
+static void expireSlot(struct TimerWheel *w, unsigned index)
+{
+    struct TimerEntry *e = w->slots[0][index];
+    w->slots[0][index] = 0;
+    w->occupied[0] &= ~(1ull << index);
+
+    while (e) {
+        struct TimerEntry *next = e->next;
+        w->count--;
+        place(w, e);    // expired, unless it was parked beyond the wheel's range
+        e = next;
+    }
+}
+
+static unsigned lowestBit(uint64_t v)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(v);
+#else
+    unsigned n = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel with millisecond ticks.
+ *
+ * Each level has 64 slots, each covering 64x the span of a slot in the level
+ * below, so 4 levels reach ~4.6 hours - anything further out is parked in the
+ * top level and re-placed as it comes around. Arming and disarming are O(1),
+ * and entries only move between levels when a lower level wraps.
+ *
+ * Not thread-safe - a wheel belongs to the thread processing its context's events.
+ */
+
+#define TIMER_LEVEL_BITS    6
+#define TIMER_SLOTS         (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS        4
+
+struct TimerEntry {
+    struct TimerEntry *next;
+    struct TimerEntry **pprev;          // null while not armed
+    uint64_t expires;                   // millis, on the monotonicNanos() clock
+    uint16_t slot;                      // level * TIMER_SLOTS + index, or TIMER_EXPIRED
+};
+
+struct TimerWheel {
+    uint64_t now;                       // last tick processed
+    unsigned count;                     // entries in slots, excluding those already expired
+    uint64_t occupied[TIMER_LEVELS];    // bitmap of non-empty slots per level
+    struct TimerEntry *expired;         // due, waiting to be collected via timerNextExpired()
+    struct TimerEntry *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timerArm(struct TimerWheel *w, struct TimerEntry *e, unsigned millis);
+void timerDisarm(struct TimerWheel *w, struct TimerEntry *e);
+void timerDisarmMatching(struct TimerWheel *w, int (*match)(struct TimerEntry *e, void *arg), void *arg);
+
+void timerAdvance(struct TimerWheel *w);
+struct TimerEntry *timerNextExpired(struct TimerWheel *w);
+unsigned timerWaitMillis(struct TimerWheel *w, unsigned timeoutMillis);
+
+static inline int timerPending(const struct TimerWheel *w) {
+    return w->count != 0 || w->expired != 0;
+}
+
+#endif // _TIMER_H
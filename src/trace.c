@@ -0,0 +1,245 @@
+#include "usbus.h"
+#include "usbus_private.h"
+#include "atomics.h"
+#include "clock.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Transfer tracing. Each event claims the next record in the ring with a
+ * single atomic increment, so submits and cancels from other threads (see
+ * usbusSetThreadSafe()) can be recorded alongside the event thread's
+ * completions. Once the ring is full, the oldest records are overwritten.
+ *
+ * Traces are written in the Chrome trace event format, which both
+ * chrome://tracing and ui.perfetto.dev can load. Each transfer is an async
+ * span from submit to completion, keyed by the transfer's address, with
+ * callbacks as nested slices on a track per endpoint.
+ */
+
+#define TRACE_MASK (USBUS_TRACE_RECORDS - 1)
+
+#if (USBUS_TRACE_RECORDS & TRACE_MASK) != 0
+#error USBUS_TRACE_RECORDS must be a power of 2
+#endif
+
+static void writeRecord(FILE *f, const struct TraceRecord *r);
+static void writeTimestamp(FILE *f, uint64_t nanos);
+static const char *statusName(int status);
+
+
+/**************
+ * API
+ **************/
+
+int usbusSetTracing(UsbusContext *ctx, uint8_t enable)
+{
+    /*
+     * Start or stop recording transfer events. Starting discards anything
+     * recorded previously, stopping keeps it around for usbusWriteTrace().
+     *
+     * Call from the thread processing events.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    struct TraceRing *ring = &c->trace;
+
+    if (!enable) {
+        atomicStore32(&ring->enabled, 0);
+        return UsbusOK;
+    }
+
+    if (!ring->records) {
+        ring->records = malloc(USBUS_TRACE_RECORDS * sizeof *ring->records);
+        if (!ring->records) {
+            logerror("usbusSetTracing(): failed to malloc trace records");
+            return -1;
+        }
+    }
+
+    memset(ring->records, 0, USBUS_TRACE_RECORDS * sizeof *ring->records);
+    atomicStore32(&ring->next, 0);
+    atomicStore32(&ring->enabled, 1);
+    return UsbusOK;
+}
+
+int usbusWriteTrace(UsbusContext *ctx, const char *path)
+{
+    /*
+     * Write the recorded events to `path` as Chrome trace JSON.
+     * Tracing needn't be stopped first, but any events recorded while
+     * writing may be missing or partially written.
+     */
+
+    struct UsbusContext *c = ctx ? ctx : &defaultCtxt;
+    struct TraceRing *ring = &c->trace;
+
+    if (!ring->records) {
+        return UsbusNotSupported;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        logerror("usbusWriteTrace(): failed to open %s", path);
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    // name each device's process once, by bus and address
+    uint8_t *named = calloc(256 * 256 / 8, 1);
+    uint32_t next = atomicLoad32(&ring->next);
+    unsigned i;
+    int first = 1;
+
+    for (i = 0; i < USBUS_TRACE_RECORDS; ++i) {
+        const struct TraceRecord *r = &ring->records[(next + i) & TRACE_MASK];
+        if (!r->nanos) {
+            continue;
+        }
+
+        unsigned pid = (r->busNumber << 8) | r->address;
+        if (named && !(named[pid / 8] & (1 << (pid % 8)))) {
+            named[pid / 8] |= 1 << (pid % 8);
+            fprintf(f, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                       "\"args\":{\"name\":\"bus %u address %u\"}}",
+                    first ? "" : ",\n", pid, r->busNumber, r->address);
+            first = 0;
+        }
+
+        if (!first) {
+            fputs(",\n", f);
+        }
+        writeRecord(f, r);
+        first = 0;
+    }
+
+    fprintf(f, "\n]}\n");
+    free(named);
+
+    if (fclose(f) != 0) {
+        logerror("usbusWriteTrace(): failed to write %s", path);
+        return -1;
+    }
+    return UsbusOK;
+}
+
+
+/********************************
+ *  Internal Routines/Helpers
+ ********************************/
+
+uint32_t traceRecord(struct UsbusTransfer *t, enum TraceEvent event, int status)
+{
+    /*
+     * Called via traceTransfer(), once it's checked that tracing is enabled.
+     * Returns the record's index, for traceCallbackEnd().
+     */
+
+    struct TraceRing *ring = &t->device->ctx->trace;
+    uint32_t index = atomicFetchAdd32(&ring->next, 1);
+    struct TraceRecord *r = &ring->records[index & TRACE_MASK];
+
+    r->transfer = t;
+    r->length = event == TraceComplete ? t->transferredlength : t->requestedLength;
+    r->status = (int16_t)status;
+    r->event = (uint8_t)event;
+    r->endpoint = t->endpoint;
+    r->busNumber = t->device->busNumber;
+    r->address = t->device->address;
+    r->nanos = monotonicNanos();
+    return index;
+}
+
+void traceCallbackEnd(UsbusContext *ctx, uint32_t begin)
+{
+    /*
+     * Close the callback slice opened by record `begin`, unless it's
+     * been overwritten since.
+     */
+
+    struct TraceRing *ring = &ctx->trace;
+    struct TraceRecord b = ring->records[begin & TRACE_MASK];
+    if (b.event != TraceCallbackBegin) {
+        return;
+    }
+
+    uint32_t index = atomicFetchAdd32(&ring->next, 1);
+    struct TraceRecord *r = &ring->records[index & TRACE_MASK];
+
+    *r = b;
+    r->event = TraceCallbackEnd;
+    r->nanos = monotonicNanos();
+}
+
+static void writeRecord(FILE *f, const struct TraceRecord *r)
+{
+    /*
+     * Transfers are async spans ("b" / "e"), with the steps in between
+     * as async instants ("n"). Callbacks run on the event thread, so are
+     * regular slices ("B" / "E") on the endpoint's track.
+     */
+
+    unsigned pid = (r->busNumber << 8) | r->address;
+
+    switch (r->event) {
+    case TraceSubmit:
+        fprintf(f, "{\"name\":\"ep 0x%02x\",\"cat\":\"transfer\",\"ph\":\"b\",\"id\":\"%p\",\"pid\":%u,\"tid\":%u,\"ts\":",
+                r->endpoint, (const void*)r->transfer, pid, r->endpoint);
+        writeTimestamp(f, r->nanos);
+        fprintf(f, ",\"args\":{\"length\":%u}}", r->length);
+        break;
+
+    case TraceEnqueue:
+    case TraceCancel:
+    case TraceTimeout:
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"transfer\",\"ph\":\"n\",\"id\":\"%p\",\"pid\":%u,\"tid\":%u,\"ts\":",
+                r->event == TraceEnqueue ? "enqueue" : r->event == TraceCancel ? "cancel" : "timeout",
+                (const void*)r->transfer, pid, r->endpoint);
+        writeTimestamp(f, r->nanos);
+        fprintf(f, "}");
+        break;
+
+    case TraceSubmitFailed:
+    case TraceComplete:
+        fprintf(f, "{\"name\":\"ep 0x%02x\",\"cat\":\"transfer\",\"ph\":\"e\",\"id\":\"%p\",\"pid\":%u,\"tid\":%u,\"ts\":",
+                r->endpoint, (const void*)r->transfer, pid, r->endpoint);
+        writeTimestamp(f, r->nanos);
+        if (r->event == TraceComplete) {
+            fprintf(f, ",\"args\":{\"status\":\"%s\",\"length\":%u}}", statusName(r->status), r->length);
+        } else {
+            fprintf(f, ",\"args\":{\"submitError\":%d}}", r->status);
+        }
+        break;
+
+    case TraceCallbackBegin:
+    case TraceCallbackEnd:
+        fprintf(f, "{\"name\":\"callback\",\"cat\":\"transfer\",\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":",
+                r->event == TraceCallbackBegin ? "B" : "E", pid, r->endpoint);
+        writeTimestamp(f, r->nanos);
+        fprintf(f, "}");
+        break;
+    }
+}
+
+static void writeTimestamp(FILE *f, uint64_t nanos)
+{
+    // microseconds, keeping nanosecond precision
+    fprintf(f, "%llu.%03u", (unsigned long long)(nanos / 1000), (unsigned)(nanos % 1000));
+}
+
+static const char *statusName(int status)
+{
+    switch (status) {
+    case UsbusComplete:             return "complete";
+    case UsbusCanceled:             return "canceled";
+    case UsbusStalled:              return "stalled";
+    case UsbusOverflow:             return "overflow";
+    case UsbusTimeout:              return "timeout";
+    case UsbusBadParameter:         return "bad parameter";
+    default:                        return "error";
+    }
+}
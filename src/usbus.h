@@ -60,6 +60,65 @@ struct UsbusConfigDescriptor {
     uint8_t  bMaxPower;
 };
 
+/*
+ * Views over raw descriptor bytes, as returned by usbusDescriptorIterNext().
+ * Multi-byte fields are little endian byte arrays, so views can be overlaid
+ * on unaligned data - use usbusLE16()/usbusLE32() to read them.
+ */
+
+struct UsbusDescriptorHeader {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+};
+
+struct UsbusEndpointDescriptorView {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bEndpointAddress;
+    uint8_t  bmAttributes;
+    uint8_t  wMaxPacketSize[2];
+    uint8_t  bInterval;
+};
+
+struct UsbusSSEndpointCompanionDescriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bMaxBurst;
+    uint8_t  bmAttributes;
+    uint8_t  wBytesPerInterval[2];
+};
+
+struct UsbusBosDescriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  wTotalLength[2];
+    uint8_t  bNumDeviceCaps;
+};
+
+struct UsbusDeviceCapabilityDescriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bDevCapabilityType;
+};
+
+struct UsbusUsb2ExtensionDescriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bDevCapabilityType;
+    uint8_t  bmAttributes[4];
+};
+
+struct UsbusSSDeviceCapabilityDescriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bDevCapabilityType;
+    uint8_t  bmAttributes;
+    uint8_t  wSpeedsSupported[2];
+    uint8_t  bFunctionalitySupport;
+    uint8_t  bU1DevExitLat;
+    uint8_t  wU2DevExitLat[2];
+};
+
 struct UsbusControlSetup {
     uint8_t  bmRequestType;
     uint8_t  bRequest;
@@ -68,6 +127,8 @@ struct UsbusControlSetup {
     uint16_t wLength;
 };
 
+#define USBUS_CONTROL_SETUP_SIZE    8
+
 
 
 /*******************************
@@ -79,6 +140,7 @@ enum UsbusError {
     UsbusIoErr      = 1,
     UsbusNotOpen    = 2,
     UsbusNotFound   = 3,
+    UsbusNotSupported = 4,
     UsbusErrUnknown
 };
 
@@ -107,6 +169,12 @@ enum UsbusLogLevel {
     UsbusLogInfo
 };
 
+enum UsbusLogMode {
+    UsbusLogSync,               // format and write on the calling thread
+    UsbusLogAsync,              // capture into a ring, formatted on a background thread
+    UsbusLogAsyncManual         // capture into a ring, formatted by usbusDrainLog()
+};
+
 enum UsbusTransferType {
     UsbusTransferControl,
     UsbusTransferIsochronous,
@@ -114,17 +182,39 @@ enum UsbusTransferType {
     UsbusTransferInterrupt
 };
 
+enum UsbusPlatformType {
+    UsbusPlatformNative,        // IOKit, WinUSB or usbfs, depending on the build
+    UsbusPlatformEmulated       // in-process virtual devices, see usbusEmuAddDevice()
+};
+
+enum UsbusEmuBehavior {
+    UsbusEmuSink,               // OUT transfers complete in full, data is discarded
+    UsbusEmuSource,             // IN transfers complete in full, with generated data
+    UsbusEmuLoopback,           // OUT data is delivered to the IN endpoint of the same number
+    UsbusEmuReplay              // transfers complete as they did in a recording, see usbusEmuAddReplay()
+};
+
 enum UsbusDescriptorType {
     UsbusDescriptorDevice           = 0x01,
     UsbusDescriptorConfig           = 0x02,
     UsbusDescriptorString           = 0x03,
     UsbusDescriptorInterface        = 0x04,
     UsbusDescriptorEndpoint         = 0x05,
+    UsbusDescriptorInterfaceAssoc   = 0x0B,
+    UsbusDescriptorBOS              = 0x0F,
+    UsbusDescriptorDeviceCapability = 0x10,
     UsbusDescriptorHID              = 0x21,
     UsbusDescriptorReport           = 0x22,
     UsbusDescriptorPhysical         = 0x23,
     UsbusDescriptorHub              = 0x29,
-    UsbusDescriptorSuperSpeedHub    = 0x2A
+    UsbusDescriptorSuperSpeedHub    = 0x2A,
+    UsbusDescriptorSSEndpointCompanion = 0x30
+};
+
+enum UsbusDeviceCapabilityType {
+    UsbusCapabilityUsb2Extension    = 0x02,
+    UsbusCapabilitySuperSpeed       = 0x03,
+    UsbusCapabilityContainerId      = 0x04
 };
 
 enum UsbusDeviceClass {
@@ -157,12 +247,27 @@ typedef struct UsbusDevice UsbusDevice;
 
 // forward decls
 struct UsbusTransfer;
+struct UsbusEndpoint;
 struct UsbusDeviceDescriptor;
 
 typedef void (*UsbusDeviceConnectedCallback)(UsbusDevice *d, uint8_t *dispose);
 typedef void (*UsbusDeviceDisconnectedCallback)(UsbusDevice *d);
 typedef void (*UsbusTransferCallback)(struct UsbusTransfer *t, enum UsbusStatus s);
-
+typedef void (*UsbusPollFdAddedCallback)(int fd, short events, void *userData);
+typedef void (*UsbusPollFdRemovedCallback)(int fd, void *userData);
+typedef void (*UsbusLogCallback)(enum UsbusLogLevel level, const char *msg, void *userData);
+
+/*
+ * Transfers must come from usbusAllocateTransfer() - the library keeps
+ * private state alongside each one, so a transfer declared on the stack or
+ * embedded in another struct is rejected with UsbusBadParameter.
+ *
+ * Control transfers (those on endpoint 0) start their buffer with the setup
+ * packet - a UsbusControlSetup in bus (little endian) order - followed by
+ * the data stage, in the direction bmRequestType declares. requestedLength
+ * covers both, transferredlength only the data stage. See
+ * usbusSetControlTransferInfo().
+ */
 struct UsbusTransfer {
     UsbusDevice *device;
     uint8_t flags;
@@ -175,6 +280,84 @@ struct UsbusTransfer {
     UsbusTransferCallback callback;
     void *userData;
     unsigned char *buffer;
+    struct UsbusEndpoint *endpointHandle;   // optional, see usbusSetEndpointTransferInfo()
+};
+
+// descriptor to watch on behalf of the library - `events` uses the POLLIN/POLLOUT flags from <poll.h>
+struct UsbusPollFd {
+    int fd;
+    short events;
+};
+
+struct UsbusCompletion {
+    struct UsbusTransfer *transfer;
+    enum UsbusStatus status;
+    int length;
+    uint64_t timestampNanos;                // monotonic clock, at the time the platform reported completion
+};
+
+/*
+ * Latencies are bucketed log-linearly: 8 buckets per power of two microseconds,
+ * so each bucket is within 12.5% of the values it holds, up to ~71 minutes.
+ * See usbusLatencyBucketMicros().
+ */
+#define USBUS_LATENCY_SUB_BUCKETS   8
+#define USBUS_LATENCY_BUCKETS       240
+
+struct UsbusEndpointStats {
+    uint64_t transfersSubmitted;
+    uint64_t transfersCompleted;
+    uint64_t bytesSubmitted;                // requested lengths
+    uint64_t bytesCompleted;                // transferred lengths
+    uint64_t completions[UsbusStatusGenericError + 1];  // by UsbusStatus
+    uint32_t inFlight;
+    uint32_t maxInFlight;
+    uint32_t latency[USBUS_LATENCY_BUCKETS];    // submit to completion
+};
+
+enum UsbusMatchFlags {
+    UsbusMatchClass     = 1 << 0,
+    UsbusMatchSubClass  = 1 << 1,
+    UsbusMatchProtocol  = 1 << 2,
+    UsbusMatchBus       = 1 << 3
+};
+
+struct UsbusDeviceId {
+    uint16_t idVendor;
+    uint16_t idProduct;                     // 0 matches any product of idVendor
+};
+
+// a device must satisfy every criterion given - a zeroed filter matches all devices
+struct UsbusMatchFilter {
+    const struct UsbusDeviceId *ids;        // optional - the device must match one of these
+    unsigned numIds;
+    uint8_t flags;                          // UsbusMatchFlags, selecting which fields below apply
+    uint8_t deviceClass;                    // as reported in the device descriptor
+    uint8_t deviceSubClass;
+    uint8_t deviceProtocol;
+    uint8_t busNumber;
+    const char *serialPrefix;               // optional, UTF-8
+};
+
+struct UsbusEmuEndpoint {
+    uint8_t address;
+    enum UsbusTransferType type;
+    uint16_t maxPacketSize;
+    enum UsbusEmuBehavior behavior;
+    unsigned latencyMicros;                 // delay between submission and completion
+};
+
+struct UsbusEmuDeviceConfig {
+    struct UsbusDeviceDescriptor descriptor;
+    enum UsbusSpeed speed;
+    const uint8_t *configDescriptors;       // optional - generated from `endpoints` if null
+    unsigned configDescriptorsLen;
+    const char *const *strings;             // UTF-8, strings[0] is string descriptor index 1
+    unsigned numStrings;
+    const struct UsbusEmuEndpoint *endpoints;
+    unsigned numEndpoints;
+    const uint8_t *bos;                     // optional - BOS descriptor set, for bcdUSB >= 0x0201
+    unsigned bosLen;
 };
 
 /******************************************
@@ -182,6 +365,13 @@ struct UsbusTransfer {
  ******************************************/
 
 void usbusSetLogLevel(enum UsbusLogLevel lvl);
+void usbusSetLogCallback(UsbusLogCallback cb, void *userData);
+int usbusSetLogMode(enum UsbusLogMode mode);
+unsigned usbusDrainLog();
+
+int usbusSetPlatform(UsbusContext *ctx, enum UsbusPlatformType type);
+
+int usbusSetMatchFilter(UsbusContext *ctx, const struct UsbusMatchFilter *filter);
 
 int usbusListen(UsbusContext *ctx,
                 UsbusDeviceConnectedCallback connectCB,
@@ -190,10 +380,22 @@ int usbusListen(UsbusContext *ctx,
 void usbusStopListen(UsbusContext *ctx);
 
 void usbusGetDescriptor(UsbusDevice *dev, struct UsbusDeviceDescriptor *desc);
+
+// zero-copy descriptor walking - views remain valid until the device is closed
+struct UsbusDescriptorIter {
+    const uint8_t *next;
+    const uint8_t *end;
+};
+
+int usbusDescriptorIterBegin(UsbusDevice *d, unsigned configIndex, struct UsbusDescriptorIter *it);
+int usbusBosIterBegin(UsbusDevice *d, struct UsbusDescriptorIter *it);
+const struct UsbusDescriptorHeader *usbusDescriptorIterNext(struct UsbusDescriptorIter *it);
 int usbusGetStringDescriptor(UsbusDevice *d, uint8_t index, uint16_t lang,
                              uint8_t *buf, unsigned len, unsigned *transferred);
 int usbusGetStringDescriptorAscii(UsbusDevice *d, uint8_t index, uint16_t lang,
                                   char *buf, unsigned len, unsigned *transferred);
+int usbusGetStringDescriptorUtf8(UsbusDevice *d, uint8_t index, uint16_t lang,
+                                 char *buf, unsigned len, unsigned *transferred);
 
 int  usbusOpen(UsbusDevice *d);
 uint8_t usbusIsOpen(UsbusDevice *d);
@@ -215,29 +417,133 @@ int usbusSetConfiguration(UsbusDevice *d, uint8_t config);
 int usbusReadSync(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
 int usbusWriteSync(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written);
 
-// async I/O
+// endpoint handles - resolve an endpoint's routing once, rather than per transfer
+struct UsbusEndpoint *usbusOpenEndpoint(UsbusDevice *d, uint8_t ep);
+void usbusCloseEndpoint(struct UsbusEndpoint *e);
+
+// async I/O - transfers must be allocated here, see struct UsbusTransfer
 struct UsbusTransfer *usbusAllocateTransfer();
 void usbusReleaseTransfer(struct UsbusTransfer *t);
 
+// transfer buffers that the platform can use without copying, where supported
+uint8_t *usbusAllocateTransferBuffer(UsbusDevice *d, unsigned len);
+void usbusFreeTransferBuffer(UsbusDevice *d, uint8_t *buf);
+
+void usbusSetEndpointTransferInfo(struct UsbusTransfer *t, struct UsbusEndpoint *e,
+                                  uint8_t *buf, unsigned len, UsbusTransferCallback cb, void *userData);
 int usbusSubmitTransfer(struct UsbusTransfer *t);
-int usbusCancelTransfer(struct UsbusTransfer *t);
+int usbusSubmitTransfers(struct UsbusTransfer **ts, unsigned n, int *results);
+int usbusCancelTransfer(struct UsbusTransfer *t);     // only `t` completes as canceled, even where the platform aborts the whole pipe
 int usbusProcessEvents(UsbusContext *ctx, unsigned timeoutMillis);
+int usbusSetThreadSafe(UsbusContext *ctx, uint8_t enable);
+int usbusPollCompletions(UsbusContext *ctx, struct UsbusCompletion *out, unsigned max, unsigned timeoutMillis);
+
+// instrumentation - counters are updated on the thread processing events, read them from there too
+int usbusGetEndpointStats(UsbusDevice *d, uint8_t ep, struct UsbusEndpointStats *stats);
+void usbusResetEndpointStats(UsbusDevice *d);
+uint64_t usbusLatencyBucketMicros(unsigned bucket);
+uint64_t usbusLatencyPercentileMicros(const struct UsbusEndpointStats *stats, double percentile);
+
+// transfer tracing into a fixed size ring, written out as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+int usbusSetTracing(UsbusContext *ctx, uint8_t enable);
+int usbusWriteTrace(UsbusContext *ctx, const char *path);
+
+// packet capture to a pcap file Wireshark can open (Linux usbmon format), written from a background thread
+int usbusStartCapture(UsbusContext *ctx, const char *path, unsigned snapLength);
+void usbusStopCapture(UsbusContext *ctx);
+
+// traffic recording to a compact binary log, for replay as emulated devices via usbusEmuAddReplay()
+int usbusStartRecording(UsbusContext *ctx, const char *path);
+void usbusStopRecording(UsbusContext *ctx);
+
+// integration with external event loops - call usbusProcessEvents(ctx, 0) once a descriptor is ready,
+// or once usbusGetNextTimeout() has passed, whichever comes first
+int usbusGetPollFds(UsbusContext *ctx, struct UsbusPollFd *fds, unsigned max, unsigned *count);
+void usbusSetPollFdNotifiers(UsbusContext *ctx, UsbusPollFdAddedCallback added,
+                             UsbusPollFdRemovedCallback removed, void *userData);
+int usbusGetEventFd(UsbusContext *ctx, int *fd);
+unsigned usbusGetNextTimeout(UsbusContext *ctx, unsigned timeoutMillis);
+
+// streaming - keeps an endpoint busy, buffering data on the application's behalf
+struct UsbusStream;
+struct UsbusStream *usbusStreamIn(UsbusDevice *d, uint8_t ep, unsigned numTransfers,
+                                  unsigned transferSize, unsigned ringSize);
+struct UsbusStream *usbusStreamOut(UsbusDevice *d, uint8_t ep, unsigned bufferSize, unsigned flushMicros);
+unsigned usbusStreamWrite(struct UsbusStream *s, const uint8_t *buf, unsigned len);
+int usbusStreamFlush(struct UsbusStream *s);
+unsigned usbusStreamRead(struct UsbusStream *s, uint8_t *buf, unsigned len);
+unsigned usbusStreamReadAvailable(struct UsbusStream *s);
+unsigned usbusStreamOverruns(struct UsbusStream *s);
+int usbusStreamStatus(struct UsbusStream *s);
+void usbusStreamClose(struct UsbusStream *s);
+
+// emulated devices
+int usbusEmuAddDevice(UsbusContext *ctx, const struct UsbusEmuDeviceConfig *cfg);
+int usbusEmuAddReplay(UsbusContext *ctx, const char *path, unsigned speedup);
 
 static inline void usbusSetBulkTransferInfo(struct UsbusTransfer *t, UsbusDevice *d, uint8_t ep,
                                             uint8_t *buf, unsigned len, UsbusTransferCallback cb, void *userData)
 {
     t->device = d;
     t->endpoint = ep;
+    t->endpointHandle = 0;
     t->buffer = buf;
     t->requestedLength = len;
     t->callback = cb;
     t->userData = userData;
 }
 
+static inline void usbusSetControlTransferInfo(struct UsbusTransfer *t, UsbusDevice *d, uint8_t *buf,
+                                               uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                                               uint16_t wIndex, uint16_t wLength,
+                                               UsbusTransferCallback cb, void *userData)
+{
+    // `buf` must have room for the setup packet, followed by wLength bytes
+    buf[0] = bmRequestType;
+    buf[1] = bRequest;
+    buf[2] = (uint8_t)wValue;
+    buf[3] = (uint8_t)(wValue >> 8);
+    buf[4] = (uint8_t)wIndex;
+    buf[5] = (uint8_t)(wIndex >> 8);
+    buf[6] = (uint8_t)wLength;
+    buf[7] = (uint8_t)(wLength >> 8);
+
+    t->device = d;
+    t->endpoint = 0;
+    t->type = UsbusTransferControl;
+    t->endpointHandle = 0;
+    t->buffer = buf;
+    t->requestedLength = USBUS_CONTROL_SETUP_SIZE + wLength;
+    t->callback = cb;
+    t->userData = userData;
+}
+
+static inline int usbusTransferIsControl(const struct UsbusTransfer *t) {
+    return (t->endpoint & 0x7f) == 0;
+}
+
 static inline int usbusTransferIsIN(const struct UsbusTransfer *t) {
+    // control transfers take their direction from the setup packet
+    if (usbusTransferIsControl(t)) {
+        return t->requestedLength >= USBUS_CONTROL_SETUP_SIZE && (t->buffer[0] & 0x80);
+    }
     return (t->endpoint & 0x80);
 }
 
+static inline uint16_t usbusLE16(const uint8_t *b) {
+    return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static inline uint32_t usbusLE32(const uint8_t *b) {
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline unsigned usbusSSMaxStreams(const struct UsbusSSEndpointCompanionDescriptor *c) {
+    // bulk endpoints only - bmAttributes holds log2 of the number of streams
+    unsigned n = c->bmAttributes & 0x1f;
+    return n ? (1u << n) : 0;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -13,4 +13,33 @@
 #define USBUS_MAX_INTERFACES        32
 #endif
 
+// transfers are allocated from per-context pools, a slab at a time
+#ifndef USBUS_TRANSFER_SLAB_SIZE
+#define USBUS_TRANSFER_SLAB_SIZE    64
+#endif
+
+#ifndef USBUS_MAX_TRANSFER_SLABS
+#define USBUS_MAX_TRANSFER_SLABS    1024
+#endif
+
+// transfer trace ring, see usbusSetTracing() - must be a power of 2
+#ifndef USBUS_TRACE_RECORDS
+#define USBUS_TRACE_RECORDS         8192
+#endif
+
+// messages buffered by the async logger, see usbusSetLogMode() - must be a power of 2
+#ifndef USBUS_LOG_RECORDS
+#define USBUS_LOG_RECORDS           1024
+#endif
+
+// bytes buffered between the event thread and the capture writer, see usbusStartCapture() - must be a power of 2
+#ifndef USBUS_CAPTURE_RING_SIZE
+#define USBUS_CAPTURE_RING_SIZE     (4 * 1024 * 1024)
+#endif
+
+// bytes buffered between the event thread and the recording writer, see usbusStartRecording() - must be a power of 2
+#ifndef USBUS_RECORD_RING_SIZE
+#define USBUS_RECORD_RING_SIZE      (16 * 1024 * 1024)
+#endif
+
 #endif // USBUS_LIMITS_H
@@ -2,33 +2,219 @@
 #define USBUS_PRIVATE_H
 
 #include "usbus.h"
+#include "usbus_limits.h"
+#include "timer.h"
+#include "clock.h"
 
 #if defined(USBUS_PLATFORM_OSX)
 #include "platform/iokit.h"
 #elif defined(USBUS_PLATFORM_WIN)
 #include "platform/winusb.h"
+#elif defined(USBUS_PLATFORM_LINUX)
+#include "platform/usbfs.h"
 #endif
 
+#include "platform/emulated.h"
+
+/*
+ * Transfers are handed out from a single pool shared by all contexts. Each pooled
+ * transfer carries the per-submit state the platform needs inline, so
+ * steady state submit/complete cycles don't touch the heap.
+ */
+struct UsbusTransferPool {
+    volatile uint64_t freeList;         // (ABA tag << 32) | (index + 1) of the first free entry
+    volatile uint32_t numSlabs;
+    volatile uint32_t growLock;
+    struct UsbusTransferPriv *slabs[USBUS_MAX_TRANSFER_SLABS];
+};
+
+struct UsbusTransferPriv {
+    struct UsbusTransfer transfer;      // must be first - public transfers are cast to this
+    struct UsbusTransferPool *pool;
+    uint32_t index;                     // position within the pool
+    volatile uint32_t nextFree;         // index + 1 of the next free entry, 0 terminates
+
+    struct UsbusTransferPriv *nextCompleted;    // completion queue link, see usbusPollCompletions()
+    struct UsbusContext *completedCtx;          // whose queue it's on, if any
+    uint64_t completedAt;
+
+    struct UsbusTransferPriv *nextSubmit;       // deferred op links, see usbusSetThreadSafe()
+    struct UsbusTransferPriv *nextCancel;
+
+    struct TimerEntry timer;                    // armed while a transfer with a timeout is pending
+    uint8_t timedOut;                           // canceled on expiry, report UsbusTimeout
+    uint8_t cancelRequested;                    // for this transfer, rather than another on its pipe
+
+    uint64_t submittedAt;                       // for latency stats, see usbusGetEndpointStats()
+    uint64_t recordedAt;                        // submit time while recording, see usbusStartRecording()
+
+    union {
+        uint64_t align;
+#if defined(USBUS_PLATFORM_MAC)
+        struct IOKitTransfer iokit;
+#elif defined(USBUS_PLATFORM_WIN)
+        struct WinOverlappedTransfer winusb;
+#elif defined(USBUS_PLATFORM_LINUX)
+        struct UsbfsTransfer usbfs;
+#endif
+    } platform;
+};
+
+#if defined(_MSC_VER)
+#define USBUS_THREAD_LOCAL __declspec(thread)
+#else
+#define USBUS_THREAD_LOCAL __thread
+#endif
+
+static inline struct UsbusTransferPriv *transferPriv(struct UsbusTransfer *t) {
+    return (struct UsbusTransferPriv*)t;
+}
+
+/*
+ * Transfer lifecycle events, recorded into a fixed size ring while
+ * tracing is enabled. See usbusSetTracing().
+ */
+enum TraceEvent {
+    TraceSubmit,                        // usbusSubmitTransfer(), on the calling thread
+    TraceEnqueue,                       // handed to the platform
+    TraceSubmitFailed,
+    TraceCancel,
+    TraceTimeout,
+    TraceComplete,
+    TraceCallbackBegin,
+    TraceCallbackEnd
+};
+
+struct TraceRecord {
+    uint64_t nanos;                     // monotonicNanos(), 0 for unused records
+    const struct UsbusTransfer *transfer;
+    uint32_t length;
+    int16_t status;                     // completion status, or submit error
+    uint8_t event;
+    uint8_t endpoint;
+    uint8_t busNumber;
+    uint8_t address;
+};
+
+struct TraceRing {
+    struct TraceRecord *records;        // USBUS_TRACE_RECORDS, allocated when first enabled
+    volatile uint32_t next;             // total recorded, wraps
+    volatile uint32_t enabled;
+};
+
 struct UsbusContext {
+    const struct UsbusPlatform *platform;
     UsbusDeviceConnectedCallback connected;
     UsbusDeviceDisconnectedCallback disconnected;
+    struct UsbusMatchFilter match;      // owned copy, see usbusSetMatchFilter()
 
 #if defined(USBUS_PLATFORM_OSX)
     struct IOKitContext iokit;
 #elif defined(USBUS_PLATFORM_WIN)
     struct WinUSBContext winusb;
+#elif defined(USBUS_PLATFORM_LINUX)
+    struct UsbfsContext usbfs;
 #endif
+    struct EmuContext emu;
+
+    // completed transfers without a callback, awaiting usbusPollCompletions()
+    struct UsbusTransferPriv *completedHead;
+    struct UsbusTransferPriv *completedTail;
+
+    // descriptors the platform waits on, see usbusGetPollFds()
+    struct UsbusPollFd *pollFds;
+    unsigned numPollFds;
+    unsigned pollFdCapacity;
+    UsbusPollFdAddedCallback pollFdAdded;
+    UsbusPollFdRemovedCallback pollFdRemoved;
+    void *pollFdUserData;
+
+    // thread-safe mode - submit and cancel ops from other threads, drained by the event thread
+    uint8_t threadSafe;
+    void *volatile submitQueue;
+    void *volatile cancelQueue;
+
+    struct UsbusStream *outStreams;     // serviced from usbusProcessEvents()
+
+    struct TimerWheel timers;           // transfer timeouts, see UsbusTransfer::timeout
+
+    struct TraceRing trace;
+    struct Capture *capture;            // see usbusStartCapture()
+    struct Recorder *recorder;          // see usbusStartRecording()
+};
+
+/*
+ * Endpoint routing, resolved once by usbusOpenEndpoint().
+ */
+struct UsbusEndpoint {
+    UsbusDevice *device;
+    uint8_t address;
+    uint8_t interfaceIndex;             // bInterfaceNumber, unless the platform remaps it in openEndpoint
+    uint8_t pipeRef;                    // platform specific pipe index, where applicable
+    enum UsbusTransferType type;
+    uint16_t maxPacketSize;
+};
+
+/*
+ * Configuration descriptors, parsed once at usbusOpen() into flat arrays
+ * allocated as a single block: configs index into interfaces (one entry
+ * per altsetting), which index into endpoints.
+ */
+struct DescriptorConfig {
+    struct UsbusConfigDescriptor desc;
+    const uint8_t *raw;                 // complete descriptor set, within DescriptorTree::raw
+    unsigned rawLen;
+    unsigned firstInterface;
+    unsigned numInterfaces;
+};
+
+struct DescriptorInterface {
+    struct UsbusInterfaceDescriptor desc;
+    unsigned firstEndpoint;
+    unsigned numEndpoints;
+};
+
+struct DescriptorTree {
+    unsigned numConfigs;
+    unsigned activeConfig;              // index of the current configuration
+    struct DescriptorConfig *configs;
+    struct DescriptorInterface *interfaces;
+    struct UsbusEndpointDescriptor *endpoints;
+    uint8_t *raw;
+    uint8_t *bos;                       // read on first use, see usbusBosIterBegin()
+    unsigned bosLen;
+    uint8_t bosFetched;
+};
+
+/*
+ * String descriptors, as read from the device. Kept for the
+ * life of the UsbusDevice, across opens.
+ */
+struct StringCacheEntry {
+    uint16_t lang;
+    uint8_t index;
+    uint8_t *desc;                      // complete descriptor, desc[0] is its length
+};
+
+struct StringCache {
+    struct StringCacheEntry *entries;
+    unsigned numEntries;
+    unsigned capacity;
 };
 
 struct UsbusDevice {
     struct UsbusContext *ctx;
 
     uint8_t isOpen;
+    struct DescriptorTree *descriptors;
+    struct StringCache strings;
+    struct UsbusEndpointStats **stats;  // by endpointSlot(), allocated as endpoints are used
 
     struct UsbusDeviceDescriptor descriptor;
     enum UsbusSpeed speed;
     uint8_t address;
     uint8_t busNumber;
+    uint32_t recordTag;                 // (recording session << 16) | number within its log + 1
 
     // list of transfers
 
@@ -39,7 +225,10 @@ struct UsbusDevice {
     struct IOKitDevice iokit;
 #elif defined(USBUS_PLATFORM_WIN)
     struct WinUSBDevice winusb;
+#elif defined(USBUS_PLATFORM_LINUX)
+    struct UsbfsDevice usbfs;
 #endif
+    struct EmuDevice emu;
 };
 
 /*
@@ -72,11 +261,53 @@ struct UsbusPlatform {
 
     int (*readSync)(UsbusDevice *d, uint8_t ep, uint8_t *buf, unsigned len, unsigned *written);
     int (*writeSync)(UsbusDevice *d, uint8_t ep, const uint8_t *buf, unsigned len, unsigned *written);
+
+    // optional - platforms that can avoid copying transfer data provide their own buffers
+    uint8_t *(*allocateBuffer)(UsbusDevice *d, unsigned len);
+    void (*freeBuffer)(UsbusDevice *d, uint8_t *buf);
+
+    // optional - submit several transfers for the same device, filling in a result for each
+    int (*submitTransfers)(struct UsbusTransfer **ts, unsigned n, int *results);
+
+    // optional - a single descriptor that's readable whenever processEvents() has work to do
+    int (*getEventFd)(UsbusContext *ctx, int *fd);
+
+    // optional - interrupt a processEvents() call that's blocked on another thread
+    void (*wakeup)(UsbusContext *ctx);
+
+    // optional - resolve any platform specific routing for an endpoint handle
+    int (*openEndpoint)(UsbusDevice *d, struct UsbusEndpoint *e);
+
+    // standard GET_DESCRIPTOR request, served from the OS's cache where possible
+    int (*getDescriptor)(UsbusDevice *d, uint8_t type, uint8_t index, uint16_t lang,
+                         uint8_t *buf, unsigned len, unsigned *transferred);
+
+    // optional - release platform state that lives as long as the UsbusDevice, see usbusDispose()
+    void (*dispose)(UsbusDevice *d);
 };
 
 extern const struct UsbusPlatform *const gPlatform;
 extern struct UsbusContext defaultCtxt;
 
+/*
+ * Each context may be bound to a different platform (see usbusSetPlatform()),
+ * and devices always route through the platform of the context that found them.
+ */
+static inline const struct UsbusPlatform *ctxPlatform(UsbusContext *ctx) {
+    return ctx->platform ? ctx->platform : gPlatform;
+}
+
+static inline const struct UsbusPlatform *devPlatform(UsbusDevice *d) {
+    return d->ctx->platform;
+}
+
+// 16 endpoint numbers x 2 directions
+#define USBUS_ENDPOINT_SLOTS 32
+
+static inline unsigned endpointSlot(uint8_t ep) {
+    return (ep & 0x0f) | ((ep & 0x80) >> 3);
+}
+
 /**************************************************************
  * Internal Routines/Helpers
  **************************************************************/
@@ -84,4 +315,76 @@ extern struct UsbusContext defaultCtxt;
 UsbusDevice *allocateDevice();
 void dispatchConnectedDevice(UsbusContext *ctx, UsbusDevice *d);
 
+int matchDevice(UsbusContext *ctx, const struct UsbusDeviceDescriptor *desc, uint8_t busNumber);
+int matchIds(UsbusContext *ctx, uint16_t idVendor, uint16_t idProduct);
+int matchSerial(UsbusContext *ctx, const char *serial);
+int matchSerialDescriptor(UsbusContext *ctx, const uint8_t *desc);
+static inline int matchNeedsSerial(UsbusContext *ctx) {
+    return ctx->match.serialPrefix != 0;
+}
+
+struct UsbusTransferPriv *transferPoolAlloc(struct UsbusTransferPool *pool);
+void transferPoolFree(struct UsbusTransferPool *pool, struct UsbusTransferPriv *tp);
+int transferPoolOwns(struct UsbusTransferPool *pool, const struct UsbusTransfer *t);
+
+void dispatchTransferCompletion(struct UsbusTransfer *t, enum UsbusStatus status);
+
+/*
+ * Endpoint stats, compiled out with USBUS_DISABLE_STATS.
+ */
+#if defined(USBUS_DISABLE_STATS)
+static inline void statsSubmitted(struct UsbusTransfer *t) { (void)t; }
+static inline void statsSubmitFailed(struct UsbusTransfer *t) { (void)t; }
+static inline void statsCompleted(struct UsbusTransfer *t, enum UsbusStatus status) { (void)t; (void)status; }
+#else
+void statsSubmitted(struct UsbusTransfer *t);
+void statsSubmitFailed(struct UsbusTransfer *t);
+void statsCompleted(struct UsbusTransfer *t, enum UsbusStatus status);
+#endif
+void statsDeviceClosed(UsbusDevice *d);
+
+void captureRecord(struct UsbusTransfer *t, char type, int status);
+static inline void captureTransfer(struct UsbusTransfer *t, char type, int status) {
+    if (t->device->ctx->capture) {
+        captureRecord(t, type, status);
+    }
+}
+
+void recorderWrite(struct UsbusTransfer *t, enum UsbusStatus status);
+static inline void recordSubmitted(struct UsbusTransfer *t) {
+    if (t->device->ctx->recorder) {
+        transferPriv(t)->recordedAt = monotonicNanos();
+    }
+}
+static inline void recordCompleted(struct UsbusTransfer *t, enum UsbusStatus status) {
+    if (t->device->ctx->recorder && transferPriv(t)->recordedAt) {
+        recorderWrite(t, status);
+    }
+}
+
+uint32_t traceRecord(struct UsbusTransfer *t, enum TraceEvent event, int status);
+void traceCallbackEnd(UsbusContext *ctx, uint32_t begin);
+static inline void traceTransfer(struct UsbusTransfer *t, enum TraceEvent event, int status) {
+    if (t->device->ctx->trace.enabled) {
+        traceRecord(t, event, status);
+    }
+}
+
+void freeEndpointStats(UsbusDevice *d);
+void disarmDeviceTimers(UsbusDevice *d);
+
+int buildDescriptorTree(UsbusDevice *d);
+void freeDescriptorTree(UsbusDevice *d);
+void setActiveConfig(UsbusDevice *d, uint8_t configValue);
+void freeStringCache(UsbusDevice *d);
+unsigned utf16ToUtf8(const uint8_t *desc, char *buf, unsigned len);
+int findEndpointDescriptor(UsbusDevice *d, uint8_t address, struct UsbusEndpointDescriptor *desc, unsigned *intfIndex);
+int interfacePosition(UsbusDevice *d, unsigned number, unsigned *position);
+
+unsigned serviceStreams(UsbusContext *ctx, unsigned timeoutMillis);
+unsigned streamWaitMillis(UsbusContext *ctx, unsigned timeoutMillis);
+
+int addPollFd(UsbusContext *ctx, int fd, short events);
+void removePollFd(UsbusContext *ctx, int fd);
+
 #endif // USBUS_PRIVATE_H
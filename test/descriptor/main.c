@@ -0,0 +1,135 @@
+#include "usbus.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Endpoint lookup across alternate settings, against an emulated device
+ * shaped like a typical audio/video function: interface 0 has a bulk OUT
+ * endpoint in its default altsetting, and an isochronous IN endpoint that
+ * only exists in altsetting 1. Both must be reachable through
+ * usbusOpenEndpoint(), and transfers on them must complete.
+ *
+ * Exits non-zero on failure.
+ */
+
+#define ISO_PACKET  1024
+
+static const uint8_t configDescriptors[] = {
+    // configuration 1, one interface
+    0x09, 0x02, 48, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+    // interface 0, altsetting 0 - bulk OUT only
+    0x09, 0x04, 0x00, 0x00, 0x01, 0xff, 0x00, 0x00, 0x00,
+    0x07, 0x05, 0x02, 0x02, 0x00, 0x02, 0x00,
+    // interface 0, altsetting 1 - the same bulk OUT, plus isochronous IN
+    0x09, 0x04, 0x00, 0x01, 0x02, 0xff, 0x00, 0x00, 0x00,
+    0x07, 0x05, 0x02, 0x02, 0x00, 0x02, 0x00,
+    0x07, 0x05, 0x81, 0x05, ISO_PACKET & 0xff, ISO_PACKET >> 8, 0x01,
+};
+
+static void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose);
+static void onComplete(struct UsbusTransfer *t, enum UsbusStatus s);
+static int checkEndpoint(uint8_t ep, int isIn);
+
+static UsbusDevice *gDevice = 0;
+static unsigned gFailures = 0;
+static unsigned gCompleted = 0;
+static enum UsbusStatus gStatus;
+
+int main(int argc, char **argv)
+{
+    (void)argv;
+
+    if (argc > 1) {
+        fprintf(stderr, "usage: descriptortest\n");
+        return -1;
+    }
+
+    static const struct UsbusEmuEndpoint endpoints[] = {
+        { 0x02, UsbusTransferBulk, 512, UsbusEmuSink, 0 },
+        { 0x81, UsbusTransferIsochronous, ISO_PACKET, UsbusEmuSource, 0 },
+    };
+
+    struct UsbusEmuDeviceConfig cfg;
+    memset(&cfg, 0, sizeof cfg);
+    cfg.descriptor.idVendor = 0x1209;
+    cfg.descriptor.idProduct = 0x0001;
+    cfg.speed = UsbusHighSpeed;
+    cfg.configDescriptors = configDescriptors;
+    cfg.configDescriptorsLen = sizeof configDescriptors;
+    cfg.endpoints = endpoints;
+    cfg.numEndpoints = sizeof endpoints / sizeof endpoints[0];
+
+    usbusSetPlatform(0, UsbusPlatformEmulated);
+    usbusEmuAddDevice(0, &cfg);
+    usbusListen(0, onDeviceConnected, 0);
+
+    if (!gDevice || usbusOpenInterface(gDevice, 0) != UsbusOK) {
+        fprintf(stderr, "FAIL: couldn't open the emulated device\n");
+        return -1;
+    }
+
+    checkEndpoint(0x02, 0);     // default altsetting
+    checkEndpoint(0x81, 1);     // alternate altsetting only
+
+    if (usbusOpenEndpoint(gDevice, 0x83)) {
+        fprintf(stderr, "FAIL: opened endpoint 0x83, which isn't in any altsetting\n");
+        gFailures++;
+    }
+
+    usbusCloseInterface(gDevice, 0);
+    usbusClose(gDevice);
+
+    printf("%s\n", gFailures ? "FAIL" : "PASS");
+    return gFailures ? -1 : 0;
+}
+
+void onDeviceConnected(struct UsbusDevice *d, uint8_t* dispose)
+{
+    if (!gDevice && usbusOpen(d) == UsbusOK) {
+        gDevice = d;
+        *dispose = 0;
+    }
+}
+
+void onComplete(struct UsbusTransfer *t, enum UsbusStatus s)
+{
+    (void)t;
+    gStatus = s;
+    gCompleted++;
+}
+
+static int checkEndpoint(uint8_t ep, int isIn)
+{
+    /*
+     * Open `ep` by address, and run one transfer through the handle.
+     */
+
+    struct UsbusEndpoint *e = usbusOpenEndpoint(gDevice, ep);
+    if (!e) {
+        fprintf(stderr, "FAIL: couldn't open endpoint 0x%02x\n", ep);
+        gFailures++;
+        return -1;
+    }
+
+    static uint8_t buf[ISO_PACKET];
+    struct UsbusTransfer *t = usbusAllocateTransfer();
+    usbusSetEndpointTransferInfo(t, e, buf, isIn ? ISO_PACKET : 64, onComplete, 0);
+
+    unsigned expected = gCompleted + 1;
+    int r = usbusSubmitTransfer(t);
+    unsigned waits = 0;
+    while (r == UsbusOK && gCompleted < expected && waits++ < 100) {
+        usbusProcessEvents(0, 10);
+    }
+
+    int ok = r == UsbusOK && gCompleted == expected && gStatus == UsbusComplete;
+    if (!ok) {
+        fprintf(stderr, "FAIL: transfer on endpoint 0x%02x: submit %d, status %d\n", ep, r, gStatus);
+        gFailures++;
+    }
+
+    usbusReleaseTransfer(t);
+    usbusCloseEndpoint(e);
+    return ok ? 0 : -1;
+}